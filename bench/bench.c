@@ -0,0 +1,374 @@
+// Microbenchmarks of the threadpool and futures
+// Usage: asyncc_bench [max_threads [benchmark_name]]
+// Every benchmark is run for each configuration (scheduler, pinned or not) and each thread count 1..max_threads (default: number of CPUs),
+// with fixed problem sizes, so that numbers from different builds can be compared directly
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "future.h"
+#include "channel.h"
+
+#define DEFER_TASKS 200000
+#define DEFER_PRODUCERS 4
+#define ROUND_TRIPS 20000
+#define CHAIN_DEPTH 10000
+#define CHAIN_REPEATS 20
+#define FANOUT_CELLS 100000
+#define FANOUT_REPEATS 10
+#define CHANNEL_ITEMS 200000
+#define CHANNEL_CAPACITY 256
+#define CHANNEL_BATCH 32
+
+// Monotonic clock in nanoseconds
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Prints one line of results; sorts `latencies`
+static void report(const char *name, const char *config, size_t threads, size_t ops, uint64_t elapsed_ns,
+                   uint64_t *latencies, size_t latencies_count) {
+    qsort(latencies, latencies_count, sizeof(uint64_t), compare_u64);
+    uint64_t p50 = latencies[latencies_count / 2];
+    uint64_t p90 = latencies[latencies_count * 9 / 10];
+    uint64_t p99 = latencies[latencies_count * 99 / 100];
+    uint64_t max = latencies[latencies_count - 1];
+
+    printf("%-16s %-10s %7zu %14.0f %12lu %12lu %12lu %12lu\n", name, config, threads,
+           (double) ops * 1e9 / (double) elapsed_ns, p50, p90, p99, max);
+    fflush(stdout);
+}
+
+// Counts down finished tasks; `wait` returns once all of them are done
+typedef struct countdown {
+    atomic_size_t remaining;
+    sem_t done;
+} countdown_t;
+
+static void countdown_init(countdown_t *countdown, size_t count) {
+    atomic_init(&countdown->remaining, count);
+    sem_init(&countdown->done, 0, 0);
+}
+
+static void countdown_tick(countdown_t *countdown) {
+    if (atomic_fetch_sub(&countdown->remaining, 1) == 1) {
+        sem_post(&countdown->done);
+    }
+}
+
+static void countdown_wait(countdown_t *countdown) {
+    sem_wait(&countdown->done);
+    sem_destroy(&countdown->done);
+}
+
+// Shared state of the `defer` benchmarks: latency of task i is measured from its submission to its start
+typedef struct defer_bench {
+    thread_pool_t *pool;
+    countdown_t countdown;
+    uint64_t *submitted;
+    uint64_t *latencies;
+    size_t next_producer;
+    size_t producers;
+} defer_bench_t;
+
+static defer_bench_t defer_state;
+
+static void empty_task(void *arg __attribute__((unused)), size_t index) {
+    defer_state.latencies[index] = now_ns() - defer_state.submitted[index];
+    countdown_tick(&defer_state.countdown);
+}
+
+static void *defer_producer(void *producer_) {
+    size_t producer = (size_t) producer_;
+    for (size_t i = producer; i < DEFER_TASKS; i += defer_state.producers) {
+        defer_state.submitted[i] = now_ns();
+        defer(defer_state.pool, (runnable_t) {.function = empty_task, .arg = NULL, .argsz = i});
+    }
+    return NULL;
+}
+
+static void bench_defer_producers(thread_pool_t *pool, const char *config, size_t threads, size_t producers,
+                                  const char *name) {
+    defer_state.pool = pool;
+    defer_state.producers = producers;
+    defer_state.submitted = calloc(DEFER_TASKS, sizeof(uint64_t));
+    defer_state.latencies = calloc(DEFER_TASKS, sizeof(uint64_t));
+    countdown_init(&defer_state.countdown, DEFER_TASKS);
+
+    pthread_t producer_threads[DEFER_PRODUCERS];
+    uint64_t start = now_ns();
+    for (size_t p = 0; p < producers; p++) {
+        pthread_create(&producer_threads[p], NULL, defer_producer, (void *) p);
+    }
+    for (size_t p = 0; p < producers; p++) {
+        pthread_join(producer_threads[p], NULL);
+    }
+    countdown_wait(&defer_state.countdown);
+    uint64_t elapsed = now_ns() - start;
+
+    report(name, config, threads, DEFER_TASKS, elapsed, defer_state.latencies, DEFER_TASKS);
+    free(defer_state.submitted);
+    free(defer_state.latencies);
+}
+
+// Throughput of empty tasks deferred by a single producer
+static void bench_defer(thread_pool_t *pool, const char *config, size_t threads) {
+    bench_defer_producers(pool, config, threads, 1, "defer");
+}
+
+// Throughput of empty tasks deferred by DEFER_PRODUCERS producers at once
+static void bench_defer_mp(thread_pool_t *pool, const char *config, size_t threads) {
+    bench_defer_producers(pool, config, threads, DEFER_PRODUCERS, "defer_mp");
+}
+
+static void *identity(void *arg, size_t argsz, size_t *res_size) {
+    *res_size = argsz;
+    return arg;
+}
+
+// Latency of `async` immediately followed by `await`
+static void bench_round_trip(thread_pool_t *pool, const char *config, size_t threads) {
+    uint64_t *latencies = calloc(ROUND_TRIPS, sizeof(uint64_t));
+    future_t future;
+    int value = 0;
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < ROUND_TRIPS; i++) {
+        uint64_t op_start = now_ns();
+        async(pool, &future, (callable_t) {.function = identity, .arg = &value, .argsz = sizeof(int)});
+        await(&future);
+        future_destroy(&future);
+        latencies[i] = now_ns() - op_start;
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    report("async_await", config, threads, ROUND_TRIPS, elapsed, latencies, ROUND_TRIPS);
+    free(latencies);
+}
+
+static void *increment(void *arg, size_t argsz, size_t *res_size) {
+    ++*(long long *) arg;
+    *res_size = argsz;
+    return arg;
+}
+
+// `map` chains like the ones built by silnia; latency is measured per chain
+static void bench_map_chain(thread_pool_t *pool, const char *config, size_t threads) {
+    uint64_t latencies[CHAIN_REPEATS];
+    future_t *futures = calloc(CHAIN_DEPTH + 1, sizeof(future_t));
+
+    uint64_t start = now_ns();
+    for (size_t r = 0; r < CHAIN_REPEATS; r++) {
+        uint64_t chain_start = now_ns();
+        long long acc = 0;
+        async(pool, &futures[0], (callable_t) {.function = increment, .arg = &acc, .argsz = sizeof(acc)});
+        for (size_t i = 0; i < CHAIN_DEPTH; i++) {
+            map(pool, &futures[i + 1], &futures[i], increment);
+        }
+        await(&futures[CHAIN_DEPTH]);
+        for (size_t i = 0; i <= CHAIN_DEPTH; i++) {
+            future_destroy(&futures[i]);
+        }
+        latencies[r] = now_ns() - chain_start;
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    report("map_chain", config, threads, CHAIN_REPEATS * (CHAIN_DEPTH + 1), elapsed, latencies, CHAIN_REPEATS);
+    free(futures);
+}
+
+typedef struct fanout_cell {
+    int value;
+    int res;
+    countdown_t *countdown;
+} fanout_cell_t;
+
+static void fanout_task(void *arg, size_t argsz __attribute__((unused))) {
+    fanout_cell_t *cell = (fanout_cell_t *) arg;
+    cell->res = cell->value * cell->value;
+    countdown_tick(cell->countdown);
+}
+
+// Wide fan-outs of tiny tasks like the ones made by macierz; latency is measured per fan-out
+static void bench_fanout(thread_pool_t *pool, const char *config, size_t threads) {
+    uint64_t latencies[FANOUT_REPEATS];
+    fanout_cell_t *cells = calloc(FANOUT_CELLS, sizeof(fanout_cell_t));
+    runnable_t *jobs = calloc(FANOUT_CELLS, sizeof(runnable_t));
+    countdown_t countdown;
+
+    uint64_t start = now_ns();
+    for (size_t r = 0; r < FANOUT_REPEATS; r++) {
+        uint64_t fanout_start = now_ns();
+        countdown_init(&countdown, FANOUT_CELLS);
+        for (size_t i = 0; i < FANOUT_CELLS; i++) {
+            cells[i].value = (int) i;
+            cells[i].countdown = &countdown;
+            jobs[i] = (runnable_t) {.function = fanout_task, .arg = &cells[i], .argsz = sizeof(fanout_cell_t)};
+        }
+        defer_batch(pool, jobs, FANOUT_CELLS);
+        countdown_wait(&countdown);
+        latencies[r] = now_ns() - fanout_start;
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    report("fanout", config, threads, FANOUT_REPEATS * FANOUT_CELLS, elapsed, latencies, FANOUT_REPEATS);
+    free(jobs);
+    free(cells);
+}
+
+// Two-stage pipeline over channels: a producer thread sends items into `input`, one stage job per worker
+// moves them in batches to `output`, and the main thread collects them
+typedef struct channel_bench {
+    channel_t input;
+    channel_t output;
+    uint64_t *sent; // When item i was sent; items are pointers into this array
+    atomic_size_t stages_left;
+} channel_bench_t;
+
+static channel_bench_t channel_state;
+
+static void *channel_producer(void *arg __attribute__((unused))) {
+    for (size_t i = 0; i < CHANNEL_ITEMS; i++) {
+        channel_state.sent[i] = now_ns();
+        channel_send(&channel_state.input, &channel_state.sent[i]);
+    }
+    channel_close(&channel_state.input);
+    return NULL;
+}
+
+static void channel_stage(void *arg __attribute__((unused)), size_t argsz __attribute__((unused))) {
+    void *items[CHANNEL_BATCH];
+    size_t count;
+    while (channel_recv_batch(&channel_state.input, items, CHANNEL_BATCH, &count) == 0) {
+        for (size_t i = 0; i < count; i++) {
+            channel_send(&channel_state.output, items[i]);
+        }
+    }
+    if (atomic_fetch_sub(&channel_state.stages_left, 1) == 1) {
+        channel_close(&channel_state.output);
+    }
+}
+
+// Stage-to-stage throughput of channels; latency is measured per item, from its send to its collection
+static void bench_channel(thread_pool_t *pool, const char *config, size_t threads) {
+    uint64_t *latencies = calloc(CHANNEL_ITEMS, sizeof(uint64_t));
+    channel_state.sent = calloc(CHANNEL_ITEMS, sizeof(uint64_t));
+    channel_init(&channel_state.input, CHANNEL_CAPACITY);
+    channel_init(&channel_state.output, CHANNEL_CAPACITY);
+    atomic_init(&channel_state.stages_left, threads);
+
+    uint64_t start = now_ns();
+    pthread_t producer;
+    pthread_create(&producer, NULL, channel_producer, NULL);
+    for (size_t i = 0; i < threads; i++) {
+        defer(pool, (runnable_t) {.function = channel_stage, .arg = NULL, .argsz = 0});
+    }
+    size_t received = 0;
+    void *item;
+    while (channel_recv(&channel_state.output, &item) == 0 && received < CHANNEL_ITEMS) {
+        latencies[received++] = now_ns() - *(uint64_t *) item;
+    }
+    uint64_t elapsed = now_ns() - start;
+    pthread_join(producer, NULL);
+
+    report("channel", config, threads, CHANNEL_ITEMS, elapsed, latencies, received);
+    channel_destroy(&channel_state.input);
+    channel_destroy(&channel_state.output);
+    free(channel_state.sent);
+    free(latencies);
+}
+
+typedef struct benchmark {
+    const char *name;
+    void (*run)(thread_pool_t *pool, const char *config, size_t threads);
+} benchmark_t;
+
+static const benchmark_t benchmarks[] = {
+        {"defer", bench_defer},
+        {"defer_mp", bench_defer_mp},
+        {"async_await", bench_round_trip},
+        {"map_chain", bench_map_chain},
+        {"fanout", bench_fanout},
+        {"channel", bench_channel},
+};
+
+// Pool configurations every benchmark is run with
+typedef struct configuration {
+    const char *name;
+    scheduler_mode_t scheduler;
+    affinity_mode_t affinity;
+    bool numa_queues;
+    bool spin; // Idle workers spin and yield before parking (the default idle policy)
+} configuration_t;
+
+// Pinned configurations put every worker on its own CPU (spread over the NUMA nodes) with per-node queues;
+// parking ones put idle workers to sleep right away
+static const configuration_t configurations[] = {
+        {"shared", SCHEDULER_SHARED_QUEUE, AFFINITY_NONE, false, true},
+        {"stealing", SCHEDULER_WORK_STEALING, AFFINITY_NONE, false, true},
+        {"pinned", SCHEDULER_SHARED_QUEUE, AFFINITY_PER_CPU, true, true},
+        {"pin-steal", SCHEDULER_WORK_STEALING, AFFINITY_PER_CPU, true, true},
+        {"parking", SCHEDULER_SHARED_QUEUE, AFFINITY_NONE, false, false},
+        {"park-steal", SCHEDULER_WORK_STEALING, AFFINITY_NONE, false, false},
+};
+
+int main(int argc, char *argv[]) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t max_threads = argc > 1 ? strtoul(argv[1], NULL, 10) : (size_t) (cpus > 0 ? cpus : 1);
+    const char *filter = argc > 2 ? argv[2] : NULL;
+    if (max_threads == 0) {
+        fprintf(stderr, "Usage: %s [max_threads [benchmark_name]]\n", argv[0]);
+        return 1;
+    }
+
+#ifndef __OPTIMIZE__
+    printf("# warning: built without optimisation; configure with -DCMAKE_BUILD_TYPE=Release\n");
+#endif
+    printf("# latencies in ns; defer: submit to start, others: per operation\n");
+    printf("%-16s %-10s %7s %14s %12s %12s %12s %12s\n", "benchmark", "config", "threads", "ops/s",
+           "p50", "p90", "p99", "max");
+
+    for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+        if (filter != NULL && strcmp(filter, benchmarks[b].name) != 0) {
+            continue;
+        }
+        for (size_t c = 0; c < sizeof(configurations) / sizeof(configurations[0]); c++) {
+            for (size_t threads = 1; threads <= max_threads; threads++) {
+                thread_pool_options_t options;
+                thread_pool_options_init(&options);
+                options.scheduler = configurations[c].scheduler;
+                options.affinity = configurations[c].affinity;
+                options.numa_queues = configurations[c].numa_queues;
+                if (!configurations[c].spin) {
+                    options.idle_spins = 0;
+                    options.idle_yields = 0;
+                }
+
+                thread_pool_t pool;
+                if (thread_pool_init_with_options(&pool, threads, &options) != 0) {
+                    fprintf(stderr, "Could not create a pool of %zu threads\n", threads);
+                    return 1;
+                }
+                benchmarks[b].run(&pool, configurations[c].name, threads);
+                thread_pool_destroy(&pool);
+            }
+        }
+    }
+
+    return 0;
+}
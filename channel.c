@@ -0,0 +1,336 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "channel.h"
+#include "futex.h"
+#include "fiber.h"
+
+// A worker waiting on a channel with nothing to run sleeps at most this long before looking for jobs again,
+// because producers wake only parked workers
+#define CHANNEL_HELP_SLEEP_NS 1000000u // 1 ms
+
+// Initialises empty channel of at least `capacity` items in memory pointed to by `channel`
+// Returns error code, or 0 on success
+int channel_init(channel_t *channel, size_t capacity) {
+    if (channel == NULL) {
+        return NULL_POINTER_ERROR;
+    }
+
+    size_t slots = 1;
+    while (slots < capacity) {
+        slots *= 2;
+    }
+    // The ring is cache-aligned, so plain `malloc` is not enough
+    if (posix_memalign((void **) &channel->cells, 64, slots * sizeof(channel_cell_t)) != 0) {
+        return MEMORY_ALLOCATION_ERROR;
+    }
+    for (size_t i = 0; i < slots; i++) {
+        atomic_init(&channel->cells[i].sequence, i);
+        channel->cells[i].item = NULL;
+    }
+    channel->mask = slots - 1;
+
+    atomic_init(&channel->tail, 0);
+    atomic_init(&channel->head, 0);
+    atomic_init(&channel->items_seq, 0);
+    atomic_init(&channel->room_seq, 0);
+    atomic_init(&channel->receivers_sleeping, 0);
+    atomic_init(&channel->senders_sleeping, 0);
+    atomic_init(&channel->receivers_pending, 0);
+    atomic_init(&channel->closed, false);
+    channel->pending = NULL;
+    channel->last_pending = NULL;
+
+    int err = pthread_mutex_init(&channel->mutex, NULL);
+    if (err != 0) {
+        free(channel->cells);
+    }
+    return err;
+}
+
+// Destroys `channel`
+void channel_destroy(channel_t *channel) {
+    silent_on_err(pthread_mutex_destroy(&channel->mutex));
+    free(channel->cells); // allocation in `channel_init`
+}
+
+// Claims at most `max` items that are ready in a row at the head of the ring, with a single CAS,
+// and moves them to `items`
+// Returns their number (0 if the channel is empty)
+static size_t pop(channel_t *channel, void **items, size_t max) {
+    size_t pos = atomic_load_explicit(&channel->head, memory_order_relaxed);
+    size_t ready;
+    for (;;) {
+        ready = 0;
+        while (ready < max) {
+            channel_cell_t *cell = &channel->cells[(pos + ready) & channel->mask];
+            if (atomic_load_explicit(&cell->sequence, memory_order_acquire) != pos + ready + 1) {
+                break;
+            }
+            ready++;
+        }
+
+        if (ready > 0) {
+            if (atomic_compare_exchange_weak_explicit(&channel->head, &pos, pos + ready,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+            continue;
+        }
+        // Either the channel is empty, or another receiver has taken the item at `pos` already
+        size_t head = atomic_load_explicit(&channel->head, memory_order_relaxed);
+        if (head == pos) {
+            return 0;
+        }
+        pos = head;
+    }
+
+    // The cells are ours now; each is handed back to the sender of the position one lap later
+    for (size_t i = 0; i < ready; i++) {
+        channel_cell_t *cell = &channel->cells[(pos + i) & channel->mask];
+        items[i] = cell->item;
+        atomic_store_explicit(&cell->sequence, pos + i + channel->mask + 1, memory_order_release);
+    }
+
+    // Pairs with the fence of a sender that is about to sleep: either it sees the room, or we see it sleeping
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&channel->senders_sleeping, memory_order_relaxed) > 0) {
+        atomic_fetch_add(&channel->room_seq, 1);
+        futex_wake(&channel->room_seq, ready < INT_MAX ? (int) ready : INT_MAX);
+    }
+    return ready;
+}
+
+// Returns the Future linked on the list of pending ones by its `continuation`, or NULL
+static future_t *linked_future(continuation_t *link) {
+    return link != NULL ? (future_t *) ((char *) link - offsetof(future_t, continuation)) : NULL;
+}
+
+// Hands items to pending Futures of `channel_recv_future`, oldest first, as long as there are both;
+// once the channel is closed and empty, cancels the rest of them
+static void serve_pending(channel_t *channel) {
+    continuation_t *served = NULL;
+    continuation_t **last_served = &served;
+    silent_on_err(pthread_mutex_lock(&channel->mutex));
+    while (channel->pending != NULL) {
+        future_t *future = channel->pending;
+        void *item;
+        if (pop(channel, &item, 1) == 1) {
+            future->res = item;
+        } else if (atomic_load(&channel->closed)) {
+            future->res = NULL;
+            atomic_fetch_or_explicit(&future->state, FUTURE_CANCELLED, memory_order_relaxed);
+        } else {
+            break;
+        }
+        channel->pending = linked_future(future->continuation.next);
+        atomic_fetch_sub_explicit(&channel->receivers_pending, 1, memory_order_relaxed);
+        future->continuation.next = NULL;
+        *last_served = &future->continuation;
+        last_served = &future->continuation.next;
+    }
+    if (channel->pending == NULL) {
+        channel->last_pending = NULL;
+    }
+    silent_on_err(pthread_mutex_unlock(&channel->mutex));
+
+    // Continuations of the Futures may send or receive again, so they run without the mutex
+    while (served != NULL) {
+        future_t *future = linked_future(served);
+        served = served->next;
+        future_complete(future);
+    }
+}
+
+// Sends `item` if there's room, without waiting
+// Returns error code (QUEUE_FULL_ERROR if the channel is full, CLOSED_CHANNEL_ERROR if it's closed),
+// or 0 on success
+int channel_try_send(channel_t *channel, void *item) {
+    if (channel == NULL || item == NULL) {
+        return NULL_POINTER_ERROR;
+    } else if (atomic_load_explicit(&channel->closed, memory_order_relaxed)) {
+        return CLOSED_CHANNEL_ERROR;
+    }
+
+    size_t pos = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+    channel_cell_t *cell;
+    for (;;) {
+        cell = &channel->cells[pos & channel->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&channel->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The receiver of the position one lap earlier hasn't taken its item yet
+            return QUEUE_FULL_ERROR;
+        } else {
+            pos = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+        }
+    }
+    cell->item = item;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+
+    // Pairs with the fence of a receiver that is about to sleep or wait through a Future: either it sees
+    // the item, or we see it waiting
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&channel->receivers_pending, memory_order_relaxed) > 0) {
+        serve_pending(channel);
+    }
+    if (atomic_load_explicit(&channel->receivers_sleeping, memory_order_relaxed) > 0) {
+        atomic_fetch_add(&channel->items_seq, 1);
+        futex_wake(&channel->items_seq, 1);
+    }
+    return 0;
+}
+
+// Waits until `*word` of a channel is no longer `seq`, or a while; a worker of `pool` runs a job instead
+// if it finds one, so that the stage that would wake it up can make progress
+static void wait_on(_Atomic uint32_t *word, uint32_t seq, thread_pool_t *pool) {
+    if (pool == NULL) {
+        futex_wait(word, seq);
+        return;
+    } else if (thread_pool_help(pool)) {
+        return;
+    }
+    uint64_t at_ns = stats_now_ns() + CHANNEL_HELP_SLEEP_NS;
+    struct timespec deadline = {.tv_sec = (time_t) (at_ns / 1000000000u),
+                                .tv_nsec = (long) (at_ns % 1000000000u)};
+    futex_wait_until(word, seq, &deadline);
+}
+
+// Sends `item`, waiting for room if the channel is full
+// Returns error code (CLOSED_CHANNEL_ERROR if the channel is or gets closed), or 0 on success
+int channel_send(channel_t *channel, void *item) {
+    int err = channel_try_send(channel, item);
+    if (err != QUEUE_FULL_ERROR) {
+        return err;
+    }
+
+    // Jobs run meanwhile would pile up on the small stack of a fiber
+    thread_pool_t *pool = fiber_active() ? NULL : thread_pool_current();
+    for (;;) {
+        // `room_seq` is read before re-checking, and receivers bump it after making room
+        uint32_t seq = atomic_load(&channel->room_seq);
+        atomic_fetch_add(&channel->senders_sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        err = channel_try_send(channel, item);
+        if (err == QUEUE_FULL_ERROR) {
+            wait_on(&channel->room_seq, seq, pool);
+        }
+        atomic_fetch_sub(&channel->senders_sleeping, 1);
+        if (err != QUEUE_FULL_ERROR) {
+            return err;
+        }
+    }
+}
+
+// Receives the oldest item into `*item` if there is any, without waiting
+// Returns false if the channel is empty
+bool channel_try_recv(channel_t *channel, void **item) {
+    return channel != NULL && item != NULL && pop(channel, item, 1) == 1;
+}
+
+// Receives the oldest item into `*item`, waiting for one if the channel is empty
+// Returns error code (CLOSED_CHANNEL_ERROR once the channel is closed and empty), or 0 on success
+int channel_recv(channel_t *channel, void **item) {
+    size_t count;
+    return channel_recv_batch(channel, item, 1, &count);
+}
+
+// Receives at least one and at most `max` items into `items[0..*count)`, waiting only if the channel is empty
+// Returns error code (CLOSED_CHANNEL_ERROR once the channel is closed and empty), or 0 on success
+int channel_recv_batch(channel_t *channel, void **items, size_t max, size_t *count) {
+    if (channel == NULL || items == NULL || count == NULL) {
+        return NULL_POINTER_ERROR;
+    }
+    *count = max > 0 ? pop(channel, items, max) : 0;
+    if (*count > 0 || max == 0) {
+        return 0;
+    }
+
+    // A fiber suspends until some sender hands it an item
+    if (fiber_active()) {
+        future_t received;
+        return_on_err(channel_recv_future(channel, &received));
+        items[0] = await(&received);
+        if (future_cancelled(&received)) {
+            return CLOSED_CHANNEL_ERROR;
+        }
+        *count = 1 + pop(channel, items + 1, max - 1);
+        return 0;
+    }
+
+    thread_pool_t *pool = thread_pool_current();
+    for (;;) {
+        // `items_seq` is read before re-checking, and senders (and `channel_close`) bump it afterwards
+        uint32_t seq = atomic_load(&channel->items_seq);
+        atomic_fetch_add(&channel->receivers_sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        *count = pop(channel, items, max);
+        bool closed = *count == 0 && atomic_load(&channel->closed);
+        if (*count == 0 && !closed) {
+            wait_on(&channel->items_seq, seq, pool);
+        }
+        atomic_fetch_sub(&channel->receivers_sleeping, 1);
+
+        if (closed) {
+            *count = pop(channel, items, max);
+            return *count > 0 ? 0 : CLOSED_CHANNEL_ERROR;
+        } else if (*count > 0) {
+            return 0;
+        }
+    }
+}
+
+// Receives an item into `future` instead of waiting for it
+// Return error code, or 0 on success
+int channel_recv_future(channel_t *channel, future_t *future) {
+    if (channel == NULL || future == NULL) {
+        return NULL_POINTER_ERROR;
+    }
+    callable_t callable = {.function = NULL, .arg = NULL, .argsz = 0};
+    return_on_err(future_init(callable, future));
+
+    // An item goes straight to the Future only if no older one waits: `serve_pending` pops under the mutex too,
+    // so a Future can't take an item that a sender has published but not yet handed to the first in line
+    return_on_err(pthread_mutex_lock(&channel->mutex));
+    void *item;
+    if (channel->pending == NULL && pop(channel, &item, 1) == 1) {
+        silent_on_err(pthread_mutex_unlock(&channel->mutex));
+        future->res = item;
+        future_complete(future);
+        return 0;
+    }
+
+    // The Future waits at the end of the line; `serve_pending` hands it an item that has come meanwhile,
+    // while senders see it pending and serve it later
+    future->continuation.next = NULL;
+    if (channel->last_pending != NULL) {
+        channel->last_pending->continuation.next = &future->continuation;
+    } else {
+        channel->pending = future;
+    }
+    channel->last_pending = future;
+    atomic_fetch_add(&channel->receivers_pending, 1);
+    silent_on_err(pthread_mutex_unlock(&channel->mutex));
+
+    // Pairs with the fence in `channel_try_send`: either the sender sees us pending, or we see its item
+    atomic_thread_fence(memory_order_seq_cst);
+    serve_pending(channel);
+    return 0;
+}
+
+// Closes `channel`: sends fail from now on, and receivers give up once the channel is empty
+void channel_close(channel_t *channel) {
+    atomic_store(&channel->closed, true);
+    atomic_fetch_add(&channel->items_seq, 1);
+    futex_wake(&channel->items_seq, INT_MAX);
+    atomic_fetch_add(&channel->room_seq, 1);
+    futex_wake(&channel->room_seq, INT_MAX);
+    serve_pending(channel);
+}
@@ -0,0 +1,94 @@
+#ifndef _CHANNEL_H_
+#define _CHANNEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "future.h"
+
+// Bounded multi-producer multi-consumer channel of item pointers, for streaming items between stages of
+// a pipeline without an `async` and a Future per item; items pass by pointer, nothing is copied
+// The ring is lock-free (every cell carries a sequence number telling whose turn it is); only threads that
+// have to wait and receivers waiting through a Future (see `channel_recv_future`) take slower paths
+
+// Cell of the ring: `sequence` == position means free for the sender of that position,
+// position + 1 means holding the item for the receiver of that position
+typedef struct channel_cell {
+    _Atomic size_t sequence;
+    void *item;
+} channel_cell_t;
+
+typedef struct channel {
+    channel_cell_t *cells; // Ring of `mask` + 1 cells
+    size_t mask;
+
+    // Positions of the next send and the next receive; each on its own cache line
+    _Alignas(64) _Atomic size_t tail;
+    _Alignas(64) _Atomic size_t head;
+
+    // Futex words of threads waiting for items and for room; bumped by whoever makes them appear
+    _Alignas(64) _Atomic uint32_t items_seq;
+    _Atomic uint32_t room_seq;
+    _Atomic size_t receivers_sleeping; // Threads in `channel_recv` or `channel_recv_batch` waiting on `items_seq`
+    _Atomic size_t senders_sleeping; // Threads in `channel_send` waiting on `room_seq`
+    _Atomic size_t receivers_pending; // Futures of `channel_recv_future` waiting for items
+    _Atomic bool closed;
+
+    // Protected by mutex:
+    pthread_mutex_t mutex;
+    future_t *pending; // Futures of `channel_recv_future` waiting for items, oldest first, linked by
+                       // `continuation.next`
+    future_t *last_pending;
+} channel_t;
+
+// Initialises empty channel of at least `capacity` items (rounded up to a power of two) in memory pointed to
+// by `channel`
+// Returns error code, or 0 on success
+int channel_init(channel_t *channel, size_t capacity);
+
+// Destroys `channel`; nobody may use it any more, and no Future of `channel_recv_future` may still wait
+void channel_destroy(channel_t *channel);
+
+// Sends `item` (not NULL) if there's room, without waiting
+// Returns error code (QUEUE_FULL_ERROR if the channel is full, CLOSED_CHANNEL_ERROR if it's closed),
+// or 0 on success
+int channel_try_send(channel_t *channel, void *item);
+
+// Sends `item` (not NULL), waiting for room if the channel is full
+// A pool worker runs other jobs of its pool meanwhile (a fiber just blocks its worker), so that a pipeline on
+// a small pool can't deadlock
+// Returns error code (CLOSED_CHANNEL_ERROR if the channel is or gets closed), or 0 on success
+int channel_send(channel_t *channel, void *item);
+
+// Receives the oldest item into `*item` if there is any, without waiting
+// Returns false if the channel is empty
+bool channel_try_recv(channel_t *channel, void **item);
+
+// Receives the oldest item into `*item`, waiting for one if the channel is empty
+// A pool worker runs other jobs of its pool meanwhile; a fiber suspends (see `channel_recv_future`)
+// Returns error code (CLOSED_CHANNEL_ERROR once the channel is closed and empty), or 0 on success
+int channel_recv(channel_t *channel, void **item);
+
+// Receives at least one and at most `max` items into `items[0..*count)`, oldest first, waiting (like
+// `channel_recv`) only if the channel is empty; all items ready in a row are claimed at once
+// Returns error code (CLOSED_CHANNEL_ERROR once the channel is closed and empty), or 0 on success
+int channel_recv_batch(channel_t *channel, void **items, size_t max, size_t *count);
+
+// Receives an item into `future` instead of waiting for it: the Future gets done with the item as its result
+// right away if there is one and no older Future waits, otherwise once some sender sends one, in the order
+// the Futures came (other receivers aside); no thread waits meanwhile, so `map` on the Future makes the next
+// stage of a pipeline a job that is deferred only when it has work
+// If the channel is closed and empty, the Future gets done cancelled with a NULL result (and so do Futures
+// created from it by `map`)
+// Return error code, or 0 on success
+int channel_recv_future(channel_t *channel, future_t *future);
+
+// Closes `channel`: sends fail from now on, while receivers take the items sent so far; once there are none,
+// waiting receivers give up with CLOSED_CHANNEL_ERROR and pending Futures get cancelled
+// Meant to be called once all senders are done
+void channel_close(channel_t *channel);
+
+#endif //_CHANNEL_H_
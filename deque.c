@@ -0,0 +1,108 @@
+#include <stdlib.h>
+
+#include "deque.h"
+#include "err.h"
+
+// Memory orderings follow "Correct and Efficient Work-Stealing for Weak Memory Models" (Lê et al., 2013)
+
+// Initialise deque able to hold at least `capacity` elements in memory pointed to by `deque`
+// Return error code, 0 on success
+int deque_init(deque_t *deque, size_t capacity) {
+    if (deque == NULL) {
+        return NULL_POINTER_ERROR;
+    }
+
+    // Round capacity up to a power of two so that indices can be masked instead of divided
+    size_t real_capacity = 1;
+    while (real_capacity < capacity) {
+        real_capacity <<= 1;
+    }
+
+    deque->buffer = (_Atomic(void *) *) calloc(real_capacity, sizeof(_Atomic(void *)));
+    if (deque->buffer == NULL) {
+        return MEMORY_ALLOCATION_ERROR;
+    }
+    deque->mask = real_capacity - 1;
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+
+    return 0;
+}
+
+// Destroy the deque (elements still inside are not freed)
+void deque_destroy(deque_t *deque) {
+    free(deque->buffer);
+}
+
+// Push element pointer to the bottom of the deque; owner only
+// Returns false if the deque is full
+bool deque_push(deque_t *deque, void *element) {
+    ssize_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    ssize_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if ((size_t) (b - t) > deque->mask) {
+        return false;
+    }
+
+    atomic_store_explicit(&deque->buffer[b & deque->mask], element, memory_order_relaxed);
+    // A release store rather than the paper's release fence followed by a relaxed store: same guarantees
+    // for thieves (they load `bottom` with acquire), but visible to ThreadSanitizer, which ignores fences
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_release);
+    return true;
+}
+
+// Pops element pointer from the bottom of the deque; owner only
+// Returns NULL if the deque is empty
+void *deque_pop(deque_t *deque) {
+    ssize_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    ssize_t t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (t > b) { // Deque was empty
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    void *res = atomic_load_explicit(&deque->buffer[b & deque->mask], memory_order_relaxed);
+    if (t == b) { // Last element; race against thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed)) {
+            res = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    }
+    return res;
+}
+
+// Steals element pointer from the top of the deque; any thread
+// Returns NULL if the deque is empty or another thread won the race for the element
+void *deque_steal(deque_t *deque) {
+    ssize_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    ssize_t b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (t >= b) {
+        return NULL;
+    }
+
+    void *res = atomic_load_explicit(&deque->buffer[t & deque->mask], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return res;
+}
+
+// Returns whether deque is empty (only a snapshot when other threads use the deque)
+bool deque_empty(deque_t *deque) {
+    ssize_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    ssize_t b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    return t >= b;
+}
+
+// Returns number of elements in the deque (only a snapshot when other threads use the deque)
+size_t deque_size(deque_t *deque) {
+    ssize_t t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    ssize_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    return b > t ? (size_t) (b - t) : 0;
+}
@@ -0,0 +1,50 @@
+#ifndef _DEQUE_H_
+#define _DEQUE_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+// Fixed-capacity Chase-Lev work-stealing deque of element pointers
+// Only the owner thread may `deque_push` and `deque_pop` (at the bottom end);
+// any thread may `deque_steal` (from the top end)
+// The buffer never grows, so stealers never see it freed; a full deque makes `deque_push` fail
+// and the caller has to put the element somewhere else
+typedef struct deque {
+    _Atomic ssize_t top; // Next index to steal from; modified by thieves and by the owner's last-element pop
+    char top_padding[64 - sizeof(ssize_t)]; // Keep `top` and `bottom` on separate cache lines
+
+    _Atomic ssize_t bottom; // Next index to push to; modified only by the owner
+    char bottom_padding[64 - sizeof(ssize_t)];
+
+    size_t mask; // capacity - 1; capacity is a power of two
+    _Atomic(void *) *buffer;
+} deque_t;
+
+// Initialise deque able to hold at least `capacity` elements in memory pointed to by `deque`
+// Return error code, 0 on success
+int deque_init(deque_t *deque, size_t capacity);
+
+// Destroy the deque (elements still inside are not freed)
+void deque_destroy(deque_t *deque);
+
+// Push element pointer to the bottom of the deque; owner only
+// Returns false if the deque is full
+bool deque_push(deque_t *deque, void *element);
+
+// Pops element pointer from the bottom of the deque; owner only
+// Returns NULL if the deque is empty
+void *deque_pop(deque_t *deque);
+
+// Steals element pointer from the top of the deque; any thread
+// Returns NULL if the deque is empty or another thread won the race for the element
+void *deque_steal(deque_t *deque);
+
+// Returns whether deque is empty (only a snapshot when other threads use the deque)
+bool deque_empty(deque_t *deque);
+
+// Returns number of elements in the deque (only a snapshot when other threads use the deque)
+size_t deque_size(deque_t *deque);
+
+#endif //_DEQUE_H_
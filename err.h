@@ -9,7 +9,14 @@ enum Pw2Error {
     CLOSED_POOL_ERROR = -2, // An attempt to defer work to a threadpool that is not acceptng work
     // (e.g. in the process of being destroyed)
     NULL_POINTER_ERROR = -3, // Null pointer was passed as an argument to function
-    ZERO_THREADS_ERROR = -4 // `pool_size` == 0
+    ZERO_THREADS_ERROR = -4, // `pool_size` == 0
+    STATS_DISABLED_ERROR = -5, // Statistics were requested, but the library was compiled without ASYNCC_STATS
+    INVALID_PRIORITY_ERROR = -6, // Priority is not one of `job_priority_t` values
+    INVALID_CPU_ERROR = -7, // A CPU to place workers on doesn't exist (or there are none)
+    TIMEOUT_ERROR = -8, // The deadline passed before the awaited Future was done
+    QUEUE_FULL_ERROR = -9, // The queue of a pool with bounded capacity has no room for another job
+    INVALID_WORKER_ERROR = -10, // No worker of the pool runs in the slot of that index
+    CLOSED_CHANNEL_ERROR = -11 // The channel has been closed (and, for a receiver, drained)
 };
 
 // Macros to reduce clutter; call a function and deal with the failure whenever the call fails
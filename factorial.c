@@ -1,79 +1,342 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "future.h"
 
-typedef struct tuple {
-    long long int value;
-    int multiplier;
-} tuple_t;
+// Numbers are arrays of limbs in base 10^9, least significant first, so that printing them is trivial
+#define BASE 1000000000u
+#define BASE_DIGITS 9
 
-// This function takes tuple consisting of the last partial product and last multiplier in the 1 x 2 x 3 ... x n
-// series, and updates this tuple
-void *multiply(void *tuple_, size_t tuple_size, size_t *res_size_ptr) {
-    tuple_t *tuple = (tuple_t *) tuple_;
-    tuple->multiplier++;
-    tuple->value *= tuple->multiplier;
+// Products with a factor shorter than this are computed by the schoolbook method
+#define KARATSUBA_LIMBS 48
 
-    if (res_size_ptr != NULL) {
-        *res_size_ptr = tuple_size;
+// Karatsuba products at least this long run two of their three halves as separate tasks
+#define PARALLEL_LIMBS 2048
+
+// Bounds of the product tree: at most this many leaves, each of at least LEAF_NUMBERS factors
+#define MAX_LEAVES 1024
+#define LEAF_NUMBERS 64
+
+typedef uint32_t limb_t;
+
+typedef struct bignum {
+    size_t length; // Number of limbs; the most significant one is non-zero (except for 0 itself)
+    limb_t limbs[];
+} bignum_t;
+
+// Allocates a number of `length` limbs; exits if memory runs out, since there's no result without it
+bignum_t *bignum_alloc(size_t length) {
+    bignum_t *number = (bignum_t *) malloc(sizeof(bignum_t) + length * sizeof(limb_t));
+    if (number == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    number->length = length;
+    return number;
+}
+
+// Returns the length of `limbs[0..length)` without the most significant zero limbs
+size_t trimmed_length(const limb_t *limbs, size_t length) {
+    while (length > 1 && limbs[length - 1] == 0) {
+        length--;
+    }
+    return length;
+}
+
+// Adds `x[0..nx)` to `out[0..n)`; the sum must fit in `n` limbs
+void add_into(limb_t *out, size_t n, const limb_t *x, size_t nx) {
+    nx = trimmed_length(x, nx);
+    uint32_t carry = 0;
+    for (size_t i = 0; i < n && (i < nx || carry != 0); i++) {
+        uint32_t sum = out[i] + (i < nx ? x[i] : 0) + carry;
+        carry = sum >= BASE;
+        out[i] = carry ? sum - BASE : sum;
+    }
+}
+
+// Subtracts `y[0..ny)` from `x[0..nx)`; the difference must not be negative
+void subtract_from(limb_t *x, size_t nx, const limb_t *y, size_t ny) {
+    ny = trimmed_length(y, ny);
+    uint32_t borrow = 0;
+    for (size_t i = 0; i < nx && (i < ny || borrow != 0); i++) {
+        uint32_t subtrahend = (i < ny ? y[i] : 0) + borrow;
+        borrow = x[i] < subtrahend;
+        x[i] = borrow ? x[i] + BASE - subtrahend : x[i] - subtrahend;
+    }
+}
+
+void multiply_into(const limb_t *a, size_t na, const limb_t *b, size_t nb, limb_t *out);
+
+// Arguments of a part of a Karatsuba product run as a separate task
+typedef struct product_part {
+    const limb_t *a;
+    size_t na;
+    const limb_t *b;
+    size_t nb;
+    limb_t *out;
+} product_part_t;
+
+void *multiply_part(void *part_, size_t part_size __attribute__((unused)), size_t *res_size) {
+    product_part_t *part = (product_part_t *) part_;
+    multiply_into(part->a, part->na, part->b, part->nb, part->out);
+    *res_size = 0;
+    return NULL;
+}
+
+// Writes the product of `a[0..na)` and `b[0..nb)` to `out[0..na + nb)`
+void multiply_into(const limb_t *a, size_t na, const limb_t *b, size_t nb, limb_t *out) {
+    if (na < nb) {
+        const limb_t *t = a;
+        a = b;
+        b = t;
+        size_t tn = na;
+        na = nb;
+        nb = tn;
+    }
+    memset(out, 0, (na + nb) * sizeof(limb_t));
+
+    if (nb < KARATSUBA_LIMBS) {
+        // Every step is below BASE^2 + 2 * BASE, which fits in 64 bits
+        for (size_t i = 0; i < nb; i++) {
+            uint64_t carry = 0;
+            for (size_t j = 0; j < na; j++) {
+                uint64_t current = out[i + j] + (uint64_t) b[i] * a[j] + carry;
+                out[i + j] = (limb_t) (current % BASE);
+                carry = current / BASE;
+            }
+            out[i + na] = (limb_t) carry;
+        }
+        return;
+    }
+
+    size_t m = (na + 1) / 2;
+    if (nb <= m) {
+        // `b` is too short to split: a * b = a0 * b + a1 * b * BASE^m
+        limb_t *partial = (limb_t *) malloc((na - m + nb) * sizeof(limb_t));
+        if (partial == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        multiply_into(a, m, b, nb, out);
+        multiply_into(a + m, na - m, b, nb, partial);
+        add_into(out + m, na + nb - m, partial, na - m + nb);
+        free(partial);
+        return;
+    }
+
+    // a * b = z0 + z1 * BASE^m + z2 * BASE^2m, where z0 = a0 * b0 and z2 = a1 * b1 go straight to `out`
+    // and z1 = (a0 + a1) * (b0 + b1) - z0 - z2
+    limb_t *sums = (limb_t *) calloc(2 * (m + 1), sizeof(limb_t));
+    limb_t *middle = (limb_t *) malloc(2 * (m + 1) * sizeof(limb_t));
+    if (sums == NULL || middle == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    limb_t *sum_a = sums;
+    limb_t *sum_b = sums + m + 1;
+    memcpy(sum_a, a, m * sizeof(limb_t));
+    add_into(sum_a, m + 1, a + m, na - m);
+    memcpy(sum_b, b, m * sizeof(limb_t));
+    add_into(sum_b, m + 1, b + m, nb - m);
+
+    // Big outer products go to other workers, while this one computes the middle product
+    product_part_t parts[2] = {
+        {.a = a, .na = m, .b = b, .nb = m, .out = out},
+        {.a = a + m, .na = na - m, .b = b + m, .nb = nb - m, .out = out + 2 * m}
+    };
+    thread_pool_t *pool = thread_pool_current();
+    future_t futures[2];
+    bool spawned[2] = {false, false};
+    for (int i = 0; i < 2; i++) {
+        callable_t callable = {.function = multiply_part, .arg = &parts[i], .argsz = sizeof(product_part_t)};
+        spawned[i] = pool != NULL && nb >= PARALLEL_LIMBS && async(pool, &futures[i], callable) == 0;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (!spawned[i]) {
+            multiply_into(parts[i].a, parts[i].na, parts[i].b, parts[i].nb, parts[i].out);
+        }
+    }
+    multiply_into(sum_a, m + 1, sum_b, m + 1, middle);
+    for (int i = 0; i < 2; i++) {
+        if (spawned[i]) {
+            await(&futures[i]);
+        }
     }
 
-    return tuple;
+    subtract_from(middle, 2 * (m + 1), out, 2 * m);
+    subtract_from(middle, 2 * (m + 1), out + 2 * m, na + nb - 2 * m);
+    add_into(out + m, na + nb - m, middle, 2 * (m + 1));
+
+    free(sums);
+    free(middle);
+}
+
+// Returns the product of `a` and `b`
+bignum_t *multiply(const bignum_t *a, const bignum_t *b) {
+    bignum_t *product = bignum_alloc(a->length + b->length);
+    multiply_into(a->limbs, a->length, b->limbs, b->length, product->limbs);
+    product->length = trimmed_length(product->limbs, product->length);
+    return product;
+}
+
+// Numbers `begin`, ..., `end` - 1 to multiply in a leaf of the product tree
+typedef struct range {
+    uint32_t begin;
+    uint32_t end;
+} range_t;
+
+// Computes the product of a range of numbers, multiplying the number by as many of them at once as fit in a limb
+void *range_product(void *range_, size_t range_size __attribute__((unused)), size_t *res_size) {
+    const range_t *range = (const range_t *) range_;
+    size_t capacity = 16;
+    bignum_t *product = bignum_alloc(capacity);
+    product->limbs[0] = 1;
+    product->length = 1;
+
+    uint32_t i = range->begin;
+    while (i < range->end) {
+        uint64_t factor = i++;
+        while (i < range->end && factor * i <= UINT32_MAX) {
+            factor *= i++;
+        }
+
+        if (product->length + 2 > capacity) { // A limb times `factor` carries into at most two more
+            capacity *= 2;
+            product = (bignum_t *) realloc(product, sizeof(bignum_t) + capacity * sizeof(limb_t));
+            if (product == NULL) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+        }
+        uint64_t carry = 0;
+        for (size_t j = 0; j < product->length; j++) {
+            uint64_t current = product->limbs[j] * factor + carry;
+            product->limbs[j] = (limb_t) (current % BASE);
+            carry = current / BASE;
+        }
+        while (carry != 0) {
+            product->limbs[product->length++] = (limb_t) (carry % BASE);
+            carry /= BASE;
+        }
+    }
+
+    *res_size = product->length;
+    return product;
+}
+
+// Joins two subtrees: the argument is the array of their two Futures (see `when_all`)
+void *join_products(void *inputs_, size_t n __attribute__((unused)), size_t *res_size) {
+    future_t **inputs = (future_t **) inputs_;
+    bignum_t *left = (bignum_t *) inputs[0]->res;
+    bignum_t *right = (bignum_t *) inputs[1]->res;
+    bignum_t *product = multiply(left, right);
+    free(left);
+    free(right);
+    *res_size = product->length;
+    return product;
+}
+
+// Node of the product tree; a leaf multiplies its `range`, an inner node joins its children
+typedef struct product_node {
+    range_t range;
+    future_t *children[2];
+    future_t *joined; // Done once both children are
+    future_t *product;
+} product_node_t;
+
+// Takes a Future from `futures`; exits if memory runs out, like `bignum_alloc`
+future_t *group_future(future_group_t *futures) {
+    future_t *future = future_group_alloc(futures);
+    if (future == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return future;
+}
+
+// Sets up the subtree of the numbers of `range` in `nodes[0..2 * leaves - 1)`, with Futures from `futures`
+// Returns the Future of its product
+future_t *product_tree(thread_pool_t *pool, future_group_t *futures, product_node_t *nodes, size_t leaves,
+                       range_t range) {
+    product_node_t *node = &nodes[0];
+    node->range = range;
+    node->product = group_future(futures);
+    if (leaves == 1) {
+        callable_t callable = {.function = range_product, .arg = &node->range, .argsz = sizeof(range_t)};
+        async(pool, node->product, callable);
+        return node->product;
+    }
+
+    // Both halves have about as many factors, so the products joined at every level are about as long
+    size_t left_leaves = leaves / 2;
+    uint32_t middle = range.begin + (uint32_t) ((uint64_t) (range.end - range.begin) * left_leaves / leaves);
+    range_t left = {.begin = range.begin, .end = middle};
+    range_t right = {.begin = middle, .end = range.end};
+    node->children[0] = product_tree(pool, futures, nodes + 1, left_leaves, left);
+    node->children[1] = product_tree(pool, futures, nodes + 2 * left_leaves, leaves - left_leaves, right);
+    node->joined = group_future(futures);
+    // The join starts where the later child finished, with one of its factors still in the caches
+    when_all(pool, node->joined, node->children, 2);
+    map_affinity(pool, node->product, node->joined, join_products, MAP_PREFER_SAME_WORKER);
+    return node->product;
 }
 
-// Helper one-liner to print result
-void print_answer(long long int res) {
-    printf("%lld\n", res);
+// Prints `number` in decimal
+void print_answer(const bignum_t *number) {
+    printf("%u", number->limbs[number->length - 1]);
+    for (size_t i = number->length - 1; i-- > 0;) {
+        printf("%0*u", BASE_DIGITS, number->limbs[i]);
+    }
+    printf("\n");
 }
 
-int main() {
+// Reads `n` and prints n!; the optional argument is the number of threads (the number of CPUs by default)
+int main(int argc, char *argv[]) {
     int n;
     // Incorrect input is intentionally left triggering UB since there's no specification in the task what to do
     scanf("%d", &n);  // NOLINT(cert-err34-c)
 
-    // Special case for small `n`s where starting up the thread pool makes no sense
-    if (n == 0 || n == 1) {
-        print_answer(1);
-        return 0;
+    long threads = argc > 1 ? atol(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) {
+        threads = 1;
     }
 
     // Initialise thread pool
     thread_pool_t pool;
-    thread_pool_init(&pool, 3);
-
-    // Describe function to run (see `multiply` for details)
-    callable_t callable;
-    callable.function = multiply;
-
-    // Initial values for factorial function
-    tuple_t acc;
-    acc.multiplier = 1; // We start with 1! already computed => n - 2 in the code below (Main part)
-    acc.value = 1;
+    thread_pool_init(&pool, (size_t) threads);
 
-    callable.arg = &acc;
-    callable.argsz = sizeof(tuple_t);
-
-    // Declare space for all the Futures that will be used
-    future_t futures[n - 1];
+    // 1 * 2 * ... * n as a balanced tree of products of ranges; every leaf is a task of its own,
+    // and every inner node multiplies the products of its children once both of them are done
+    size_t leaves = (size_t) n / LEAF_NUMBERS;
+    if (leaves > MAX_LEAVES) {
+        leaves = MAX_LEAVES;
+    } else if (leaves == 0) {
+        leaves = 1;
+    }
+    product_node_t *nodes = (product_node_t *) calloc(2 * leaves - 1, sizeof(product_node_t));
+    future_group_t futures;
+    future_group_init(&futures);
+    if (nodes == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    range_t numbers = {.begin = 1, .end = (uint32_t) n + 1};
+    future_t *root = product_tree(&pool, &futures, nodes, leaves, numbers);
 
     // Error codes are not checked since there's nothing in the task spec. on what to do with them
-    // If an error occurs (tho it shouldn't), it will trigger UB and we are hoping for the best
-
-    // Main part that defers calculations to the threadpool
-    async(&pool, &futures[0], callable);
-    for (int i = 0; i < n - 2; i++) {
-        map(&pool, &futures[i + 1], &futures[i], multiply);
-    }
 
     // Wait for the final result
-    await(&futures[n - 2]);
-    print_answer(acc.value);
+    bignum_t *res = (bignum_t *) await(root);
+    print_answer(res);
+    free(res);
 
     // Clean up
     thread_pool_destroy(&pool);
-    for (int i = 0; i < n - 1; i++) {
-        future_destroy(&futures[i]);
-    }
+    future_group_destroy(&futures);
+    free(nodes);
 
     return 0;
-}
\ No newline at end of file
+}
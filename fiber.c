@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "fiber.h"
+
+#if defined(__SANITIZE_THREAD__)
+#include <sanitizer/tsan_interface.h>
+#endif
+
+// Fiber running on the current thread (NULL outside of fibers)
+// A fiber may continue on another thread after it suspends, so the variable is never accessed directly
+// from code that switches contexts: the compiler would keep its address across the switch
+static _Thread_local fiber_t *current_fiber = NULL;
+
+static __attribute__((noinline)) fiber_t *get_current_fiber(void) {
+    return current_fiber;
+}
+
+static __attribute__((noinline)) void set_current_fiber(fiber_t *fiber) {
+    current_fiber = fiber;
+}
+
+static size_t page_size(void) {
+    long size = sysconf(_SC_PAGESIZE);
+    return size > 0 ? (size_t) size : 4096;
+}
+
+// Initialises a runtime running fibers with stacks of `stack_size` bytes (0 means FIBER_DEFAULT_STACK_SIZE)
+// on workers of `pool`
+// Returns error code, or 0 on success
+int fiber_runtime_init(fiber_runtime_t *runtime, thread_pool_t *pool, size_t stack_size) {
+    if (runtime == NULL || pool == NULL) {
+        return NULL_POINTER_ERROR;
+    }
+    if (stack_size == 0) {
+        stack_size = FIBER_DEFAULT_STACK_SIZE;
+    }
+    size_t page = page_size();
+    runtime->pool = pool;
+    runtime->stack_size = (stack_size + page - 1) / page * page;
+    runtime->free_fibers = NULL;
+    runtime->free_count = 0;
+    runtime->stack_allocations = 0;
+    return_on_err(pthread_mutex_init(&runtime->mutex, NULL));
+    return 0;
+}
+
+// Releases the stacks of `runtime`; all its fibers must have finished (their Futures are done)
+void fiber_runtime_destroy(fiber_runtime_t *runtime) {
+    size_t page = page_size();
+    fiber_t *fiber = runtime->free_fibers;
+    while (fiber != NULL) {
+        fiber_t *next = fiber->next;
+#if defined(__SANITIZE_THREAD__)
+        __tsan_destroy_fiber(fiber->tsan_fiber);
+#endif
+        munmap(fiber->stack, runtime->stack_size + page);
+        free(fiber);
+        fiber = next;
+    }
+    runtime->free_fibers = NULL;
+    runtime->free_count = 0;
+    silent_on_err(pthread_mutex_destroy(&runtime->mutex));
+}
+
+// Takes a finished fiber of `runtime` for reuse, or makes a new one with a fresh stack, and stores it in `*res`
+// Returns error code, or 0 on success
+static int acquire_fiber(fiber_runtime_t *runtime, fiber_t **res) {
+    return_on_err(pthread_mutex_lock(&runtime->mutex));
+    fiber_t *fiber = runtime->free_fibers;
+    if (fiber != NULL) {
+        runtime->free_fibers = fiber->next;
+        runtime->free_count--;
+        silent_on_err(pthread_mutex_unlock(&runtime->mutex));
+        *res = fiber;
+        return 0;
+    }
+    silent_on_err(pthread_mutex_unlock(&runtime->mutex));
+
+    fiber = (fiber_t *) malloc(sizeof(fiber_t));
+    if (fiber == NULL) {
+        return MEMORY_ALLOCATION_ERROR;
+    }
+    // The lowest page stays inaccessible, so that a stack overflow faults instead of corrupting memory
+    size_t page = page_size();
+    fiber->stack = mmap(NULL, runtime->stack_size + page, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (fiber->stack == MAP_FAILED) {
+        free(fiber);
+        return MEMORY_ALLOCATION_ERROR;
+    }
+    if (mprotect(fiber->stack, page, PROT_NONE) != 0) {
+        int err = errno;
+        munmap(fiber->stack, runtime->stack_size + page);
+        free(fiber);
+        return err;
+    }
+    fiber->runtime = runtime;
+#if defined(__SANITIZE_THREAD__)
+    fiber->tsan_fiber = __tsan_create_fiber(0);
+#endif
+    // Counted only once the stack is usable, so that failed attempts don't count
+    silent_on_err(pthread_mutex_lock(&runtime->mutex));
+    runtime->stack_allocations++;
+    silent_on_err(pthread_mutex_unlock(&runtime->mutex));
+    *res = fiber;
+    return 0;
+}
+
+// Puts `fiber`, which has finished, on the free list of its runtime
+static void release_fiber(fiber_t *fiber) {
+    fiber_runtime_t *runtime = fiber->runtime;
+    silent_on_err(pthread_mutex_lock(&runtime->mutex));
+    fiber->next = runtime->free_fibers;
+    runtime->free_fibers = fiber;
+    runtime->free_count++;
+    silent_on_err(pthread_mutex_unlock(&runtime->mutex));
+}
+
+// Goes back from the running fiber to the job that resumed it
+static void switch_to_resumer(fiber_t *fiber) {
+#if defined(__SANITIZE_THREAD__)
+    __tsan_switch_to_fiber(fiber->tsan_resumer, 0);
+#endif
+    swapcontext(&fiber->context, fiber->resumer);
+}
+
+// First function of every fiber; never returns, the fiber is just not resumed after it finishes
+static void fiber_entry(void) {
+    fiber_t *fiber = get_current_fiber();
+    future_t *future = fiber->future;
+    uint32_t state = atomic_fetch_or_explicit(&future->state, FUTURE_STARTED, memory_order_acquire);
+    if (state & FUTURE_CANCELLED) {
+        atomic_fetch_and_explicit(&future->state, ~FUTURE_STARTED, memory_order_relaxed);
+        future->res = NULL;
+        future->res_size = 0;
+    } else {
+        callable_t callable = fiber->callable;
+        future->res = (*callable.function)(callable.arg, callable.argsz, &future->res_size);
+    }
+
+    fiber->finished = true;
+    switch_to_resumer(fiber);
+}
+
+static void fiber_job(void *arg, size_t argsz);
+
+// Continuation of the Future a fiber waits for: makes the fiber run again
+// Runs the fiber right away if its job can't be deferred
+static void wake_fiber(continuation_t *continuation, future_t *source __attribute__((unused))) {
+    fiber_t *fiber = (fiber_t *) ((char *) continuation - offsetof(fiber_t, wakeup));
+    runnable_t runnable = {.function = fiber_job, .arg = fiber, .argsz = 0};
+    if (defer(fiber->runtime->pool, runnable) != 0) {
+        fiber_job(fiber, 0);
+    }
+}
+
+// Job that runs `fiber` until it finishes or suspends on a Future that is not done yet
+static void fiber_job(void *arg, size_t argsz __attribute__((unused))) {
+    fiber_t *fiber = (fiber_t *) arg;
+    ucontext_t resumer;
+    fiber_t *outer_fiber = get_current_fiber();
+    const future_t *outer_future = future_set_current(fiber->future);
+    set_current_fiber(fiber);
+    fiber->resumer = &resumer;
+#if defined(__SANITIZE_THREAD__)
+    fiber->tsan_resumer = __tsan_get_current_fiber();
+#endif
+
+    for (;;) {
+#if defined(__SANITIZE_THREAD__)
+        __tsan_switch_to_fiber(fiber->tsan_fiber, 0);
+#endif
+        swapcontext(&resumer, &fiber->context);
+        if (fiber->finished) {
+            break;
+        }
+        // Once the continuation is on the list, the fiber may be resumed by another worker at any moment
+        fiber->wakeup.run = wake_fiber;
+        if (future_add_continuation(fiber->awaited, &fiber->wakeup)) {
+            set_current_fiber(outer_fiber);
+            future_set_current(outer_future);
+            return;
+        }
+        // The Future is done already: carry on
+    }
+
+    set_current_fiber(outer_fiber);
+    future_set_current(outer_future);
+    future_t *future = fiber->future;
+    release_fiber(fiber);
+    future_complete(future);
+}
+
+// Makes `fiber` start from `fiber_entry` on its own stack when it's switched to
+// Kept out of line: `getcontext` returns twice as far as the compiler knows, which would upset the caller
+static __attribute__((noinline)) void prepare_context(fiber_t *fiber) {
+    getcontext(&fiber->context);
+    fiber->context.uc_stack.ss_sp = (char *) fiber->stack + page_size();
+    fiber->context.uc_stack.ss_size = fiber->runtime->stack_size;
+    fiber->context.uc_link = NULL;
+    makecontext(&fiber->context, fiber_entry, 0);
+}
+
+// Runs task described by `callable` in a new fiber of `runtime`, like `async` does in a job
+// Returns error code, or 0 on success
+int fiber_spawn(fiber_runtime_t *runtime, future_t *future, callable_t callable) {
+    if (runtime == NULL || future == NULL) {
+        return NULL_POINTER_ERROR;
+    }
+    return_on_err(future_init(callable, future));
+    future->pool = runtime->pool;
+
+    fiber_t *fiber = NULL;
+    return_on_err(acquire_fiber(runtime, &fiber));
+    fiber->future = future;
+    fiber->callable = callable;
+    fiber->awaited = NULL;
+    fiber->finished = false;
+    fiber->next = NULL;
+    prepare_context(fiber);
+
+    runnable_t runnable = {.function = fiber_job, .arg = fiber, .argsz = 0};
+    int err = defer(runtime->pool, runnable);
+    if (err != 0) {
+        release_fiber(fiber);
+    }
+    return err;
+}
+
+// Returns whether the calling code runs in a fiber
+bool fiber_active(void) {
+    return get_current_fiber() != NULL;
+}
+
+// Suspends the calling fiber until `future` is done; used by `await`
+void fiber_await(future_t *future) {
+    fiber_t *fiber = get_current_fiber();
+    fiber->awaited = future;
+    switch_to_resumer(fiber);
+}
@@ -0,0 +1,66 @@
+#ifndef _FIBER_H_
+#define _FIBER_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <ucontext.h>
+
+#include "threadpool.h"
+#include "future.h"
+
+#define FIBER_DEFAULT_STACK_SIZE (64 * 1024)
+
+// Task with its own stack, run by workers of a pool; `await` inside it suspends the fiber instead of
+// blocking the worker, and the fiber is deferred again once the awaited Future is done
+typedef struct fiber {
+    ucontext_t context; // Where the fiber continues when resumed
+    ucontext_t *resumer; // Where it returns to when it suspends or finishes
+    struct fiber_runtime *runtime;
+    void *stack; // Mapping of `runtime->stack_size` bytes plus a guard page below
+    future_t *future;
+    callable_t callable;
+    future_t *awaited; // Future the fiber suspended on
+    bool finished;
+    continuation_t wakeup; // Entry on `awaited->continuations`
+    struct fiber *next; // Link on `runtime->free_fibers`
+#if defined(__SANITIZE_THREAD__)
+    void *tsan_fiber;
+    void *tsan_resumer;
+#endif
+} fiber_t;
+
+// Fibers of a pool, with their stacks kept for reuse
+typedef struct fiber_runtime {
+    thread_pool_t *pool;
+    size_t stack_size;
+
+    // Protected by mutex:
+    pthread_mutex_t mutex;
+    fiber_t *free_fibers; // Finished fibers whose stacks wait for reuse
+    size_t free_count;
+    size_t stack_allocations; // Number of stacks ever mapped
+} fiber_runtime_t;
+
+// Initialises a runtime running fibers with stacks of `stack_size` bytes (0 means FIBER_DEFAULT_STACK_SIZE)
+// on workers of `pool`
+// Returns error code, or 0 on success
+int fiber_runtime_init(fiber_runtime_t *runtime, thread_pool_t *pool, size_t stack_size);
+
+// Releases the stacks of `runtime`; all its fibers must have finished (their Futures are done)
+void fiber_runtime_destroy(fiber_runtime_t *runtime);
+
+// Runs task described by `callable` in a new fiber of `runtime`, like `async` does in a job
+// The callable may `await` any number of Futures; each of them suspends only the fiber
+// Returns error code, or 0 on success
+int fiber_spawn(fiber_runtime_t *runtime, future_t *future, callable_t callable);
+
+// Returns whether the calling code runs in a fiber
+bool fiber_active(void);
+
+// Suspends the calling fiber until `future` is done; used by `await`
+// The fiber may continue on another worker
+void fiber_await(future_t *future);
+
+#endif //_FIBER_H_
@@ -0,0 +1,25 @@
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "futex.h"
+
+// Sleeps as long as `*word` == `expected`, until woken up by `futex_wake`
+// Spurious wake-ups are possible, so the caller has to re-check its condition
+void futex_wait(_Atomic uint32_t *word, uint32_t expected) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+// Same as `futex_wait`, but sleeps only until `deadline` (of CLOCK_MONOTONIC); NULL means no deadline
+// Returns false if the deadline has passed
+bool futex_wait_until(_Atomic uint32_t *word, uint32_t expected, const struct timespec *deadline) {
+    // FUTEX_WAIT_BITSET takes an absolute deadline, unlike FUTEX_WAIT
+    long res = syscall(SYS_futex, word, FUTEX_WAIT_BITSET_PRIVATE, expected, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+    return res == 0 || errno != ETIMEDOUT;
+}
+
+// Wakes up at most `count` threads sleeping in `futex_wait` on `word`
+void futex_wake(_Atomic uint32_t *word, int count) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
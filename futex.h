@@ -0,0 +1,22 @@
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// Thin wrappers around the Linux futex syscall (process-private futexes only)
+
+// Sleeps as long as `*word` == `expected`, until woken up by `futex_wake`
+// Spurious wake-ups are possible, so the caller has to re-check its condition
+void futex_wait(_Atomic uint32_t *word, uint32_t expected);
+
+// Same as `futex_wait`, but sleeps only until `deadline` (of CLOCK_MONOTONIC); NULL means no deadline
+// Returns false if the deadline has passed
+bool futex_wait_until(_Atomic uint32_t *word, uint32_t expected, const struct timespec *deadline);
+
+// Wakes up at most `count` threads sleeping in `futex_wait` on `word`
+void futex_wake(_Atomic uint32_t *word, int count);
+
+#endif //_FUTEX_H_
@@ -1,21 +1,50 @@
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include "future.h"
+#include "futex.h"
+#include "fiber.h"
+#include "trace.h"
+
+#define ASYNC_BATCH_CHUNK 256
+
+// A worker that waits in `await` with nothing to run sleeps at most this long before looking for jobs again,
+// because producers wake only parked workers
+#define AWAIT_HELP_SLEEP_NS 1000000u // 1 ms
+
+// Value of `future_t.continuations` once the Future is done
+static char continuations_closed_marker;
+#define CONTINUATIONS_CLOSED ((continuation_t *) &continuations_closed_marker)
+
+// Future whose callable runs on the current thread (NULL outside of callables); see `cancel_token_current`
+static _Thread_local const future_t *current_future = NULL;
+
+// Whether `future_complete` runs on the current thread, and the Futures created by `map` that it has cancelled
+// meanwhile (linked through `continuation.next`); the outermost call completes them in a loop, so that
+// cancelling a long chain of maps doesn't take a stack frame per link
+static _Thread_local bool completing = false;
+static _Thread_local continuation_t *cancelled_maps = NULL;
 
 // Creates a future_t in space pointed to by `future`, with result to be calculated by `callable`
 // Returns error code, or 0 on success
 int future_init(callable_t callable, future_t *future) {
-    // No allocations here, but there is pthread mutex and cond creation!
-    future_t res;
-    res.callable = callable;
-    res.res = NULL;
-    res.res_size = 0;
-
-    return_on_err(pthread_mutex_init(&(res.done_mutex), NULL));
-    return_on_err(pthread_cond_init(&(res.done_cond), NULL));
-    res.done = false;
-
-    *future = res;
+    // No allocations and no syscalls here
+    future->callable = callable;
+    future->inline_function = NULL;
+    future->res = NULL;
+    future->res_size = 0;
+    future->source = NULL;
+    future->pool = NULL;
+    future->priority = PRIORITY_NORMAL;
+    future->affinity = MAP_ANY_WORKER;
+    future->continuation.next = NULL;
+    future->continuation.run = NULL;
+    atomic_init(&future->continuations, NULL);
+    atomic_init(&future->state, 0);
 
     return 0;
 }
@@ -24,9 +53,140 @@ int future_init(callable_t callable, future_t *future) {
 // therefore we don't know when to clean up a future – it must be the user's responsibility
 // Destroys `future`
 // Silently ignores all errors
-void future_destroy(future_t *future) {
-    silent_on_err(pthread_mutex_destroy(&(future->done_mutex)));
-    silent_on_err(pthread_cond_destroy(&(future->done_cond)));
+void future_destroy(future_t *future __attribute__((unused))) {
+    // Nothing to release: a Future is just memory owned by the user
+}
+
+void map_work(void *arg, size_t argsz);
+
+// Returns whether `future` was cancelled before its callable started, so it's done (or will be) without a result;
+// a callable cancelled while it runs may still produce one
+static bool cancelled_before_start(const future_t *future) {
+    uint32_t state = atomic_load_explicit(&future->state, memory_order_relaxed);
+    return (state & FUTURE_CANCELLED) && !(state & FUTURE_STARTED);
+}
+
+// Defers the job of `future`, created by `map`, whose source is done, to the worker its affinity asks for
+// Returns error code, or 0 on success
+static int defer_map_job(future_t *future) {
+    runnable_t runnable;
+    runnable.function = map_work;
+    runnable.arg = future;
+    runnable.argsz = sizeof(future_t);
+
+    size_t index;
+    if (future->affinity == MAP_SAME_WORKER && thread_pool_worker_index(future->pool, &index)
+        && defer_on(future->pool, index, runnable) == 0) {
+        return 0;
+    } else if (future->affinity == MAP_PREFER_SAME_WORKER) {
+        return defer_local(future->pool, runnable);
+    }
+    return defer_prio(future->pool, runnable, future->priority);
+}
+
+// Continuation of a Future created by `map`: defers its job once the source is done,
+// or cancels the Future right away if the source has been cancelled before it ran
+// Silently ignores errors
+static void defer_mapped(continuation_t *continuation, future_t *source) {
+    future_t *future = (future_t *) ((char *) continuation - offsetof(future_t, continuation));
+    if (cancelled_before_start(source)) {
+        atomic_fetch_or_explicit(&future->state, FUTURE_CANCELLED, memory_order_relaxed);
+    }
+    if (future_cancelled(future)) {
+        future->res = NULL;
+        future->res_size = 0;
+        if (completing) {
+            continuation->next = cancelled_maps;
+            cancelled_maps = continuation;
+        } else {
+            future_complete(future);
+        }
+        return;
+    }
+
+    silent_on_err(defer_map_job(future));
+}
+
+// Puts `continuation` on the list of `source`, to be run once it's done
+// Returns false if `source` is done already (and the caller has to run it)
+bool future_add_continuation(future_t *source, continuation_t *continuation) {
+    continuation_t *head = atomic_load_explicit(&source->continuations, memory_order_acquire);
+    while (head != CONTINUATIONS_CLOSED) {
+        continuation->next = head;
+        if (atomic_compare_exchange_weak_explicit(&source->continuations, &head, continuation,
+                                                  memory_order_release, memory_order_acquire)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Marks `future`, whose result is already stored, as done: wakes up threads in `await`
+// and runs its continuations
+static void complete_one(future_t *future) {
+    // Take the continuations first: once `state` says done, `await` may return
+    // and the user may free the Future
+    continuation_t *continuations = atomic_exchange_explicit(&future->continuations, CONTINUATIONS_CLOSED,
+                                                             memory_order_acq_rel);
+
+    // Signal end of work to all interested parties; the syscall is made only if somebody sleeps
+    uint32_t old_state = atomic_fetch_or_explicit(&future->state, FUTURE_DONE, memory_order_release);
+    if (old_state & FUTURE_WAITERS) {
+        futex_wake(&future->state, INT_MAX);
+    }
+
+    // Start calculations that were waiting for this result
+    while (continuations != NULL) {
+        continuation_t *next = continuations->next;
+        continuations->run(continuations, future);
+        continuations = next;
+    }
+}
+
+// Marks `future`, whose result is already stored, as done: wakes up threads in `await`
+// and runs its continuations, then completes the Futures created by `map` that got cancelled by them
+void future_complete(future_t *future) {
+    if (completing) {
+        complete_one(future);
+        return;
+    }
+
+    completing = true;
+    complete_one(future);
+    while (cancelled_maps != NULL) {
+        continuation_t *continuation = cancelled_maps;
+        cancelled_maps = continuation->next;
+        complete_one((future_t *) ((char *) continuation - offsetof(future_t, continuation)));
+    }
+    completing = false;
+}
+
+// Calculates the result of `future` with its callable and completes it
+static void run_callable(future_t *future) {
+    callable_t callable = future->callable;
+
+    // A cancelled Future only has to be completed
+    uint32_t state = atomic_fetch_or_explicit(&future->state, FUTURE_STARTED, memory_order_acquire);
+    if (state & FUTURE_CANCELLED) {
+        // Never started after all, so Futures mapped from it get cancelled too
+        atomic_fetch_and_explicit(&future->state, ~FUTURE_STARTED, memory_order_relaxed);
+        future->res = NULL;
+        future->res_size = 0;
+        future_complete(future);
+        return;
+    }
+
+    // Run the function; it may await other Futures and so run their callables inside
+    const future_t *outer = current_future;
+    current_future = future;
+    if (future->inline_function != NULL) {
+        future->res_size = (*future->inline_function)(callable.arg, callable.argsz, future->inline_res);
+        future->res = future->inline_res;
+    } else {
+        future->res = (*callable.function)(callable.arg, callable.argsz, &future->res_size);
+    }
+    current_future = outer;
+    future_complete(future);
 }
 
 // Job that actually calculates the result of `callable` in `future`, to be deferred to a thread pool
@@ -35,18 +195,10 @@ void async_work(
         void *arg, // typeof(arg) == future_t
         size_t argsz __attribute__((unused)))
 {
-    // Extract function calculating the result
     future_t *future = (future_t *) arg;
-    callable_t callable = future->callable;
-
-    // Run the function
-    future->res = (*callable.function)(callable.arg, callable.argsz, &future->res_size);
-
-    // Signal end of work to all interested parties
-    silent_on_err(pthread_mutex_lock(&future->done_mutex));
-    future->done = true;
-    silent_on_err(pthread_cond_broadcast(&future->done_cond));
-    silent_on_err(pthread_mutex_unlock(&future->done_mutex));
+    TRACE(TRACE_START, "async", future, NULL);
+    run_callable(future);
+    TRACE(TRACE_END, "async", future, NULL);
 }
 
 // Runs task described by `callable` asynchronously
@@ -55,12 +207,19 @@ void async_work(
 // `callable` -> Description of the task
 // Return error code, or 0 on success
 int async(thread_pool_t *pool, future_t *future, callable_t callable) {
+    return async_prio(pool, future, callable, PRIORITY_NORMAL);
+}
+
+// Same as `async`, but the task goes to lane `priority` of `pool`
+// Return error code, or 0 on success
+int async_prio(thread_pool_t *pool, future_t *future, callable_t callable, job_priority_t priority) {
     if (pool == NULL || future == NULL) {
         return NULL_POINTER_ERROR;
     }
 
     // 1. Create a Future
     return_on_err(future_init(callable, future));
+    future->priority = priority;
 
     // 2. Send the task to the pool
     runnable_t runnable;
@@ -68,34 +227,189 @@ int async(thread_pool_t *pool, future_t *future, callable_t callable) {
     runnable.arg = future;
     runnable.argsz = sizeof(future_t);
 
+    return defer_prio(pool, runnable, priority);
+}
+
+// Same as `async`, but the task starts only once `delay_ns` nanoseconds have passed
+// Return error code, or 0 on success
+int async_after(thread_pool_t *pool, future_t *future, callable_t callable, uint64_t delay_ns) {
+    if (pool == NULL || future == NULL) {
+        return NULL_POINTER_ERROR;
+    }
+
+    return_on_err(future_init(callable, future));
+    runnable_t runnable = {.function = async_work, .arg = future, .argsz = sizeof(future_t)};
+    return defer_after(pool, runnable, delay_ns);
+}
+
+// Read done by the job of a Future created by `async_read`; kept in the Future's result buffer,
+// which stays unused since the result is the caller's buffer
+typedef struct read_request {
+    int fd;
+    void *buf;
+    size_t count;
+} read_request_t;
+
+// Job that reads into the buffer of `future`, created by `async_read`, once its fd is readable
+// Silently ignores errors
+void read_work(
+        void *arg, // typeof(arg) == future_t
+        size_t argsz __attribute__((unused)))
+{
+    future_t *future = (future_t *) arg;
+    read_request_t *request = (read_request_t *) future->inline_res;
+    uint32_t state = atomic_fetch_or_explicit(&future->state, FUTURE_STARTED, memory_order_acquire);
+    if (state & FUTURE_CANCELLED) {
+        // Never started after all, so Futures mapped from it get cancelled too
+        atomic_fetch_and_explicit(&future->state, ~FUTURE_STARTED, memory_order_relaxed);
+        future->res = NULL;
+        future->res_size = 0;
+        future_complete(future);
+        return;
+    }
+
+    TRACE(TRACE_START, "read", future, NULL);
+    ssize_t count;
+    do {
+        count = read(request->fd, request->buf, request->count);
+    } while (count < 0 && errno == EINTR);
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        // Somebody else took the data; wait for more, letting `future_cancel` stop the read meanwhile
+        atomic_fetch_and_explicit(&future->state, ~FUTURE_STARTED, memory_order_relaxed);
+        runnable_t runnable = {.function = read_work, .arg = future, .argsz = sizeof(future_t)};
+        if (defer_on_readable(future->pool, request->fd, runnable) == 0) {
+            TRACE(TRACE_END, "read", future, NULL);
+            return;
+        }
+        errno = EAGAIN;
+    }
+    if (count < 0) {
+        future->res = NULL;
+        future->res_size = (size_t) errno;
+    } else {
+        future->res = request->buf;
+        future->res_size = (size_t) count;
+    }
+    future_complete(future);
+    TRACE(TRACE_END, "read", future, NULL);
+}
+
+// Same as `async`, but the task reads from `fd` into `buf` once `fd` is readable
+// Return error code, or 0 on success
+int async_read(thread_pool_t *pool, future_t *future, int fd, void *buf, size_t count) {
+    if (pool == NULL || future == NULL || (buf == NULL && count > 0)) {
+        return NULL_POINTER_ERROR;
+    }
+
+    callable_t callable = {.function = NULL, .arg = buf, .argsz = count};
+    return_on_err(future_init(callable, future));
+    future->pool = pool;
+    read_request_t *request = (read_request_t *) future->inline_res;
+    request->fd = fd;
+    request->buf = buf;
+    request->count = count;
+
+    runnable_t runnable = {.function = read_work, .arg = future, .argsz = sizeof(future_t)};
+    return defer_on_readable(pool, fd, runnable);
+}
+
+// Same as `async`, but the result is written into the Future itself
+// Return error code, or 0 on success
+int async_inline(thread_pool_t *pool, future_t *future, inline_callable_t callable) {
+    if (pool == NULL || future == NULL) {
+        return NULL_POINTER_ERROR;
+    }
+
+    callable_t plain = {.function = NULL, .arg = callable.arg, .argsz = callable.argsz};
+    return_on_err(future_init(plain, future));
+    future->inline_function = callable.function;
+
+    runnable_t runnable;
+    runnable.function = async_work;
+    runnable.arg = future;
+    runnable.argsz = sizeof(future_t);
     return defer(pool, runnable);
 }
 
-// Job that waits for one future to finish and then starts calculations on the second one using obtained result
+// Runs `n` tasks described by `callables` asynchronously, writing their Futures to `futures[0..n)`
+// Jobs are handed to the pool with `defer_batch`, in chunks of ASYNC_BATCH_CHUNK to avoid allocating
+// Return error code, or 0 on success; on error only some of the tasks may have been started
+int async_batch(thread_pool_t *pool, future_t *futures, callable_t *callables, size_t n) {
+    if (pool == NULL || ((futures == NULL || callables == NULL) && n > 0)) {
+        return NULL_POINTER_ERROR;
+    }
+
+    runnable_t runnables[ASYNC_BATCH_CHUNK];
+    for (size_t done = 0; done < n; ) {
+        size_t chunk = n - done < ASYNC_BATCH_CHUNK ? n - done : ASYNC_BATCH_CHUNK;
+        for (size_t i = 0; i < chunk; i++) {
+            return_on_err(future_init(callables[done + i], &futures[done + i]));
+            runnables[i].function = async_work;
+            runnables[i].arg = &futures[done + i];
+            runnables[i].argsz = sizeof(future_t);
+        }
+        return_on_err(defer_batch(pool, runnables, chunk));
+        done += chunk;
+    }
+
+    return 0;
+}
+
+// Job that starts calculations on the result of a Future that is already done
+// Deferred only once the source Future is done, so it never waits
 // Silently ignores errors
 void map_work(
-        void *arg, // typeof(arg) == future_t[2]
+        void *arg, // typeof(arg) == future_t
         size_t argsz __attribute__((unused)))
 {
     // Extract Futures
-    future_t **futures = (future_t **) arg;
-    future_t *old = futures[0];
-    future_t *new = futures[1];
+    future_t *new = (future_t *) arg;
+    future_t *old = new->source;
 
-    // Wait for first calculation
-    // TODO: it can happen that all but one threads in the threadpool await on some Future
-    // TODO: while there is another that might have possibly started working but is waiting
-    // TODO: in the jobqueue for the awaiting threads
-    // TODO: Solution: instead of `await`ing, suspend execution and move to the back of the queue?
-    await(old);
+    // Cancellation of the first calculation cancels the second one, unless the first one ran anyway
+    if (cancelled_before_start(old)) {
+        atomic_fetch_or_explicit(&new->state, FUTURE_CANCELLED, memory_order_relaxed);
+    }
 
     // Run second calculation on the result of the first calculation
     new->callable.arg = old->res;
     new->callable.argsz = old->res_size;
-    // re-use this thread to not get put at the end of the jobqueue
-    async_work(new, sizeof(future_t));
+    // the result is already there, so calculate it right here
+    TRACE(TRACE_START, "map", new, old);
+    run_callable(new);
+    TRACE(TRACE_END, "map", new, old);
+}
 
-    free(arg); // allocation in `map`
+// Common part of `map_prio`, `map_affinity` and `map_inline`; exactly one of `function` and `inline_function`
+// is used
+// Return error code, or 0 on success
+static int chain(thread_pool_t *pool, future_t *future, future_t *from, callable_function_t function,
+                 inline_callable_function_t inline_function, job_priority_t priority, map_affinity_t affinity) {
+    if (pool == NULL || future == NULL || from == NULL) {
+        return NULL_POINTER_ERROR;
+    }
+
+    // prepare new future
+    callable_t callable;
+    callable.function = function;
+    // callable.arg, .argsz will be set in `map_work` before running `async_work` with the callable
+    return_on_err(future_init(callable, future));
+    future->inline_function = inline_function;
+    // the new Future remembers where its argument comes from, so no extra memory is needed for the job
+    future->source = from;
+    future->pool = pool;
+    future->priority = priority;
+    future->affinity = affinity;
+
+    // If `from` is not done yet, the new Future waits on its list of continuations;
+    // `async_work` will defer it once the result is there
+    future->continuation.run = defer_mapped;
+    if (future_add_continuation(from, &future->continuation)) {
+        return 0;
+    }
+
+    // Deferring is last instruction; return its error code
+    return defer_map_job(future);
 }
 
 // Defer to `pool` a job that will call function `function` on the result of calculation
@@ -103,46 +417,308 @@ void map_work(
 // in space pointed to by `future`
 // Return error code, or 0 on success
 int map(thread_pool_t *pool, future_t *future, future_t *from, callable_function_t function) {
-    if (pool == NULL || future == NULL || from == NULL) {
+    return map_prio(pool, future, from, function, PRIORITY_NORMAL);
+}
+
+// Same as `map`, but the job goes to lane `priority` of `pool`
+// Return error code, or 0 on success
+int map_prio(thread_pool_t *pool, future_t *future, future_t *from, callable_function_t function,
+             job_priority_t priority) {
+    return chain(pool, future, from, function, NULL, priority, MAP_ANY_WORKER);
+}
+
+// Same as `map`, but the job runs on (or preferably on) the worker that completed `from`
+// Return error code, or 0 on success
+int map_affinity(thread_pool_t *pool, future_t *future, future_t *from, callable_function_t function,
+                 map_affinity_t affinity) {
+    return chain(pool, future, from, function, NULL, PRIORITY_NORMAL, affinity);
+}
+
+// Same as `map`, but `function` writes its result into `future`
+// Return error code, or 0 on success
+int map_inline(thread_pool_t *pool, future_t *future, future_t *from, inline_callable_function_t function) {
+    return chain(pool, future, from, NULL, function, PRIORITY_NORMAL, MAP_ANY_WORKER);
+}
+
+
+// Continuation of a single input of `when_all` / `when_any`
+typedef struct combinator_entry {
+    continuation_t continuation;
+    struct combinator *combinator;
+} combinator_entry_t;
+
+// State of a `when_all` / `when_any` call; freed once all its inputs are done
+typedef struct combinator {
+    future_t *future;
+    future_t **inputs;
+    size_t n;
+    atomic_size_t remaining; // Inputs not done yet
+    atomic_bool decided; // Set by the first input done (`when_any` only)
+    combinator_entry_t entries[]; // One per input
+} combinator_t;
+
+// Continuation of an input of `when_all`: the last input done completes the Future
+static void all_input_done(continuation_t *continuation, future_t *source __attribute__((unused))) {
+    combinator_t *combinator = ((combinator_entry_t *) continuation)->combinator;
+    if (atomic_fetch_sub_explicit(&combinator->remaining, 1, memory_order_acq_rel) == 1) {
+        future_t *future = combinator->future;
+        future->res = combinator->inputs;
+        future->res_size = combinator->n;
+        free(combinator); // allocation in `combine`
+        future_complete(future);
+    }
+}
+
+// Continuation of an input of `when_any`: the first input done completes the Future
+static void any_input_done(continuation_t *continuation, future_t *source) {
+    combinator_entry_t *entry = (combinator_entry_t *) continuation;
+    combinator_t *combinator = entry->combinator;
+    if (!atomic_exchange_explicit(&combinator->decided, true, memory_order_relaxed)) {
+        future_t *future = combinator->future;
+        future->res = source;
+        future->res_size = (size_t) (entry - combinator->entries);
+        future_complete(future);
+    }
+    if (atomic_fetch_sub_explicit(&combinator->remaining, 1, memory_order_acq_rel) == 1) {
+        free(combinator); // allocation in `combine`
+    }
+}
+
+// Common part of `when_all` and `when_any`: puts a continuation running `run` on every input
+// Return error code, or 0 on success
+static int combine(thread_pool_t *pool, future_t *future, future_t **inputs, size_t n,
+                   void (*run)(continuation_t *, future_t *)) {
+    if (pool == NULL || future == NULL || (inputs == NULL && n > 0)) {
         return NULL_POINTER_ERROR;
     }
+    for (size_t i = 0; i < n; i++) {
+        if (inputs[i] == NULL) {
+            return NULL_POINTER_ERROR;
+        }
+    }
+
+    callable_t callable = {.function = NULL, .arg = NULL, .argsz = 0};
+    return_on_err(future_init(callable, future));
+    future->pool = pool;
+    if (n == 0) {
+        future->res = run == all_input_done ? inputs : NULL;
+        future_complete(future);
+        return 0;
+    }
 
-    // allocation of space for two Future pointers so that worker will read and write data to space pointed to by them
-    // freeing will be done by `map_work`
-    future_t **future_ptrs = (future_t **) calloc(2, sizeof(future_t *));
-    if (future_ptrs == NULL) {
+    // A single allocation, whatever the number of inputs
+    combinator_t *combinator = (combinator_t *) malloc(sizeof(combinator_t) + n * sizeof(combinator_entry_t));
+    if (combinator == NULL) {
         return MEMORY_ALLOCATION_ERROR;
     }
+    combinator->future = future;
+    combinator->inputs = inputs;
+    combinator->n = n;
+    atomic_init(&combinator->remaining, n);
+    atomic_init(&combinator->decided, false);
 
-    // copy pointers to Futures
-    future_ptrs[0] = from;
-    future_ptrs[1] = future;
+    // Inputs that are done already are counted right here; the last one may free `combinator`,
+    // so it's not touched after the loop
+    for (size_t i = 0; i < n; i++) {
+        combinator_entry_t *entry = &combinator->entries[i];
+        entry->continuation.run = run;
+        entry->combinator = combinator;
+        if (!future_add_continuation(inputs[i], &entry->continuation)) {
+            run(&entry->continuation, inputs[i]);
+        }
+    }
+    return 0;
+}
 
-    // prepare new future
-    callable_t callable;
-    callable.function = function;
-    // callable.arg, .argsz will be set in `map_work` before running `async_work` with the callable
-    return_on_err(future_init(callable, future_ptrs[1]));
+// Makes `future` done once all `n` Futures of `inputs` are done
+// Return error code, or 0 on success
+int when_all(thread_pool_t *pool, future_t *future, future_t **inputs, size_t n) {
+    return combine(pool, future, inputs, n, all_input_done);
+}
 
-    // prepare runnable with `map_work` as a function to run, and the two Futures as arg
-    runnable_t runnable;
-    runnable.arg = future_ptrs;
-    runnable.argsz = 2 * sizeof(future_t);
-    runnable.function = map_work;
+// Makes `future` done once any of `n` Futures of `inputs` is done
+// Return error code, or 0 on success
+int when_any(thread_pool_t *pool, future_t *future, future_t **inputs, size_t n) {
+    return combine(pool, future, inputs, n, any_input_done);
+}
 
-    // Deferring is last instruction; return its error code
-    return defer(pool, runnable);
+// Converts a point in time of `stats_now_ns` to a deadline of `futex_wait_until`
+static void to_timespec(uint64_t at_ns, struct timespec *deadline) {
+    deadline->tv_sec = (time_t) (at_ns / 1000000000u);
+    deadline->tv_nsec = (long) (at_ns % 1000000000u);
+}
+
+// Waits for `future` to be done, at most until `deadline_ns` (0 means no deadline)
+// Called from a pool worker, runs jobs of its pool in the meantime; called from a fiber without a deadline,
+// suspends the fiber
+// Returns whether `future` is done
+static bool wait_for(future_t *future, uint64_t deadline_ns) {
+    bool in_fiber = fiber_active();
+    if (in_fiber && deadline_ns == 0) {
+        if (!(atomic_load_explicit(&future->state, memory_order_acquire) & FUTURE_DONE)) {
+            fiber_await(future);
+        }
+        return true;
+    }
+
+    // Jobs run meanwhile would pile up on the small stack of a fiber, so a fiber waiting with a deadline
+    // just blocks its worker
+    thread_pool_t *pool = in_fiber ? NULL : thread_pool_current();
+    uint32_t state = atomic_load_explicit(&future->state, memory_order_acquire);
+    while (!(state & FUTURE_DONE)) {
+        uint64_t now_ns = deadline_ns != 0 || pool != NULL ? stats_now_ns() : 0;
+        if (deadline_ns != 0 && now_ns >= deadline_ns) {
+            return false;
+        }
+
+        // A worker can't just block: the job completing `future` may be waiting behind it,
+        // possibly in its own deque
+        if (pool != NULL && thread_pool_help(pool)) {
+            state = atomic_load_explicit(&future->state, memory_order_acquire);
+            continue;
+        }
+
+        // Announce that somebody sleeps, so that `async_work` knows it has to wake us up
+        if (!(state & FUTURE_WAITERS)) {
+            if (!atomic_compare_exchange_weak_explicit(&future->state, &state, state | FUTURE_WAITERS,
+                                                       memory_order_acquire, memory_order_acquire)) {
+                continue;
+            }
+            state |= FUTURE_WAITERS;
+        }
+
+        // A worker wakes up now and then to look for jobs again
+        uint64_t wake_ns = deadline_ns;
+        if (pool != NULL && (wake_ns == 0 || wake_ns - now_ns > AWAIT_HELP_SLEEP_NS)) {
+            wake_ns = now_ns + AWAIT_HELP_SLEEP_NS;
+        }
+        if (wake_ns == 0) {
+            futex_wait(&future->state, state);
+        } else {
+            struct timespec deadline;
+            to_timespec(wake_ns, &deadline);
+            futex_wait_until(&future->state, state, &deadline);
+        }
+        state = atomic_load_explicit(&future->state, memory_order_acquire);
+    }
+    return true;
 }
 
 // Wait for Future `future` to have its calculation complete;
 // Returns pointer to the result
+// Called from a pool worker, runs jobs of its pool in the meantime
 // Ignores silently errors
 void *await(future_t *future) {
-    silent_on_err(pthread_mutex_lock(&future->done_mutex));
-    while (!future->done) {
-        silent_on_err(pthread_cond_wait(&future->done_cond, &future->done_mutex));
+    wait_for(future, 0);
+    return future->res;
+}
+
+// Wait for Future `future` at most until `deadline_ns` and store pointer to the result in `*res`
+// Return TIMEOUT_ERROR if `future` is not done by the deadline, or 0 on success
+int await_until(future_t *future, uint64_t deadline_ns, void **res) {
+    if (future == NULL || res == NULL) {
+        return NULL_POINTER_ERROR;
+    }
+    if (!wait_for(future, deadline_ns > 0 ? deadline_ns : 1)) {
+        return TIMEOUT_ERROR;
     }
-    silent_on_err(pthread_mutex_unlock(&future->done_mutex));
+    *res = future->res;
+    return 0;
+}
 
-    return future->res;
+// Same as `await_until`, with the deadline `timeout_ns` from now
+// Return TIMEOUT_ERROR if `future` is not done in time, or 0 on success
+int await_timeout(future_t *future, uint64_t timeout_ns, void **res) {
+    return await_until(future, stats_now_ns() + timeout_ns, res);
+}
+
+// Cancels `future` unless it's done already
+// Returns true if the callable was cancelled before it started
+bool future_cancel(future_t *future) {
+    uint32_t state = atomic_load_explicit(&future->state, memory_order_relaxed);
+    while (!(state & (FUTURE_DONE | FUTURE_CANCELLED))) {
+        if (atomic_compare_exchange_weak_explicit(&future->state, &state, state | FUTURE_CANCELLED,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            return !(state & FUTURE_STARTED);
+        }
+    }
+    return false;
+}
+
+// Returns whether `future` has been cancelled
+bool future_cancelled(const future_t *future) {
+    return atomic_load_explicit(&future->state, memory_order_relaxed) & FUTURE_CANCELLED;
+}
+
+// Makes `future` the one whose callable runs on the calling thread; returns the previous one
+const future_t *future_set_current(const future_t *future) {
+    const future_t *previous = current_future;
+    current_future = future;
+    return previous;
+}
+
+// Returns the token of the callable running on the calling thread
+cancel_token_t cancel_token_current(void) {
+    cancel_token_t token = {.future = current_future};
+    return token;
+}
+
+// Returns whether the Future of `token` has been cancelled
+bool cancel_token_cancelled(cancel_token_t token) {
+    return token.future != NULL && future_cancelled(token.future);
+}
+
+// Initialises empty group of Futures in memory pointed to by `group`
+// Returns error code, or 0 on success
+int future_group_init(future_group_t *group) {
+    if (group == NULL) {
+        return NULL_POINTER_ERROR;
+    }
+    group->chunks = NULL;
+    group->current = NULL;
+    group->used = 0;
+    group->allocations = 0;
+    return 0;
+}
+
+// Hands out a Future of `group`: from the current chunk, from the next one kept by a reset,
+// or from a new chunk appended to the list
+// Returns NULL if memory runs out
+future_t *future_group_alloc(future_group_t *group) {
+    if (group->current == NULL || group->used == FUTURE_GROUP_CHUNK) {
+        future_group_chunk_t *next = group->current != NULL ? group->current->next : group->chunks;
+        if (next == NULL) {
+            // Chunks are cache-aligned, so plain `malloc` is not enough
+            if (posix_memalign((void **) &next, 64, sizeof(future_group_chunk_t)) != 0) {
+                return NULL;
+            }
+            next->next = NULL;
+            group->allocations++;
+            if (group->current != NULL) {
+                group->current->next = next;
+            } else {
+                group->chunks = next;
+            }
+        }
+        group->current = next;
+        group->used = 0;
+    }
+    return &group->current->slots[group->used++].future;
+}
+
+// Takes all Futures of `group` back in O(1), keeping its chunks
+void future_group_reset(future_group_t *group) {
+    group->current = NULL;
+    group->used = 0;
+}
+
+// Destroys `group` together with all its Futures
+void future_group_destroy(future_group_t *group) {
+    while (group->chunks != NULL) {
+        future_group_chunk_t *chunk = group->chunks;
+        group->chunks = chunk->next;
+        free(chunk); // allocation in `future_group_alloc`
+    }
+    group->current = NULL;
+    group->used = 0;
 }
@@ -1,6 +1,11 @@
 #ifndef FUTURE_H
 #define FUTURE_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
 #include "threadpool.h"
 
 // Alias to make code more readable
@@ -13,18 +18,108 @@ typedef struct callable {
     size_t argsz;
 } callable_t;
 
+// Size of the result buffer inside every Future
+#define FUTURE_INLINE_SIZE 48
+
+// Variant of `callable_function_t` for small results: writes at most FUTURE_INLINE_SIZE bytes of the result
+// to `res` (inside the Future, aligned like `max_align_t`) and returns their number
+typedef size_t (*inline_callable_function_t)(void *arg, size_t argsz, void *res);
+
+// Describes async task with a small result
+typedef struct inline_callable {
+    inline_callable_function_t function;
+    void *arg;
+    size_t argsz;
+} inline_callable_t;
+
+// Bits of `future_t.state`
+#define FUTURE_DONE 1u // Result is ready
+#define FUTURE_WAITERS 2u // Some thread sleeps in `await` (on a futex on `state`)
+#define FUTURE_STARTED 4u // The callable has started; cleared again if the job finds the Future cancelled
+#define FUTURE_CANCELLED 8u // `future_cancel` was called before the Future was done
+
+// Where the job of a Future created by `map_affinity` runs once its source is done
+typedef enum map_affinity {
+    MAP_ANY_WORKER = 0, // Wherever the pool puts it, as with `map`
+    MAP_SAME_WORKER = 1, // Only on the worker that completed the source (see `defer_on`)
+    MAP_PREFER_SAME_WORKER = 2 // On the worker that completed the source unless another steals it (see `defer_local`)
+} map_affinity_t;
+
+struct future;
+
+// Entry on a Future's list of things to do once it's done
+typedef struct continuation {
+    struct continuation *next;
+    void (*run)(struct continuation *self, struct future *source); // Called by whoever completes `source`
+} continuation_t;
+
 // Represents result of calculation that might have not yet been completed; use `await` or `map` to use the result
 typedef struct future {
     callable_t callable;
-    void *res;
+    inline_callable_function_t inline_function; // Used instead of `callable.function` unless NULL
+    void *res; // Points to `inline_res` if the result is stored there
     size_t res_size;
+    _Alignas(max_align_t) unsigned char inline_res[FUTURE_INLINE_SIZE];
 
-    // `done` and `done_cond` can be accessed concurrently, so we'll protect them with a mutex
-    pthread_mutex_t done_mutex;
-    pthread_cond_t done_cond;
-    bool done;
+    // Set by `map` on the dependent Future:
+    struct future *source; // Future whose result is the argument of `callable`
+    thread_pool_t *pool; // Pool that runs `callable` once `source` is done
+    job_priority_t priority; // Lane of `pool` that runs `callable`
+    map_affinity_t affinity; // Worker of `pool` that runs `callable`
+    continuation_t continuation; // Entry on `source->continuations`
+
+    // Lock-free stack of continuations (e.g. of Futures created by `map` from this one), run once it's done;
+    // closed with a marker value on completion, after which `map` defers directly
+    _Atomic(continuation_t *) continuations;
+    _Atomic uint32_t state; // FUTURE_DONE | FUTURE_WAITERS | FUTURE_STARTED | FUTURE_CANCELLED
 } future_t;
 
+// Number of Futures in a chunk of a `future_group_t`
+#define FUTURE_GROUP_CHUNK 64
+
+// Future of a group, alone on its cache lines, so that workers completing neighbours don't contend
+typedef struct future_slot {
+    future_t future;
+} __attribute__((aligned(64))) future_slot_t;
+
+// Chunk of Futures of a group; chunks are kept until the group is destroyed
+typedef struct future_group_chunk {
+    struct future_group_chunk *next; // Next chunk handed out from after this one
+    future_slot_t slots[FUTURE_GROUP_CHUNK];
+} future_group_chunk_t;
+
+// Arena of Futures: hands them out from cache-aligned chunks and takes all of them back at once, so that
+// a batch of tasks needs neither an array of Futures sized up front nor a `future_destroy` for each of them
+// Not thread-safe: a single thread at a time hands Futures out, resets and destroys the group
+typedef struct future_group {
+    future_group_chunk_t *chunks; // All chunks, in the order they are handed out from
+    future_group_chunk_t *current; // Chunk handed out from now, NULL if none yet
+    size_t used; // Futures of `current` handed out
+    size_t allocations; // Number of chunks ever allocated
+} future_group_t;
+
+// Lets a running callable find out whether its Future has been cancelled; see `cancel_token_current`
+typedef struct cancel_token {
+    const future_t *future; // NULL outside of callables run by the pool
+} cancel_token_t;
+
+
+// Creates a future_t in space pointed to by `future`, with result to be calculated by `callable`
+// Needed only by code that computes results outside of `async` jobs (see `future_complete`)
+// Returns error code, or 0 on success
+int future_init(callable_t callable, future_t *future);
+
+// Puts `continuation` on the list of `source`, to be run by whoever completes it
+// Returns false if `source` is done already (and the caller has to run it)
+bool future_add_continuation(future_t *source, continuation_t *continuation);
+
+// Marks `future`, whose result is already stored in `res` and `res_size`, as done: wakes up threads
+// in `await` and runs its continuations
+void future_complete(future_t *future);
+
+// Makes `future` the one whose callable runs on the calling thread (see `cancel_token_current`)
+// Needed only by code that runs callables outside of `async` jobs; returns the previous one
+const future_t *future_set_current(const future_t *future);
 
 // Runs task described by `callable` asynchronously
 // `pool` –> Pool that will execute the task
@@ -33,18 +128,124 @@ typedef struct future {
 // Return error code, or 0 on success
 int async(thread_pool_t *pool, future_t *future, callable_t callable);
 
+// Same as `async`, but the task goes to lane `priority` of `pool`
+// Return error code, or 0 on success
+int async_prio(thread_pool_t *pool, future_t *future, callable_t callable, job_priority_t priority);
+
+// Same as `async`, but the task starts only once `delay_ns` nanoseconds have passed (see `defer_after`);
+// until then it takes no worker, and `future_cancel` keeps it from running at all
+// Return error code, or 0 on success
+int async_after(thread_pool_t *pool, future_t *future, callable_t callable, uint64_t delay_ns);
+
+// Same as `async`, but instead of running a callable the task reads at most `count` bytes from file descriptor
+// `fd` into `buf`, once `fd` is readable (see `defer_on_readable`), so no worker blocks in `read` meanwhile
+// The result is `buf`, with the number of bytes read as its size (0 at end of file); if `read` fails, it is NULL,
+// with its `errno` as the size. An O_NONBLOCK `fd` drained by another reader first is waited for again
+// Return error code, or 0 on success
+int async_read(thread_pool_t *pool, future_t *future, int fd, void *buf, size_t count);
+
+// Same as `async`, but the result is written into the Future itself, so nothing has to be allocated for it;
+// `await` returns a pointer into `future`, valid as long as the Future is
+// Return error code, or 0 on success
+int async_inline(thread_pool_t *pool, future_t *future, inline_callable_t callable);
+
+// Runs `n` tasks described by `callables` asynchronously, writing their Futures to `futures[0..n)`
+// Much cheaper than `n` calls to `async`: jobs are queued in large batches with `defer_batch`
+// Return error code, or 0 on success; on error only some of the tasks may have been started
+int async_batch(thread_pool_t *pool, future_t *futures, callable_t *callables, size_t n);
+
 // Defer to `pool` a job that will call function `function` on the result of calculation
 // described by `from`; Future describing result of the final calculation will be stored
 // in space pointed to by `future`
+// The job is deferred only once `from` is done, so no worker ever waits for `from`
 // Return error code, or 0 on success
 int map(thread_pool_t *pool, future_t *future, future_t *from, callable_function_t function);
 
+// Same as `map`, but `function` writes its result into `future` (see `async_inline`)
+// A result of `from` stored inline is passed to `function` in place, without copying
+// Return error code, or 0 on success
+int map_inline(thread_pool_t *pool, future_t *future, future_t *from, inline_callable_function_t function);
+
+// Same as `map`, but the job goes to lane `priority` of `pool`
+// Return error code, or 0 on success
+int map_prio(thread_pool_t *pool, future_t *future, future_t *from, callable_function_t function,
+             job_priority_t priority);
+
+// Same as `map`, but the job runs on (or, with MAP_PREFER_SAME_WORKER, preferably on) the worker that completed
+// `from`, whose caches likely hold the data `function` works on; a chain of such Futures stays on a single CPU
+// If `from` is done already, that's the calling thread if it is a worker of `pool`; if the worker isn't one
+// of `pool` (or `from` was completed outside of any pool), the job goes wherever `map` would put it
+// Return error code, or 0 on success
+int map_affinity(thread_pool_t *pool, future_t *future, future_t *from, callable_function_t function,
+                 map_affinity_t affinity);
+
+// Makes `future` done once all `n` Futures of `inputs` are done; `inputs` must stay valid until then
+// The result of `future` is `inputs` itself, with `n` as its size, so `map` on it gets all the results
+// Each input that gets done costs a single atomic decrement, run by whoever completes it; no jobs are deferred
+// `pool` is recorded in `future` as the pool of its calculation
+// Return error code, or 0 on success
+int when_all(thread_pool_t *pool, future_t *future, future_t **inputs, size_t n);
+
+// Makes `future` done once any of `n` Futures of `inputs` is done (at once if `n` == 0)
+// The result of `future` is the first input that got done, with its index in `inputs` as the size
+// Other inputs must still get done before the memory `when_any` allocated is released
+// Return error code, or 0 on success
+int when_any(thread_pool_t *pool, future_t *future, future_t **inputs, size_t n);
+
 // Wait for Future `future` to have its calculation complete;
 // Returns pointer to the result
+// A Future that is already done costs a single atomic load
+// Called from a pool worker (e.g. by a task that forks and joins), runs other jobs of its pool until `future`
+// is done, so that the worker isn't wasted and a small pool can't deadlock
 // Ignores silently errors
 void *await(future_t *future);
 
+// Wait for Future `future` at most until `deadline_ns` (of CLOCK_MONOTONIC, as `stats_now_ns`)
+// and store pointer to the result in `*res`
+// Called from a pool worker, runs jobs of its pool in the meantime, like `await`
+// Return TIMEOUT_ERROR if `future` is not done by the deadline, or 0 on success
+int await_until(future_t *future, uint64_t deadline_ns, void **res);
+
+// Same as `await_until`, with the deadline `timeout_ns` from now
+// Return TIMEOUT_ERROR if `future` is not done in time, or 0 on success
+int await_timeout(future_t *future, uint64_t timeout_ns, void **res);
+
+// Cancels `future`: if its callable hasn't started yet, it never will, and the Future gets done with a NULL
+// result as soon as its job is taken from the queue (the job can't be removed, so the Future must stay valid
+// until it's done); a callable that runs already can notice through its `cancel_token_t`
+// Futures created by `map` from a Future cancelled before its callable started are cancelled too, without
+// deferring their jobs; those of a callable cancelled while running get its result like any other
+// Returns true if the callable was cancelled before it started
+bool future_cancel(future_t *future);
+
+// Returns whether `future` has been cancelled
+bool future_cancelled(const future_t *future);
+
+// Returns the token of the callable running on the calling thread
+cancel_token_t cancel_token_current(void);
+
+// Returns whether the Future of `token` has been cancelled; meant to be polled by long-running callables
+bool cancel_token_cancelled(cancel_token_t token);
+
+// Initialises empty group of Futures in memory pointed to by `group`; nothing is allocated until it's used
+// Returns error code, or 0 on success
+int future_group_init(future_group_t *group);
+
+// Hands out a Future of `group`, to be set up by `async`, `map`, `when_all` or any other function that
+// creates a Future; it stays valid until the group is reset or destroyed
+// Returns NULL if memory runs out
+future_t *future_group_alloc(future_group_t *group);
+
+// Takes all Futures of `group` back in O(1), keeping its chunks to hand them out again
+// All of them must be done, and no continuation or `await` may still use them
+void future_group_reset(future_group_t *group);
+
+// Destroys `group` together with all its Futures (which must be done, as for `future_group_reset`);
+// the cost is a `free` per chunk, not anything per Future
+void future_group_destroy(future_group_t *group);
+
 // Destroys `future`
+// Futures hold no resources, but every Future should still be destroyed once it's no longer needed
 // Silently ignores all errors
 void future_destroy(future_t *future);
 
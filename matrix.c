@@ -1,8 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <unistd.h>
 
 #include "threadpool.h"
+#include "future.h"
+#include "parallel.h"
 #include "err.h"
 
 typedef struct matrix_cell {
@@ -15,11 +16,31 @@ typedef struct job_description {
     int res;
 } job_description_t;
 
-void cell_worker(void *arg, size_t argsz __attribute__((unused))) {
-    job_description_t *job = (job_description_t *) arg;
-    matrix_cell_t cell = job->matrix_cell;
-    usleep(cell.time * 1000);
-    job->res = cell.value;
+// Computes a cell of the matrix; runs once the cell's time has passed, so the wait takes no worker
+void *cell_worker(void *job_description_, size_t argsz __attribute__((unused)), size_t *retsz) {
+    job_description_t *job_description = (job_description_t *) job_description_;
+    job_description->res = job_description->matrix_cell.value;
+    *retsz = sizeof(int);
+    return &job_description->res;
+}
+
+// Cells of the matrix and the sums of its rows
+typedef struct matrix {
+    job_description_t *cells;
+    int n; // Cells in a row
+    int *sums;
+} matrix_t;
+
+// Sums rows [begin, end) of the matrix in `matrix_`
+void rows_worker(void *matrix_, size_t begin, size_t end) {
+    matrix_t *matrix = (matrix_t *) matrix_;
+    for (size_t i = begin; i < end; i++) {
+        int sum = 0;
+        for (int j = 0; j < matrix->n; j++) {
+            sum += matrix->cells[i * matrix->n + j].res;
+        }
+        matrix->sums[i] = sum;
+    }
 }
 
 int main() {
@@ -27,7 +48,11 @@ int main() {
     scanf("%d", &k);
     scanf("%d", &n);
 
-    job_description_t *jobs_matrix = (job_description_t *) calloc(k * n, sizeof(job_description_t));
+    size_t cells = (size_t) k * n;
+    job_description_t *jobs_matrix = (job_description_t *) calloc(cells, sizeof(job_description_t));
+    if (jobs_matrix == NULL) {
+        return MEMORY_ALLOCATION_ERROR;
+    }
 
     thread_pool_t pool;
     silent_on_err(thread_pool_init(&pool, 4));
@@ -35,33 +60,60 @@ int main() {
     int v, t;
     matrix_cell_t cell;
     job_description_t job_description;
-    runnable_t job;
-    for (int i = 0; i < k * n; i++) {
+    for (size_t i = 0; i < cells; i++) {
         scanf("%d %d", &v, &t);
         cell.value = v;
         cell.time = t;
         job_description.matrix_cell = cell;
         jobs_matrix[i] = job_description;
+    }
 
-        job.function = cell_worker;
-        job.arg = &jobs_matrix[i];
-        job.argsz = sizeof(job_description);
+    // Every cell is a delayed task, so all the cells wait at the same time and the whole matrix
+    // takes about as long as its slowest cell
+    future_t *futures = (future_t *) calloc(cells, sizeof(future_t));
+    int *sums = (int *) calloc(k > 0 ? (size_t) k : 1, sizeof(int));
+    if (futures == NULL || sums == NULL) {
+        thread_pool_destroy(&pool);
+        free(futures);
+        free(sums);
+        free(jobs_matrix);
+        return MEMORY_ALLOCATION_ERROR;
+    }
+    int err = 0;
+    size_t started = 0;
+    while (started < cells) {
+        callable_t callable = {.function = cell_worker, .arg = &jobs_matrix[started],
+                               .argsz = sizeof(job_description_t)};
+        err = async_after(&pool, &futures[started], callable,
+                          (uint64_t) jobs_matrix[started].matrix_cell.time * 1000000u);
+        if (err != 0) {
+            break;
+        }
+        started++;
+    }
+    // Only the Futures of started cells are initialised
+    for (size_t i = 0; i < started; i++) {
+        await(&futures[i]);
+        future_destroy(&futures[i]);
+    }
+    free(futures);
 
-        defer(&pool, job);
+    // Rows are summed in parallel as well, each row a separate piece
+    matrix_t matrix = {.cells = jobs_matrix, .n = n, .sums = sums};
+    if (err == 0) {
+        err = parallel_for(&pool, 0, (size_t) k, 1, rows_worker, &matrix);
     }
 
     thread_pool_destroy(&pool);
 
-    int sum;
-    for (int i = 0; i < k; i++) {
-        sum = 0;
-        for (int j = 0; j < n; j++) {
-            sum += jobs_matrix[i * n + j].res;
+    if (err == 0) {
+        for (int i = 0; i < k; i++) {
+            printf("%d\n", sums[i]);
         }
-        printf("%d\n", sum);
     }
 
+    free(sums);
     free(jobs_matrix);
 
-    return 0;
+    return err;
 }
\ No newline at end of file
@@ -0,0 +1,271 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdalign.h>
+#include <stddef.h>
+
+#include "parallel.h"
+#include "futex.h"
+
+// The range is split as a binary tree numbered like a heap: node 1 is [begin, end), node k has children 2k and 2k+1
+// When a participant splits its node, it keeps the left half and defers the right half as a separate piece;
+// states of the pieces let the caller take back pieces that no worker has started yet
+#define NODE_UNUSED 0 // Not split off, taken back after `defer` failed, or a left half (which stays with its parent)
+#define NODE_DEFERRED 1 // Split off and waiting for a participant
+#define NODE_CLAIMED 2 // Taken by a participant
+
+#define MAX_DEPTH 12
+
+// State of a single `parallel_for` / `parallel_reduce` call
+// Freed by whoever drops the last reference: the caller or one of the deferred jobs (which may run late)
+typedef struct parallel_loop {
+    thread_pool_t *pool;
+    size_t begin;
+    size_t end;
+    size_t grain;
+    range_function_t for_function;
+    range_reduce_function_t reduce_function;
+    void *ctx;
+    const void *identity;
+    size_t acc_size; // 0 for `parallel_for`
+    size_t acc_stride; // `acc_size` rounded up to keep accumulators aligned
+
+    unsigned int eager_depth; // Pieces are always split down to this depth
+    unsigned int max_depth; // Deeper than `eager_depth` pieces are split only while some worker is idle
+    size_t node_count; // 2^(max_depth + 1)
+
+    atomic_size_t remaining; // Indices not processed yet
+    _Atomic uint32_t done; // Set to 1 (and woken on) when `remaining` drops to 0
+    atomic_size_t references;
+
+    atomic_uchar *nodes; // NODE_* state of every node
+    unsigned char *accumulators; // One accumulator per claimed node (`parallel_reduce` only)
+    size_t (*order)[2]; // Scratch space for sorting accumulators: (first index, node) pairs
+} parallel_loop_t;
+
+static unsigned int node_depth(size_t node) {
+    return (unsigned int) (sizeof(unsigned long long) * CHAR_BIT - 1 - __builtin_clzll(node));
+}
+
+static unsigned int ceil_log2(size_t n) {
+    unsigned int res = 0;
+    while (((size_t) 1 << res) < n) {
+        res++;
+    }
+    return res;
+}
+
+// Computes the range of indices of `node`
+static void node_range(const parallel_loop_t *loop, size_t node, size_t *begin, size_t *end) {
+    size_t b = loop->begin;
+    size_t e = loop->end;
+    for (unsigned int bit = node_depth(node); bit-- > 0; ) {
+        size_t mid = b + (e - b) / 2;
+        if ((node >> bit) & 1) {
+            b = mid;
+        } else {
+            e = mid;
+        }
+    }
+    *begin = b;
+    *end = e;
+}
+
+static void release_loop(parallel_loop_t *loop) {
+    if (atomic_fetch_sub_explicit(&loop->references, 1, memory_order_acq_rel) == 1) {
+        free(loop);
+    }
+}
+
+void piece_job(void *arg, size_t node);
+
+// Processes claimed `node`, splitting off its right halves for other participants while it's worth it
+static void run_piece(parallel_loop_t *loop, size_t node) {
+    size_t begin, end;
+    node_range(loop, node, &begin, &end);
+
+    void *acc = NULL;
+    if (loop->acc_size > 0) {
+        acc = loop->accumulators + node * loop->acc_stride;
+        memcpy(acc, loop->identity, loop->acc_size);
+    }
+
+    size_t split = node;
+    unsigned int depth = node_depth(node);
+    while (end - begin > loop->grain && depth < loop->max_depth
+           && (depth < loop->eager_depth
+               || atomic_load_explicit(&loop->pool->idle_count, memory_order_relaxed) > 0)) {
+        size_t right = 2 * split + 1;
+        atomic_store_explicit(&loop->nodes[right], NODE_DEFERRED, memory_order_release);
+        atomic_fetch_add_explicit(&loop->references, 1, memory_order_relaxed);
+
+        runnable_t runnable;
+        runnable.function = piece_job;
+        runnable.arg = loop;
+        runnable.argsz = right;
+        if (defer(loop->pool, runnable) != 0) {
+            // Nobody may look for the piece anymore (the caller could be past its last scan), so take it back
+            // and keep the whole range, unless somebody has claimed it in the meantime
+            release_loop(loop);
+            unsigned char expected = NODE_DEFERRED;
+            if (atomic_compare_exchange_strong_explicit(&loop->nodes[right], &expected, NODE_UNUSED,
+                                                        memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        }
+
+        split = 2 * split;
+        depth++;
+        end = begin + (end - begin) / 2;
+    }
+
+    if (loop->reduce_function != NULL) {
+        loop->reduce_function(loop->ctx, begin, end, acc);
+    } else {
+        loop->for_function(loop->ctx, begin, end);
+    }
+
+    // The participant that processes the last indices wakes up the caller
+    if (atomic_fetch_sub_explicit(&loop->remaining, end - begin, memory_order_acq_rel) == end - begin) {
+        atomic_store_explicit(&loop->done, 1, memory_order_release);
+        futex_wake(&loop->done, INT_MAX);
+    }
+}
+
+// Tries to take `node` for the calling thread; returns whether it succeeded
+static bool claim_piece(parallel_loop_t *loop, size_t node) {
+    unsigned char expected = NODE_DEFERRED;
+    return atomic_load_explicit(&loop->nodes[node], memory_order_relaxed) == NODE_DEFERRED
+           && atomic_compare_exchange_strong_explicit(&loop->nodes[node], &expected, NODE_CLAIMED,
+                                                      memory_order_acquire, memory_order_relaxed);
+}
+
+// Job processing a piece split off by `run_piece`, unless the caller took it back already
+void piece_job(void *arg, size_t node) {
+    parallel_loop_t *loop = (parallel_loop_t *) arg;
+    if (claim_piece(loop, node)) {
+        run_piece(loop, node);
+    }
+    release_loop(loop);
+}
+
+static int compare_first(const void *a, const void *b) {
+    size_t x = *(const size_t *) a;
+    size_t y = *(const size_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Merges accumulators of all claimed nodes into `result`, in index order
+static void combine_accumulators(parallel_loop_t *loop, combine_function_t combine, void *result) {
+    // Ranges of claimed nodes are disjoint, so sorting them by their first index puts them in order
+    size_t count = 0;
+    for (size_t node = 1; node < loop->node_count; node++) {
+        if (atomic_load_explicit(&loop->nodes[node], memory_order_relaxed) == NODE_CLAIMED) {
+            size_t begin, end;
+            node_range(loop, node, &begin, &end);
+            loop->order[count][0] = begin;
+            loop->order[count][1] = node;
+            count++;
+        }
+    }
+    qsort(loop->order, count, sizeof(loop->order[0]), compare_first);
+
+    for (size_t i = 0; i < count; i++) {
+        combine(loop->ctx, result, loop->accumulators + loop->order[i][1] * loop->acc_stride);
+    }
+}
+
+// Common part of `parallel_for` and `parallel_reduce`
+static int run_loop(thread_pool_t *pool, size_t begin, size_t end, size_t grain,
+                    range_function_t for_function, range_reduce_function_t reduce_function,
+                    combine_function_t combine, void *ctx, void *result, size_t result_size) {
+    if (end <= begin) {
+        return 0;
+    }
+
+    // A few pieces per participant (the workers and the caller) are made up front, more only on demand
+    unsigned int eager_depth = ceil_log2(pool->thread_count + 1) + 1;
+    unsigned int max_depth = eager_depth + 3 < MAX_DEPTH ? eager_depth + 3 : MAX_DEPTH;
+    size_t node_count = (size_t) 1 << (max_depth + 1);
+    size_t acc_stride = (result_size + alignof(max_align_t) - 1) / alignof(max_align_t) * alignof(max_align_t);
+
+    // Everything the loop needs is a single allocation, whatever the size of the range
+    size_t accumulators_offset = (sizeof(parallel_loop_t) + node_count + alignof(max_align_t) - 1)
+                                 / alignof(max_align_t) * alignof(max_align_t);
+    size_t order_offset = accumulators_offset + (result_size > 0 ? node_count * acc_stride : 0);
+    size_t order_size = result_size > 0 ? node_count * 2 * sizeof(size_t) : 0;
+    unsigned char *memory = (unsigned char *) calloc(1, order_offset + order_size);
+    if (memory == NULL) {
+        return MEMORY_ALLOCATION_ERROR;
+    }
+
+    parallel_loop_t *loop = (parallel_loop_t *) memory;
+    loop->pool = pool;
+    loop->begin = begin;
+    loop->end = end;
+    loop->grain = grain > 0 ? grain : 1;
+    loop->for_function = for_function;
+    loop->reduce_function = reduce_function;
+    loop->ctx = ctx;
+    loop->identity = result;
+    loop->acc_size = result_size;
+    loop->acc_stride = acc_stride;
+    loop->eager_depth = eager_depth;
+    loop->max_depth = max_depth;
+    loop->node_count = node_count;
+    atomic_init(&loop->remaining, end - begin);
+    atomic_init(&loop->done, 0);
+    atomic_init(&loop->references, 1); // The caller's
+    loop->nodes = (atomic_uchar *) (memory + sizeof(parallel_loop_t));
+    loop->accumulators = memory + accumulators_offset;
+    loop->order = (size_t (*)[2]) (memory + order_offset);
+
+    // The caller processes the whole range, except for the pieces workers manage to take
+    atomic_store_explicit(&loop->nodes[1], NODE_CLAIMED, memory_order_relaxed);
+    run_piece(loop, 1);
+
+    // Take back pieces that are still waiting in the pool; this also makes calls from a worker
+    // of a busy (or 1-thread) pool safe
+    bool found = true;
+    while (found && !atomic_load_explicit(&loop->done, memory_order_acquire)) {
+        found = false;
+        for (size_t node = 2; node < node_count; node++) {
+            if (claim_piece(loop, node)) {
+                run_piece(loop, node);
+                found = true;
+            }
+        }
+    }
+
+    // Wait for pieces being processed by workers
+    while (!atomic_load_explicit(&loop->done, memory_order_acquire)) {
+        futex_wait(&loop->done, 0);
+    }
+
+    if (result_size > 0) {
+        combine_accumulators(loop, combine, result);
+    }
+    release_loop(loop);
+    return 0;
+}
+
+// Calls `fn` on subranges of [begin, end) in `pool`, and returns once all of them are processed
+// Return error code, or 0 on success
+int parallel_for(thread_pool_t *pool, size_t begin, size_t end, size_t grain, range_function_t fn, void *ctx) {
+    if (pool == NULL || fn == NULL) {
+        return NULL_POINTER_ERROR;
+    }
+    return run_loop(pool, begin, end, grain, fn, NULL, NULL, ctx, NULL, 0);
+}
+
+// Reduces [begin, end) in `pool` like `parallel_for`, into `result` of `result_size` bytes
+// Return error code, or 0 on success
+int parallel_reduce(thread_pool_t *pool, size_t begin, size_t end, size_t grain,
+                    range_reduce_function_t fn, combine_function_t combine, void *ctx,
+                    void *result, size_t result_size) {
+    if (pool == NULL || fn == NULL || combine == NULL || result == NULL) {
+        return NULL_POINTER_ERROR;
+    }
+    return run_loop(pool, begin, end, grain, NULL, fn, combine, ctx, result, result_size);
+}
@@ -0,0 +1,32 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+
+#include "threadpool.h"
+
+// Body of a parallel loop: processes indices [begin, end)
+typedef void (*range_function_t)(void *ctx, size_t begin, size_t end);
+
+// Body of a parallel reduction: folds indices [begin, end) into accumulator `acc`
+typedef void (*range_reduce_function_t)(void *ctx, size_t begin, size_t end, void *acc);
+
+// Merges accumulator `from` (covering later indices) into accumulator `into` (covering earlier ones)
+typedef void (*combine_function_t)(void *ctx, void *into, const void *from);
+
+// Calls `fn` on subranges of [begin, end) in `pool`, and returns once all of them are processed
+// The range is split in halves recursively down to pieces of about `grain` indices (0 means 1);
+// beyond a few pieces per thread, pieces are split off only while some worker is idle
+// The calling thread processes pieces too, so it may be a worker of `pool` itself
+// Return error code, or 0 on success
+int parallel_for(thread_pool_t *pool, size_t begin, size_t end, size_t grain, range_function_t fn, void *ctx);
+
+// Reduces [begin, end) in `pool` like `parallel_for`, into `result` of `result_size` bytes
+// `result` must contain the identity element on entry: every accumulator starts as its copy
+// Accumulators of pieces are combined in index order, so `combine` has to be associative, but not commutative
+// Return error code, or 0 on success
+int parallel_reduce(thread_pool_t *pool, size_t begin, size_t end, size_t grain,
+                    range_reduce_function_t fn, combine_function_t combine, void *ctx,
+                    void *result, size_t result_size);
+
+#endif
@@ -3,47 +3,70 @@
 #include "queue.h"
 #include "err.h"
 
-// Initialise queue and return pointer to it (NULL on error)
-queue_t *queue_init() {
+#define QUEUE_INITIAL_SLOTS 64
+
+// Initialise queue holding at most `capacity` elements (0 means unbounded) and return pointer to it
+// (NULL on error)
+queue_t *queue_init(size_t capacity) {
     queue_t *res = (queue_t *) calloc(1, sizeof(queue_t));
     if (res == NULL) {
         return NULL;
     }
 
-    res->first = NULL;
-    res->last = NULL;
+    // A bounded queue gets its whole ring up front, so pushing never allocates
+    size_t slots = QUEUE_INITIAL_SLOTS;
+    while (slots < capacity) {
+        slots *= 2;
+    }
+    res->elements = (void **) calloc(slots, sizeof(void *));
+    if (res->elements == NULL) {
+        free(res);
+        return NULL;
+    }
+    res->slots = slots;
+    res->first = 0;
     res->size = 0;
+    res->capacity = capacity;
+    res->allocations = 1;
     return res;
 }
 
 // Destroy the queue.
 void queue_destroy(queue_t *queue) {
-    while (queue->size > 0) {
-        queue_pop(queue);
-    }
+    free(queue->elements); // allocation in `queue_init` or `grow`
     free(queue);
 }
 
-// Push element pointer to queue.
+// Doubles the ring of `queue`, moving the elements to the beginning of the new one
 // Return error code, 0 on success
-int queue_push(queue_t *queue, void *element) {
-    queue_node_t *node = (queue_node_t *) calloc(1, sizeof(queue_node_t));
-    if (node == NULL) {
+static int grow(queue_t *queue) {
+    void **elements = (void **) calloc(2 * queue->slots, sizeof(void *));
+    if (elements == NULL) {
         return MEMORY_ALLOCATION_ERROR;
     }
+    for (size_t i = 0; i < queue->size; i++) {
+        elements[i] = queue->elements[(queue->first + i) & (queue->slots - 1)];
+    }
+    free(queue->elements);
+    queue->elements = elements;
+    queue->slots *= 2;
+    queue->first = 0;
+    queue->allocations++;
+    return 0;
+}
 
-    node->element = element;
-    node->next = NULL;
-
-    if (queue->size == 0) {
-        queue->first = node;
-    } else {
-        queue->last->next = node;
+// Push element pointer to queue.
+// Return error code (QUEUE_FULL_ERROR if a bounded queue is full), 0 on success
+int queue_push(queue_t *queue, void *element) {
+    if (queue->capacity > 0 && queue->size >= queue->capacity) {
+        return QUEUE_FULL_ERROR;
+    }
+    if (queue->size == queue->slots) {
+        return_on_err(grow(queue));
     }
 
-    queue->last = node;
+    queue->elements[(queue->first + queue->size) & (queue->slots - 1)] = element;
     queue->size++;
-
     return 0;
 }
 
@@ -52,20 +75,13 @@ void *queue_pop(queue_t *queue) {
     if (queue->size == 0) {
         return NULL;
     }
-    queue_node_t *node = queue->first;
-    void *res = node->element;
-
-    if (queue->size == 1) {
-        queue->last = NULL;
-    }
-
-    queue->first = node->next;
+    void *res = queue->elements[queue->first];
+    queue->first = (queue->first + 1) & (queue->slots - 1);
     queue->size--;
-    free(node); // allocation in `queue_push`
     return res;
 }
 
 // Returns whether if queue is empty
 bool queue_empty(queue_t *queue) {
     return queue->size == 0;
-}
\ No newline at end of file
+}
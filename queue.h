@@ -4,25 +4,26 @@
 #include <stddef.h>
 #include <stdbool.h>
 
-typedef struct queue_node {
-    void *element; // Pointer to data stored at this node
-    struct queue_node *next;
-} queue_node_t;
-
+// FIFO queue of element pointers in a ring buffer
+// An unbounded queue doubles its ring when it fills up; a bounded one refuses new elements instead
 typedef struct queue {
+    void **elements; // Ring of `slots` (a power of two) element pointers
+    size_t slots;
+    size_t first; // Position of the oldest element in the ring
     size_t size; // Number of elements in the queue
-    queue_node_t *first;
-    queue_node_t *last;
+    size_t capacity; // Maximal number of elements, 0 if unbounded
+    size_t allocations; // Number of rings ever allocated
 } queue_t;
 
-// Initialise queue and return pointer to it (NULL on error)
-queue_t *queue_init();
+// Initialise queue holding at most `capacity` elements (0 means unbounded) and return pointer to it
+// (NULL on error)
+queue_t *queue_init(size_t capacity);
 
 // Destroy the queue.
 void queue_destroy(queue_t *queue);
 
 // Push element pointer to queue.
-// Return error code, 0 on success
+// Return error code (QUEUE_FULL_ERROR if a bounded queue is full), 0 on success
 int queue_push(queue_t *queue, void *element);
 
 // Pops element pointer from the queue (NULL if queue is empty)
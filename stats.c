@@ -0,0 +1,51 @@
+#include <time.h>
+
+#include "stats.h"
+
+// Monotonic clock in nanoseconds
+uint64_t stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+// Adds `value` to a counter written only by the calling thread
+void stats_add(_Atomic uint64_t *counter, uint64_t value) {
+    // Not an RMW: there is a single writer, readers only need not to see torn values
+    uint64_t old = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, old + value, memory_order_relaxed);
+}
+
+// Counts `duration_ns` in the histogram
+void stats_record(_Atomic uint64_t *histogram, uint64_t duration_ns) {
+    size_t bucket = duration_ns == 0 ? 0 : (size_t) (63 - __builtin_clzll(duration_ns));
+    if (bucket >= STATS_HISTOGRAM_BUCKETS) {
+        bucket = STATS_HISTOGRAM_BUCKETS - 1;
+    }
+    stats_add(&histogram[bucket], 1);
+}
+
+// Returns the upper bound (in ns) of the bucket containing the `percentile`-th (0..100) duration in `histogram`
+// Returns 0 for an empty histogram
+uint64_t stats_percentile(const uint64_t *histogram, double percentile) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        count += histogram[i];
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t) ((double) count * percentile / 100.0);
+    if (rank >= count) {
+        rank = count - 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram[i];
+        if (seen > rank) {
+            return (uint64_t) 1 << (i + 1);
+        }
+    }
+    return (uint64_t) 1 << STATS_HISTOGRAM_BUCKETS;
+}
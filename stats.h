@@ -0,0 +1,62 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Statistics of the threadpool; collected only when compiled with ASYNCC_STATS defined
+// (CMake option of the same name), otherwise the hot paths contain no trace of them
+
+// Histograms are log-bucketed: bucket i counts durations in [2^i, 2^(i+1)) ns, the last one everything longer
+#define STATS_HISTOGRAM_BUCKETS 40
+
+// Counters of a single worker
+// Every counter has a single writer (its worker), so it is updated with relaxed loads and stores, not RMWs,
+// and the structure is aligned to a cache line, so that workers never share one
+typedef struct worker_stats {
+    _Atomic uint64_t executed; // Jobs run
+    _Atomic uint64_t idle; // Times the worker ran out of jobs
+    _Atomic uint64_t spin_hits; // Times the worker found a job while spinning, before parking
+    _Atomic uint64_t parks; // Times the worker went to sleep waiting for jobs
+    _Atomic uint64_t queue_wait_ns; // Total time jobs spent between `defer` and start
+    _Atomic uint64_t run_ns; // Total time of running jobs
+    _Atomic uint64_t queue_wait_histogram[STATS_HISTOGRAM_BUCKETS];
+    _Atomic uint64_t run_histogram[STATS_HISTOGRAM_BUCKETS];
+} __attribute__((aligned(64))) worker_stats_t;
+
+// Copy of the counters of a single worker
+typedef struct worker_stats_snapshot {
+    uint64_t executed;
+    uint64_t idle;
+    uint64_t spin_hits;
+    uint64_t parks;
+    uint64_t queue_wait_ns;
+    uint64_t run_ns;
+} worker_stats_snapshot_t;
+
+// Copy of the statistics of the whole pool; create with `thread_pool_stats`, release with `thread_pool_stats_destroy`
+typedef struct thread_pool_stats {
+    size_t queue_depth; // Jobs deferred but not started yet
+    size_t worker_count; // Worker slots; in an elastic pool some of them may have no running thread
+    size_t live_workers; // Workers running at the time of the snapshot
+    worker_stats_snapshot_t *workers; // Array of `worker_count` snapshots
+    worker_stats_snapshot_t total; // Sums over all workers
+    uint64_t queue_wait_histogram[STATS_HISTOGRAM_BUCKETS]; // Merged histograms of all workers
+    uint64_t run_histogram[STATS_HISTOGRAM_BUCKETS];
+} thread_pool_stats_t;
+
+// Monotonic clock in nanoseconds
+uint64_t stats_now_ns(void);
+
+// Adds `value` to a counter written only by the calling thread
+void stats_add(_Atomic uint64_t *counter, uint64_t value);
+
+// Counts `duration_ns` in the histogram
+void stats_record(_Atomic uint64_t *histogram, uint64_t duration_ns);
+
+// Returns the upper bound (in ns) of the bucket containing the `percentile`-th (0..100) duration in `histogram`
+// Returns 0 for an empty histogram
+uint64_t stats_percentile(const uint64_t *histogram, double percentile);
+
+#endif //_STATS_H_
@@ -1,9 +1,15 @@
+#include <sched.h>
+#include <semaphore.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 #include "future.h"
 #include "minunit.h"
+#include "trace.h"
 
 int tests_run = 0;
 static thread_pool_t pool;
@@ -32,8 +38,660 @@ static char *test_await_simple() {
   return 0;
 }
 
+#define CHAIN_LENGTH 10000
+
+static void *increment(void *arg, size_t argsz,
+                       size_t *retsz __attribute__((unused))) {
+  ++*(int *)arg;
+  *retsz = argsz;
+  return arg;
+}
+
+typedef struct gated_counter {
+  sem_t gate;
+  int counter;
+} gated_counter_t;
+
+static void *wait_for_gate(void *arg, size_t argsz __attribute__((unused)),
+                           size_t *retsz) {
+  gated_counter_t *gated = arg;
+  sem_wait(&gated->gate);
+  *retsz = sizeof(int);
+  return &gated->counter;
+}
+
+// The whole chain is built while its first Future is still running,
+// so a worker blocked in `await` would never let the chain progress
+static char *test_map_chain_single_thread() {
+  thread_pool_init(&pool, 1);
+
+  gated_counter_t gated = {.counter = 0};
+  sem_init(&gated.gate, 0, 0);
+  future_t *futures = malloc(sizeof(future_t) * (CHAIN_LENGTH + 1));
+  async(&pool, &futures[0],
+        (callable_t){.function = wait_for_gate, .arg = &gated});
+  for (int i = 0; i < CHAIN_LENGTH; i++) {
+    map(&pool, &futures[i + 1], &futures[i], increment);
+  }
+
+  sem_post(&gated.gate);
+  int *res = await(&futures[CHAIN_LENGTH]);
+  mu_assert("expected CHAIN_LENGTH increments", *res == CHAIN_LENGTH);
+
+  thread_pool_destroy(&pool);
+  for (int i = 0; i <= CHAIN_LENGTH; i++) {
+    future_destroy(&futures[i]);
+  }
+  free(futures);
+  sem_destroy(&gated.gate);
+  return 0;
+}
+
+#define AFFINITY_CHAIN 100
+
+typedef struct affinity_chain {
+  sem_t gate;
+  size_t steps;
+  size_t workers[AFFINITY_CHAIN + 1];
+} affinity_chain_t;
+
+static void *record_step(void *arg, size_t argsz, size_t *retsz) {
+  affinity_chain_t *chain = arg;
+  thread_pool_worker_index(&pool, &chain->workers[chain->steps++]);
+  *retsz = argsz;
+  return chain;
+}
+
+static void *gated_step(void *arg, size_t argsz, size_t *retsz) {
+  affinity_chain_t *chain = arg;
+  sem_wait(&chain->gate);
+  return record_step(arg, argsz, retsz);
+}
+
+// The chain waits on the gate, so every step is a continuation run by the
+// worker that completed the step before
+static char *test_map_affinity() {
+  thread_pool_init(&pool, 4);
+
+  map_affinity_t affinities[] = {MAP_SAME_WORKER, MAP_PREFER_SAME_WORKER};
+  for (int a = 0; a < 2; a++) {
+    affinity_chain_t chain = {.steps = 0};
+    sem_init(&chain.gate, 0, 0);
+    future_t futures[AFFINITY_CHAIN + 1];
+    async(&pool, &futures[0],
+          (callable_t){.function = gated_step,
+                       .arg = &chain,
+                       .argsz = sizeof(chain)});
+    for (int i = 0; i < AFFINITY_CHAIN; i++) {
+      map_affinity(&pool, &futures[i + 1], &futures[i], record_step,
+                   affinities[a]);
+    }
+
+    sem_post(&chain.gate);
+    await(&futures[AFFINITY_CHAIN]);
+    mu_assert("expected every step to run",
+              chain.steps == AFFINITY_CHAIN + 1);
+    for (int i = 0; affinities[a] == MAP_SAME_WORKER && i <= AFFINITY_CHAIN;
+         i++) {
+      mu_assert("expected the chain to stay on a single worker",
+                chain.workers[i] == chain.workers[0]);
+    }
+    sem_destroy(&chain.gate);
+  }
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+#define GROUP_FUTURES 200
+#define GROUP_ROUNDS 3
+
+// Batches of tasks reuse the chunks of a group once it's reset
+static char *test_future_group() {
+  thread_pool_init(&pool, 2);
+  future_group_t group;
+  mu_assert("future_group_init failed", future_group_init(&group) == 0);
+
+  int args[GROUP_FUTURES];
+  size_t allocations = 0;
+  for (int round = 0; round < GROUP_ROUNDS; round++) {
+    future_t *futures[GROUP_FUTURES];
+    for (int i = 0; i < GROUP_FUTURES; i++) {
+      args[i] = i + round;
+      futures[i] = future_group_alloc(&group);
+      mu_assert("expected cache-aligned Futures",
+                ((uintptr_t)futures[i] & 63) == 0);
+      async(&pool, futures[i],
+            (callable_t){.function = squared, .arg = &args[i]});
+    }
+    for (int i = 0; i < GROUP_FUTURES; i++) {
+      int *m = await(futures[i]);
+      mu_assert("expected a square", *m == (i + round) * (i + round));
+      free(m);
+    }
+
+    if (round == 0) {
+      allocations = group.allocations;
+    }
+    mu_assert("expected a reset group to reuse its chunks",
+              group.allocations == allocations);
+    future_group_reset(&group);
+  }
+  mu_assert("expected chunks of FUTURE_GROUP_CHUNK Futures",
+            allocations ==
+                (GROUP_FUTURES + FUTURE_GROUP_CHUNK - 1) / FUTURE_GROUP_CHUNK);
+
+  thread_pool_destroy(&pool);
+  future_group_destroy(&group);
+  return 0;
+}
+
+#define BATCH_SIZE 100
+
+static char *test_async_batch() {
+  thread_pool_init(&pool, 2);
+
+  int args[BATCH_SIZE];
+  callable_t callables[BATCH_SIZE];
+  future_t futures[BATCH_SIZE];
+  for (int i = 0; i < BATCH_SIZE; i++) {
+    args[i] = i;
+    callables[i] =
+        (callable_t){.function = squared, .arg = &args[i], .argsz = sizeof(int)};
+  }
+  mu_assert("async_batch failed",
+            async_batch(&pool, futures, callables, BATCH_SIZE) == 0);
+
+  for (int i = 0; i < BATCH_SIZE; i++) {
+    int *m = await(&futures[i]);
+    mu_assert("expected i * i", *m == i * i);
+    free(m);
+    future_destroy(&futures[i]);
+  }
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+#define SUM_N (1 << 16)
+#define SUM_LEAF 256
+
+typedef struct sum_range {
+  thread_pool_t *pool;
+  uint64_t begin;
+  uint64_t end;
+  uint64_t sum;
+} sum_range_t;
+
+// Forks both halves of the range and joins them with `await` from the worker
+static void *recursive_sum(void *arg, size_t argsz,
+                           size_t *retsz __attribute__((unused))) {
+  sum_range_t *range = arg;
+  range->sum = 0;
+  if (range->end - range->begin <= SUM_LEAF) {
+    for (uint64_t i = range->begin; i < range->end; ++i) {
+      range->sum += i;
+    }
+    return range;
+  }
+
+  uint64_t mid = range->begin + (range->end - range->begin) / 2;
+  sum_range_t halves[2] = {
+      {.pool = range->pool, .begin = range->begin, .end = mid},
+      {.pool = range->pool, .begin = mid, .end = range->end}};
+  future_t futures[2];
+  for (int i = 0; i < 2; ++i) {
+    async(range->pool, &futures[i],
+          (callable_t){
+              .function = recursive_sum, .arg = &halves[i], .argsz = argsz});
+  }
+  for (int i = 0; i < 2; ++i) {
+    sum_range_t *half = await(&futures[i]);
+    range->sum += half->sum;
+    future_destroy(&futures[i]);
+  }
+  return range;
+}
+
+// Fork-join recursion needs far more simultaneous joins than there are
+// workers, so it only finishes if awaiting workers run the pending halves
+static char *test_fork_join() {
+  scheduler_mode_t schedulers[] = {SCHEDULER_SHARED_QUEUE,
+                                   SCHEDULER_WORK_STEALING};
+  for (int s = 0; s < 2; ++s) {
+    for (size_t threads = 1; threads <= 3; ++threads) {
+      thread_pool_options_t options;
+      thread_pool_options_init(&options);
+      options.scheduler = schedulers[s];
+      thread_pool_init_with_options(&pool, threads, &options);
+
+      sum_range_t range = {.pool = &pool, .begin = 0, .end = SUM_N};
+      async(&pool, &future,
+            (callable_t){.function = recursive_sum,
+                         .arg = &range,
+                         .argsz = sizeof(sum_range_t)});
+      sum_range_t *res = await(&future);
+      mu_assert("expected the sum of 0..SUM_N-1",
+                res->sum == (uint64_t)SUM_N * (SUM_N - 1) / 2);
+      future_destroy(&future);
+
+      thread_pool_destroy(&pool);
+    }
+  }
+  return 0;
+}
+
+// Sums the squares computed by the inputs of `when_all`
+static void *sum_squares(void *arg, size_t argsz,
+                         size_t *retsz __attribute__((unused))) {
+  future_t **inputs = arg;
+  int *sum = malloc(sizeof(int));
+  *sum = 0;
+  for (size_t i = 0; i < argsz; ++i) {
+    int *square = inputs[i]->res;
+    *sum += *square;
+    free(square);
+  }
+  return sum;
+}
+
+static char *test_when_all() {
+  thread_pool_init(&pool, 2);
+
+  int args[BATCH_SIZE];
+  future_t futures[BATCH_SIZE];
+  future_t *inputs[BATCH_SIZE];
+  int expected = 0;
+  for (int i = 0; i < BATCH_SIZE; i++) {
+    args[i] = i;
+    expected += i * i;
+    async(&pool, &futures[i],
+          (callable_t){.function = squared, .arg = &args[i],
+                       .argsz = sizeof(int)});
+    inputs[i] = &futures[i];
+  }
+
+  // Some inputs may be done before `when_all` and some after
+  future_t all, sum;
+  mu_assert("when_all failed",
+            when_all(&pool, &all, inputs, BATCH_SIZE) == 0);
+  map(&pool, &sum, &all, sum_squares);
+  int *res = await(&sum);
+  mu_assert("expected the sum of squares", *res == expected);
+  free(res);
+
+  future_t none;
+  mu_assert("when_all failed", when_all(&pool, &none, inputs, 0) == 0);
+  mu_assert("expected no inputs to be done at once",
+            await(&none) == inputs);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *test_when_any() {
+  thread_pool_init(&pool, 2);
+
+  gated_counter_t gated = {.counter = 7};
+  sem_init(&gated.gate, 0, 0);
+  int n = 3;
+  future_t slow, fast, any;
+  async(&pool, &slow, (callable_t){.function = wait_for_gate, .arg = &gated});
+  async(&pool, &fast,
+        (callable_t){.function = squared, .arg = &n, .argsz = sizeof(int)});
+  future_t *inputs[] = {&slow, &fast};
+
+  mu_assert("when_any failed", when_any(&pool, &any, inputs, 2) == 0);
+  mu_assert("expected the fast input to win", await(&any) == &fast);
+  mu_assert("expected the index of the fast input", any.res_size == 1);
+  int *m = fast.res;
+  mu_assert("expected 9", *m == 9);
+  free(m);
+
+  // The slow input still has to finish before its Future goes away
+  sem_post(&gated.gate);
+  await(&slow);
+  thread_pool_destroy(&pool);
+  sem_destroy(&gated.gate);
+  return 0;
+}
+
+static void *count_call(void *arg, size_t argsz,
+                        size_t *retsz __attribute__((unused))) {
+  ++*(int *)arg;
+  *retsz = argsz;
+  return arg;
+}
+
+static char *test_cancel() {
+  thread_pool_init(&pool, 1);
+
+  // The only worker is held back, so the cancelled job is still queued
+  gated_counter_t gated = {.counter = 0};
+  sem_init(&gated.gate, 0, 0);
+  int calls = 0;
+  future_t blocker, victim, dependent;
+  async(&pool, &blocker,
+        (callable_t){.function = wait_for_gate, .arg = &gated});
+  async(&pool, &victim, (callable_t){.function = count_call, .arg = &calls});
+  map(&pool, &dependent, &victim, count_call);
+
+  mu_assert("expected to cancel a queued task", future_cancel(&victim));
+  mu_assert("expected a second cancel to do nothing", !future_cancel(&victim));
+  sem_post(&gated.gate);
+
+  mu_assert("expected no result of a cancelled task", await(&victim) == NULL);
+  mu_assert("expected the dependent to be cancelled",
+            await(&dependent) == NULL && future_cancelled(&dependent));
+  mu_assert("expected no callable to run", calls == 0);
+  mu_assert("expected a done Future not to be cancelled",
+            !future_cancel(&blocker) && !future_cancelled(&blocker));
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&gated.gate);
+  return 0;
+}
+
+#define CANCEL_CHAIN 100000
+
+// Cancelling the source of a long chain of maps must not take a stack frame
+// per link
+static char *test_cancel_chain() {
+  thread_pool_init(&pool, 1);
+  future_group_t futures;
+  future_group_init(&futures);
+
+  gated_counter_t gated = {.counter = 0};
+  sem_init(&gated.gate, 0, 0);
+  int calls = 0;
+  future_t blocker, victim;
+  async(&pool, &blocker,
+        (callable_t){.function = wait_for_gate, .arg = &gated});
+  async(&pool, &victim, (callable_t){.function = count_call, .arg = &calls});
+  future_t *last = &victim;
+  for (int i = 0; i < CANCEL_CHAIN; i++) {
+    future_t *next = future_group_alloc(&futures);
+    map(&pool, next, last, count_call);
+    last = next;
+  }
+
+  future_cancel(&victim);
+  sem_post(&gated.gate);
+  mu_assert("expected the end of the chain to be cancelled",
+            await(last) == NULL && future_cancelled(last));
+  mu_assert("expected no callable to run", calls == 0);
+  await(&blocker);
+
+  thread_pool_destroy(&pool);
+  future_group_destroy(&futures);
+  sem_destroy(&gated.gate);
+  return 0;
+}
+
+static char *test_await_timeout() {
+  thread_pool_init(&pool, 1);
+
+  gated_counter_t gated = {.counter = 5};
+  sem_init(&gated.gate, 0, 0);
+  async(&pool, &future,
+        (callable_t){.function = wait_for_gate, .arg = &gated});
+
+  void *res = NULL;
+  mu_assert("expected a timeout",
+            await_timeout(&future, 10 * 1000 * 1000, &res) == TIMEOUT_ERROR);
+  sem_post(&gated.gate);
+  mu_assert("expected the result in time",
+            await_until(&future, stats_now_ns() + 1000 * 1000 * 1000,
+                        &res) == 0);
+  mu_assert("expected 5", *(int *)res == 5);
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&gated.gate);
+  return 0;
+}
+
+// Spins until its Future gets cancelled
+static void *until_cancelled(void *arg, size_t argsz __attribute__((unused)),
+                             size_t *retsz __attribute__((unused))) {
+  cancel_token_t token = cancel_token_current();
+  sem_post(arg);
+  while (!cancel_token_cancelled(token)) {
+    sched_yield();
+  }
+  return arg;
+}
+
+static void *pass_through(void *arg, size_t argsz __attribute__((unused)),
+                          size_t *retsz __attribute__((unused))) {
+  return arg;
+}
+
+static char *test_cancel_token() {
+  thread_pool_init(&pool, 1);
+
+  sem_t started;
+  sem_init(&started, 0, 0);
+  future_t mapped;
+  async(&pool, &future,
+        (callable_t){.function = until_cancelled, .arg = &started});
+  map(&pool, &mapped, &future, pass_through);
+  sem_wait(&started);
+
+  mu_assert("expected a running task not to count as cancelled before start",
+            !future_cancel(&future));
+  mu_assert("expected the callable to notice and return",
+            await(&future) == &started && future_cancelled(&future));
+  mu_assert("expected the result of a callable that ran to be mapped",
+            await(&mapped) == &started && !future_cancelled(&mapped));
+  mu_assert("expected no token outside of callables",
+            !cancel_token_cancelled(cancel_token_current()));
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&started);
+  return 0;
+}
+
+typedef struct pair {
+  int first;
+  int second;
+} pair_t;
+
+static size_t make_pair(void *arg, size_t argsz __attribute__((unused)),
+                        void *res) {
+  pair_t *pair = res;
+  pair->first = *(int *)arg;
+  pair->second = 0;
+  return sizeof(pair_t);
+}
+
+static size_t step_pair(void *arg, size_t argsz, void *res) {
+  const pair_t *pair = arg;
+  pair_t *next = res;
+  next->first = pair->first;
+  next->second = pair->second + 1;
+  return argsz;
+}
+
+static const void *expected_arg;
+
+// Checks that the result of the previous Future is passed in place
+static void *same_arg(void *arg, size_t argsz __attribute__((unused)),
+                      size_t *retsz __attribute__((unused))) {
+  return arg == expected_arg ? arg : NULL;
+}
+
+static char *test_inline_results() {
+  thread_pool_init(&pool, 2);
+
+  int first = 42;
+  future_t *futures = malloc(sizeof(future_t) * (CHAIN_LENGTH + 1));
+  async_inline(&pool, &futures[0],
+               (inline_callable_t){.function = make_pair, .arg = &first});
+  for (int i = 0; i < CHAIN_LENGTH; i++) {
+    map_inline(&pool, &futures[i + 1], &futures[i], step_pair);
+  }
+  pair_t *res = await(&futures[CHAIN_LENGTH]);
+  mu_assert("expected the result inside the Future",
+            (void *)res == futures[CHAIN_LENGTH].inline_res);
+  mu_assert("expected CHAIN_LENGTH steps",
+            res->first == 42 && res->second == CHAIN_LENGTH);
+  mu_assert("expected the size of the result",
+            futures[CHAIN_LENGTH].res_size == sizeof(pair_t));
+
+  future_t plain;
+  expected_arg = res;
+  map(&pool, &plain, &futures[CHAIN_LENGTH], same_arg);
+  mu_assert("expected the inline result to be passed without copying",
+            await(&plain) == res);
+
+  thread_pool_destroy(&pool);
+  free(futures);
+  return 0;
+}
+
+static char *test_async_after() {
+  thread_pool_init(&pool, 1);
+
+  int n = 7, calls = 0;
+  future_t delayed, cancelled;
+  uint64_t started_ns = stats_now_ns();
+  async_after(&pool, &delayed,
+              (callable_t){.function = squared, .arg = &n}, 20000000u);
+  async_after(&pool, &cancelled,
+              (callable_t){.function = count_call, .arg = &calls}, 10000000u);
+  mu_assert("expected to cancel a waiting task", future_cancel(&cancelled));
+
+  // The only worker is free while both wait
+  async(&pool, &future, (callable_t){.function = squared, .arg = &n});
+  int *m = await(&future);
+  mu_assert("expected the plain task first",
+            !(atomic_load(&delayed.state) & FUTURE_DONE));
+  free(m);
+
+  m = await(&delayed);
+  mu_assert("expected 49 after the delay",
+            *m == 49 && stats_now_ns() - started_ns >= 20000000u);
+  free(m);
+  mu_assert("expected the cancelled task not to run",
+            await(&cancelled) == NULL && calls == 0);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *test_async_read() {
+  thread_pool_init(&pool, 1);
+  int fds[2];
+  mu_assert("socketpair failed",
+            socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+  char buf[16];
+  future_t received;
+  mu_assert("async_read failed",
+            async_read(&pool, &received, fds[0], buf, sizeof(buf)) == 0);
+
+  // The only worker is free while the read waits
+  int n = 7;
+  async(&pool, &future, (callable_t){.function = squared, .arg = &n});
+  free(await(&future));
+  mu_assert("expected the read to wait for data",
+            !(atomic_load(&received.state) & FUTURE_DONE));
+
+  mu_assert("write failed", write(fds[1], "ping", 4) == 4);
+  mu_assert("expected the data in the buffer",
+            await(&received) == buf && received.res_size == 4 &&
+                memcmp(buf, "ping", 4) == 0);
+
+  // A cancelled read takes nothing once the fd is ready
+  future_t cancelled;
+  async_read(&pool, &cancelled, fds[0], buf, sizeof(buf));
+  mu_assert("expected to cancel a waiting read", future_cancel(&cancelled));
+  mu_assert("write failed", write(fds[1], "pong", 4) == 4);
+  mu_assert("expected the cancelled read to be done with NULL",
+            await(&cancelled) == NULL);
+
+  async_read(&pool, &received, fds[0], buf, sizeof(buf));
+  mu_assert("expected the data left by the cancelled read",
+            await(&received) == buf && received.res_size == 4 &&
+                memcmp(buf, "pong", 4) == 0);
+
+  // End of file is an empty result
+  close(fds[1]);
+  async_read(&pool, &received, fds[0], buf, sizeof(buf));
+  mu_assert("expected end of file",
+            await(&received) == buf && received.res_size == 0);
+  close(fds[0]);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *test_trace() {
+  thread_pool_init(&pool, 2);
+
+  // Nothing is recorded before tracing starts
+  int n = 3;
+  async(&pool, &future, (callable_t){.function = squared, .arg = &n});
+  free(await(&future));
+
+  // The worker may record the end of that job after `await` returns, inside
+  // the session; such ends are left out of the trace
+  trace_start(0);
+  TRACE(TRACE_END, "async", &n, NULL);
+  future_t mapped;
+  async(&pool, &future, (callable_t){.function = squared, .arg = &n});
+  map(&pool, &mapped, &future, squared);
+  int *m = await(&mapped);
+  mu_assert("expected 81", *m == 81);
+  free(future.res);
+  free(m);
+  // The last events are recorded after `await` returns
+  thread_pool_destroy(&pool);
+  trace_stop();
+
+  char *json;
+  size_t length;
+  FILE *file = open_memstream(&json, &length);
+  mu_assert("trace_write failed", trace_write(file) == 0);
+  fclose(file);
+
+  char parent[64];
+  snprintf(parent, sizeof(parent), "\"parent\":\"%p\"", (void *)&future);
+  mu_assert("expected a flow from enqueue to start",
+            strstr(json, "\"ph\":\"s\"") && strstr(json, "\"ph\":\"f\""));
+  mu_assert("expected async and map slices",
+            strstr(json, "\"name\":\"async\"") &&
+                strstr(json, "\"name\":\"map\""));
+  mu_assert("expected the map to point at its source", strstr(json, parent));
+  mu_assert("expected worker names", strstr(json, " of pool "));
+  int begins = 0, ends = 0;
+  for (char *p = json; (p = strstr(p, "\"ph\":\"")) != NULL; p++) {
+    begins += p[6] == 'B';
+    ends += p[6] == 'E';
+  }
+  mu_assert("expected two jobs and two callables",
+            begins == 4 && ends == 4);
+  free(json);
+  return 0;
+}
+
 static char *all_tests() {
   mu_run_test(test_await_simple);
+  mu_run_test(test_async_batch);
+  mu_run_test(test_future_group);
+  mu_run_test(test_map_chain_single_thread);
+  mu_run_test(test_map_affinity);
+  mu_run_test(test_fork_join);
+  mu_run_test(test_when_all);
+  mu_run_test(test_when_any);
+  mu_run_test(test_cancel);
+  mu_run_test(test_cancel_chain);
+  mu_run_test(test_await_timeout);
+  mu_run_test(test_cancel_token);
+  mu_run_test(test_inline_results);
+  mu_run_test(test_async_after);
+  mu_run_test(test_async_read);
+  mu_run_test(test_trace);
   return 0;
 }
 
@@ -0,0 +1,256 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "channel.h"
+#include "fiber.h"
+#include "minunit.h"
+
+int tests_run = 0;
+
+static char *test_channel_ring() {
+  channel_t channel;
+  mu_assert("channel_init failed", channel_init(&channel, 3) == 0);
+
+  // The capacity is rounded up to a power of two
+  int values[5] = {0, 1, 2, 3, 4};
+  for (int i = 0; i < 4; i++) {
+    mu_assert("channel_try_send failed",
+              channel_try_send(&channel, &values[i]) == 0);
+  }
+  mu_assert("expected a full channel",
+            channel_try_send(&channel, &values[4]) == QUEUE_FULL_ERROR);
+  mu_assert("expected NULL items to be refused",
+            channel_try_send(&channel, NULL) == NULL_POINTER_ERROR);
+
+  void *item;
+  mu_assert("expected the oldest item", channel_try_recv(&channel, &item) &&
+                                            item == &values[0]);
+  mu_assert("expected room for another item",
+            channel_try_send(&channel, &values[4]) == 0);
+
+  // A batch takes the items in order, and at most as many as asked for
+  void *items[3];
+  size_t count;
+  mu_assert("channel_recv_batch failed",
+            channel_recv_batch(&channel, items, 3, &count) == 0);
+  mu_assert("expected a batch of 3", count == 3 && items[0] == &values[1] &&
+                                         items[2] == &values[3]);
+  mu_assert("channel_recv_batch failed",
+            channel_recv_batch(&channel, items, 3, &count) == 0);
+  mu_assert("expected the rest", count == 1 && items[0] == &values[4]);
+  mu_assert("expected an empty channel", !channel_try_recv(&channel, &item));
+
+  channel_try_send(&channel, &values[0]);
+  channel_close(&channel);
+  mu_assert("expected sends to fail once closed",
+            channel_try_send(&channel, &values[1]) == CLOSED_CHANNEL_ERROR);
+  mu_assert("expected items sent before closing",
+            channel_recv(&channel, &item) == 0 && item == &values[0]);
+  mu_assert("expected a closed and empty channel",
+            channel_recv(&channel, &item) == CLOSED_CHANNEL_ERROR);
+
+  channel_destroy(&channel);
+  return 0;
+}
+
+#define PRODUCERS 4
+#define CONSUMERS 4
+#define PRODUCER_ITEMS 5000
+#define RECV_BATCH 16
+
+typedef struct mpmc {
+  channel_t channel;
+  long values[PRODUCERS * PRODUCER_ITEMS];
+  atomic_long sum;
+  atomic_long received;
+  atomic_size_t next_producer;
+} mpmc_t;
+
+static void *produce(void *arg) {
+  mpmc_t *mpmc = arg;
+  size_t producer = atomic_fetch_add(&mpmc->next_producer, 1);
+  for (size_t i = producer; i < PRODUCERS * PRODUCER_ITEMS; i += PRODUCERS) {
+    channel_send(&mpmc->channel, &mpmc->values[i]);
+  }
+  return NULL;
+}
+
+static void *consume(void *arg) {
+  mpmc_t *mpmc = arg;
+  void *items[RECV_BATCH];
+  size_t count;
+  while (channel_recv_batch(&mpmc->channel, items, RECV_BATCH, &count) == 0) {
+    for (size_t i = 0; i < count; i++) {
+      atomic_fetch_add(&mpmc->sum, *(long *)items[i]);
+    }
+    atomic_fetch_add(&mpmc->received, (long)count);
+  }
+  return NULL;
+}
+
+// Producers block on a small channel, consumers on an empty one
+static char *test_channel_mpmc() {
+  mpmc_t *mpmc = calloc(1, sizeof(mpmc_t));
+  channel_init(&mpmc->channel, 8);
+  long expected = 0;
+  for (long i = 0; i < PRODUCERS * PRODUCER_ITEMS; i++) {
+    mpmc->values[i] = i;
+    expected += i;
+  }
+
+  pthread_t producers[PRODUCERS], consumers[CONSUMERS];
+  for (int i = 0; i < CONSUMERS; i++) {
+    pthread_create(&consumers[i], NULL, consume, mpmc);
+  }
+  for (int i = 0; i < PRODUCERS; i++) {
+    pthread_create(&producers[i], NULL, produce, mpmc);
+  }
+  for (int i = 0; i < PRODUCERS; i++) {
+    pthread_join(producers[i], NULL);
+  }
+  channel_close(&mpmc->channel);
+  for (int i = 0; i < CONSUMERS; i++) {
+    pthread_join(consumers[i], NULL);
+  }
+
+  mu_assert("expected every item once",
+            mpmc->received == PRODUCERS * PRODUCER_ITEMS &&
+                mpmc->sum == expected);
+  channel_destroy(&mpmc->channel);
+  free(mpmc);
+  return 0;
+}
+
+#define PIPELINE_ITEMS 1000
+
+typedef struct pipeline {
+  channel_t channel;
+  long values[PIPELINE_ITEMS];
+  atomic_long sum;
+} pipeline_t;
+
+static pipeline_t pipeline;
+
+static void send_value(void *arg, size_t argsz __attribute__((unused))) {
+  channel_send(&pipeline.channel, arg);
+}
+
+static void *add_value(void *arg, size_t argsz __attribute__((unused)),
+                       size_t *retsz __attribute__((unused))) {
+  atomic_fetch_add(&pipeline.sum, *(long *)arg);
+  return arg;
+}
+
+// Receivers wait through Futures, so the next stage is deferred only once
+// an item arrives, and no worker blocks
+static char *test_channel_pipeline() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 2);
+  channel_init(&pipeline.channel, 4);
+  atomic_init(&pipeline.sum, 0);
+  future_group_t futures;
+  future_group_init(&futures);
+
+  future_t *added[PIPELINE_ITEMS];
+  for (int i = 0; i < PIPELINE_ITEMS; i++) {
+    future_t *received = future_group_alloc(&futures);
+    added[i] = future_group_alloc(&futures);
+    channel_recv_future(&pipeline.channel, received);
+    map(&pool, added[i], received, add_value);
+  }
+  long expected = 0;
+  for (int i = 0; i < PIPELINE_ITEMS; i++) {
+    pipeline.values[i] = i;
+    expected += i;
+    defer(&pool, (runnable_t){.function = send_value,
+                              .arg = &pipeline.values[i]});
+  }
+  for (int i = 0; i < PIPELINE_ITEMS; i++) {
+    await(added[i]);
+  }
+  mu_assert("expected every item to pass the stage", pipeline.sum == expected);
+
+  // Closing cancels the Futures still waiting, and their stages with them
+  future_t received, added_after;
+  channel_recv_future(&pipeline.channel, &received);
+  map(&pool, &added_after, &received, add_value);
+  channel_close(&pipeline.channel);
+  mu_assert("expected a NULL result", await(&added_after) == NULL);
+  mu_assert("expected the stage to be cancelled",
+            future_cancelled(&added_after));
+
+  thread_pool_destroy(&pool);
+  future_group_destroy(&futures);
+  channel_destroy(&pipeline.channel);
+  return 0;
+}
+
+#define FIBER_ITEMS 100
+
+static void *recv_in_fiber(void *arg, size_t argsz __attribute__((unused)),
+                           size_t *retsz __attribute__((unused))) {
+  channel_t *channel = arg;
+  long *sum = malloc(sizeof(long));
+  *sum = 0;
+  void *item;
+  while (channel_recv(channel, &item) == 0) {
+    *sum += *(long *)item;
+  }
+  return sum;
+}
+
+static void send_all(void *arg __attribute__((unused)),
+                     size_t argsz __attribute__((unused))) {
+  for (int i = 0; i < FIBER_ITEMS; i++) {
+    pipeline.values[i] = i;
+    channel_send(&pipeline.channel, &pipeline.values[i]);
+  }
+  channel_close(&pipeline.channel);
+}
+
+// A fiber waiting for items suspends, so a single worker is enough for
+// both the receiver and the sender (which runs the fiber while it waits)
+static char *test_channel_fiber() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 1);
+  fiber_runtime_t runtime;
+  fiber_runtime_init(&runtime, &pool, 0);
+  channel_init(&pipeline.channel, 4);
+
+  future_t received;
+  fiber_spawn(&runtime, &received,
+              (callable_t){.function = recv_in_fiber,
+                           .arg = &pipeline.channel});
+  defer(&pool, (runnable_t){.function = send_all});
+  long *sum = await(&received);
+  mu_assert("expected the fiber to get every item",
+            *sum == FIBER_ITEMS * (FIBER_ITEMS - 1) / 2);
+  free(sum);
+
+  thread_pool_destroy(&pool);
+  fiber_runtime_destroy(&runtime);
+  channel_destroy(&pipeline.channel);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_channel_ring);
+  mu_run_test(test_channel_mpmc);
+  mu_run_test(test_channel_pipeline);
+  mu_run_test(test_channel_fiber);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ " %s\n", result);
+  } else {
+    printf(__FILE__ " ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
@@ -1,7 +1,13 @@
+#define _GNU_SOURCE // sched_getcpu
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #include "minunit.h"
 #include "threadpool.h"
@@ -50,8 +56,791 @@ static char *ping_pong() {
   return 0;
 }
 
+#define FANOUT_DEPTH 10
+
+typedef struct fanout {
+  thread_pool_t *pool;
+  atomic_int leaves;
+} fanout_t;
+
+// Every call below the maximal depth defers two children from inside the worker
+static void fanout_node(void *args, size_t depth) {
+  fanout_t *fanout = args;
+  if (depth == FANOUT_DEPTH) {
+    atomic_fetch_add(&fanout->leaves, 1);
+    return;
+  }
+  for (int i = 0; i < 2; ++i) {
+    defer(fanout->pool, (runnable_t){.function = fanout_node,
+                                     .arg = fanout,
+                                     .argsz = depth + 1});
+  }
+}
+
+static char *work_stealing_fanout() {
+  thread_pool_options_t options;
+  thread_pool_options_init(&options);
+  options.scheduler = SCHEDULER_WORK_STEALING;
+  options.deque_capacity = 16; // small enough to overflow into the shared queue
+
+  thread_pool_t pool;
+  mu_assert("init failed", thread_pool_init_with_options(&pool, 4, &options) == 0);
+
+  fanout_t fanout = {.pool = &pool};
+  atomic_init(&fanout.leaves, 0);
+  defer(&pool,
+        (runnable_t){.function = fanout_node, .arg = &fanout, .argsz = 0});
+
+  thread_pool_destroy(&pool);
+  mu_assert("expected 2^FANOUT_DEPTH leaves",
+            atomic_load(&fanout.leaves) == 1 << FANOUT_DEPTH);
+  return 0;
+}
+
+#define ROUNDS 20
+#define JOBS_PER_ROUND 200
+
+static void count_job(void *args, size_t argsz __attribute__((unused))) {
+  sem_post(args);
+}
+
+typedef struct blocking_job {
+  sem_t started;
+  sem_t release;
+} blocking_job_t;
+
+// Signals that it runs, then holds its worker until released
+static void block_job(void *args, size_t argsz __attribute__((unused))) {
+  blocking_job_t *blocking = args;
+  sem_post(&blocking->started);
+  sem_wait(&blocking->release);
+}
+
+typedef struct gate {
+  sem_t open;
+  sem_t *done;
+} gate_t;
+
+// Waits for the gate to open, then counts itself done
+static void gate_job(void *args, size_t argsz __attribute__((unused))) {
+  gate_t *gate = args;
+  sem_wait(&gate->open);
+  sem_post(gate->done);
+}
+
+// Defers `jobs` jobs while the first worker is held back, so that (in a
+// 1-thread pool) all of them are queued at once
+static void queue_round(thread_pool_t *pool, sem_t *done, int jobs) {
+  gate_t gate = {.done = done};
+  sem_init(&gate.open, 0, 0);
+  defer(pool, (runnable_t){.function = gate_job, .arg = &gate});
+  for (int i = 0; i < jobs; ++i) {
+    defer(pool, (runnable_t){.function = count_job, .arg = done});
+  }
+  sem_post(&gate.open);
+  // The gate job counts too: the gate can't be destroyed while it's waiting
+  for (int i = 0; i < jobs + 1; ++i) {
+    sem_wait(done);
+  }
+  sem_destroy(&gate.open);
+}
+
+static char *steady_state_allocations() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 1);
+
+  sem_t done;
+  sem_init(&done, 0, 0);
+
+  // The warm-up round queues more jobs than any later one
+  queue_round(&pool, &done, 2 * JOBS_PER_ROUND);
+  size_t warmed_up = thread_pool_allocations(&pool);
+  mu_assert("expected the warm-up to allocate", warmed_up > 0);
+
+  for (int round = 0; round < ROUNDS; ++round) {
+    queue_round(&pool, &done, JOBS_PER_ROUND);
+  }
+
+  mu_assert("expected no allocations after the warm-up",
+            thread_pool_allocations(&pool) == warmed_up);
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&done);
+  return 0;
+}
+
+#define BATCH_SIZE 1000
+
+static char *batch() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 3);
+
+  sem_t done;
+  sem_init(&done, 0, 0);
+
+  runnable_t jobs[BATCH_SIZE];
+  for (int i = 0; i < BATCH_SIZE; ++i) {
+    jobs[i] = (runnable_t){.function = count_job, .arg = &done};
+  }
+  mu_assert("defer_batch failed", defer_batch(&pool, jobs, BATCH_SIZE) == 0);
+  for (int i = 0; i < BATCH_SIZE; ++i) {
+    sem_wait(&done);
+  }
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&done);
+  return 0;
+}
+
+static char *stats() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 2);
+
+  sem_t done;
+  sem_init(&done, 0, 0);
+  queue_round(&pool, &done, JOBS_PER_ROUND);
+
+  thread_pool_stats_t stats;
+#ifdef ASYNCC_STATS
+  // Counters are updated right after a job returns, so the last ones may lag
+  // behind `queue_round` a little; the gate job of `queue_round` counts too
+  uint64_t histogram_total;
+  for (int attempt = 0;; ++attempt) {
+    mu_assert("thread_pool_stats failed",
+              thread_pool_stats(&pool, &stats) == 0);
+    histogram_total = 0;
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; ++i) {
+      histogram_total += stats.run_histogram[i];
+    }
+    if ((stats.total.executed == JOBS_PER_ROUND + 1 &&
+         histogram_total == stats.total.executed) ||
+        attempt == 100) {
+      break;
+    }
+    thread_pool_stats_destroy(&stats);
+    usleep(1000);
+  }
+  mu_assert("expected one snapshot per worker", stats.worker_count == 2);
+  mu_assert("expected all jobs executed",
+            stats.total.executed == JOBS_PER_ROUND + 1);
+  mu_assert("expected empty queue", stats.queue_depth == 0);
+  mu_assert("expected every job in the histogram",
+            histogram_total == stats.total.executed);
+  thread_pool_stats_destroy(&stats);
+#else
+  mu_assert("expected stats to be disabled",
+            thread_pool_stats(&pool, &stats) == STATS_DISABLED_ERROR);
+#endif
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&done);
+  return 0;
+}
+
+#define PRIORITY_JOBS 10
+
+typedef struct execution_log {
+  atomic_int next;
+  int order[3 * PRIORITY_JOBS + 1];
+} execution_log_t;
+
+static execution_log_t execution_log;
+
+// Logs its priority (passed as `argsz`) in order of execution
+static void log_priority(void *args __attribute__((unused)), size_t priority) {
+  execution_log.order[atomic_fetch_add(&execution_log.next, 1)] = priority;
+}
+
+// Queues jobs from `lanes` while the only worker is held back, then waits for
+// all of them by destroying the pool
+static void queue_priorities(thread_pool_t *pool, const job_priority_t *lanes,
+                             int count) {
+  blocking_job_t gate;
+  sem_init(&gate.started, 0, 0);
+  sem_init(&gate.release, 0, 0);
+  defer(pool, (runnable_t){.function = block_job, .arg = &gate});
+  sem_wait(&gate.started);
+  atomic_init(&execution_log.next, 0);
+  for (int i = 0; i < count; ++i) {
+    defer_prio(pool, (runnable_t){.function = log_priority, .argsz = lanes[i]},
+               lanes[i]);
+  }
+  sem_post(&gate.release);
+  thread_pool_destroy(pool);
+  sem_destroy(&gate.started);
+  sem_destroy(&gate.release);
+}
+
+static char *priorities() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 1);
+  mu_assert("expected invalid priority rejected",
+            defer_prio(&pool, (runnable_t){.function = log_priority},
+                       PRIORITY_LANES) == INVALID_PRIORITY_ERROR);
+
+  job_priority_t lanes[3 * PRIORITY_JOBS];
+  for (int i = 0; i < 3 * PRIORITY_JOBS; ++i) {
+    lanes[i] = (job_priority_t)(2 - i % 3); // low, normal, high, low, ...
+  }
+  queue_priorities(&pool, lanes, 3 * PRIORITY_JOBS);
+
+  for (int i = 0; i < 3 * PRIORITY_JOBS; ++i) {
+    mu_assert("expected higher lanes first",
+              execution_log.order[i] == i / PRIORITY_JOBS);
+  }
+  return 0;
+}
+
+static char *priority_aging() {
+  thread_pool_options_t options;
+  thread_pool_options_init(&options);
+  options.priority_aging = 4;
+  thread_pool_t pool;
+  thread_pool_init_with_options(&pool, 1, &options);
+
+  job_priority_t lanes[3 * PRIORITY_JOBS];
+  lanes[0] = PRIORITY_LOW;
+  for (int i = 1; i < 3 * PRIORITY_JOBS; ++i) {
+    lanes[i] = PRIORITY_HIGH;
+  }
+  queue_priorities(&pool, lanes, 3 * PRIORITY_JOBS);
+
+  mu_assert("expected the low job to age past 4 high ones",
+            execution_log.order[4] == PRIORITY_LOW);
+  return 0;
+}
+
+#define ELASTIC_MAX_THREADS 4
+
+// Returns once all of ELASTIC_MAX_THREADS blocking jobs run at the same time
+static void block_all_threads(thread_pool_t *pool, blocking_job_t *blocking) {
+  for (int i = 0; i < ELASTIC_MAX_THREADS; ++i) {
+    defer(pool, (runnable_t){.function = block_job, .arg = blocking});
+  }
+  for (int i = 0; i < ELASTIC_MAX_THREADS; ++i) {
+    sem_wait(&blocking->started);
+  }
+}
+
+// Waits up to ~0.5 s for the pool to shrink to `threads` workers
+static size_t wait_for_threads(thread_pool_t *pool, size_t threads) {
+  for (int attempt = 0; attempt < 500; ++attempt) {
+    if (thread_pool_threads(pool) == threads) {
+      break;
+    }
+    usleep(1000);
+  }
+  return thread_pool_threads(pool);
+}
+
+static char *elastic() {
+  scheduler_mode_t schedulers[] = {SCHEDULER_SHARED_QUEUE,
+                                   SCHEDULER_WORK_STEALING};
+  for (int s = 0; s < 2; ++s) {
+    thread_pool_options_t options;
+    thread_pool_options_init(&options);
+    options.scheduler = schedulers[s];
+    options.max_threads = ELASTIC_MAX_THREADS;
+    options.grow_queue_depth = 1;
+    options.idle_timeout_ns = 20 * 1000 * 1000;
+    thread_pool_t pool;
+    thread_pool_init_with_options(&pool, 1, &options);
+    mu_assert("expected the minimal size at start",
+              thread_pool_threads(&pool) == 1);
+
+    blocking_job_t blocking;
+    sem_init(&blocking.started, 0, 0);
+    sem_init(&blocking.release, 0, 0);
+
+    // Every blocked job needs its own thread, so the pool has to grow to finish
+    // them; the second round reuses slots of the retired workers
+    for (int round = 0; round < 2; ++round) {
+      block_all_threads(&pool, &blocking);
+      mu_assert("expected the pool to grow to the maximum",
+                thread_pool_threads(&pool) == ELASTIC_MAX_THREADS);
+      for (int i = 0; i < ELASTIC_MAX_THREADS; ++i) {
+        sem_post(&blocking.release);
+      }
+      mu_assert("expected idle workers to retire",
+                wait_for_threads(&pool, 1) == 1);
+    }
+
+    thread_pool_destroy(&pool);
+    sem_destroy(&blocking.started);
+    sem_destroy(&blocking.release);
+  }
+  return 0;
+}
+
+#define PINNED_JOBS 200
+
+typedef struct placement_log {
+  atomic_int misplaced;
+  sem_t done;
+} placement_log_t;
+
+static void check_cpu(void *args, size_t cpu) {
+  placement_log_t *log = args;
+  if (sched_getcpu() != (int)cpu) {
+    atomic_fetch_add(&log->misplaced, 1);
+  }
+  sem_post(&log->done);
+}
+
+static char *affinity() {
+  int cpus[] = {0};
+  scheduler_mode_t schedulers[] = {SCHEDULER_SHARED_QUEUE,
+                                   SCHEDULER_WORK_STEALING};
+  for (int s = 0; s < 2; ++s) {
+    thread_pool_options_t options;
+    thread_pool_options_init(&options);
+    options.scheduler = schedulers[s];
+    options.affinity = AFFINITY_PER_CPU;
+    options.cpus = cpus;
+    options.cpu_count = 1;
+    options.numa_queues = true;
+    thread_pool_t pool;
+    mu_assert("expected a pool pinned to CPU 0",
+              thread_pool_init_with_options(&pool, 2, &options) == 0);
+
+    placement_log_t log;
+    atomic_init(&log.misplaced, 0);
+    sem_init(&log.done, 0, 0);
+    for (int i = 0; i < PINNED_JOBS; ++i) {
+      defer(&pool,
+            (runnable_t){.function = check_cpu, .arg = &log, .argsz = 0});
+    }
+    for (int i = 0; i < PINNED_JOBS; ++i) {
+      sem_wait(&log.done);
+    }
+    mu_assert("expected all jobs to run on CPU 0",
+              atomic_load(&log.misplaced) == 0);
+
+    thread_pool_destroy(&pool);
+    sem_destroy(&log.done);
+  }
+
+  int invalid[] = {-1};
+  thread_pool_options_t options;
+  thread_pool_options_init(&options);
+  options.affinity = AFFINITY_CPU_SET;
+  options.cpus = invalid;
+  options.cpu_count = 1;
+  thread_pool_t pool;
+  mu_assert("expected an invalid CPU to be rejected",
+            thread_pool_init_with_options(&pool, 1, &options) ==
+                INVALID_CPU_ERROR);
+  return 0;
+}
+
+#define RELAY_HOPS 2000
+
+typedef struct relay {
+  thread_pool_t *pool;
+  sem_t done;
+} relay_t;
+
+// Passes itself on to the pool until no hops are left, like a chain of
+// short requests and responses
+static void relay_job(void *args, size_t hops) {
+  relay_t *relay = args;
+  if (hops == 0) {
+    sem_post(&relay->done);
+    return;
+  }
+  defer(relay->pool,
+        (runnable_t){.function = relay_job, .arg = relay, .argsz = hops - 1});
+}
+
+static char *idle_policies() {
+  // Parking right away, yielding only, and spinning for long
+  size_t spins[] = {0, 0, 1000000};
+  size_t yields[] = {0, 64, 8};
+  scheduler_mode_t schedulers[] = {SCHEDULER_SHARED_QUEUE,
+                                   SCHEDULER_WORK_STEALING};
+  for (int p = 0; p < 3; ++p) {
+    for (int s = 0; s < 2; ++s) {
+      thread_pool_options_t options;
+      thread_pool_options_init(&options);
+      options.scheduler = schedulers[s];
+      options.idle_spins = spins[p];
+      options.idle_yields = yields[p];
+      thread_pool_t pool;
+      thread_pool_init_with_options(&pool, 3, &options);
+
+      relay_t relay = {.pool = &pool};
+      sem_init(&relay.done, 0, 0);
+      defer(&pool, (runnable_t){.function = relay_job,
+                                .arg = &relay,
+                                .argsz = RELAY_HOPS});
+      sem_wait(&relay.done);
+
+      // Every job has to be picked up, whether workers spin or park
+      runnable_t jobs[BATCH_SIZE];
+      for (int i = 0; i < BATCH_SIZE; ++i) {
+        jobs[i] = (runnable_t){.function = count_job, .arg = &relay.done};
+      }
+      mu_assert("defer_batch failed",
+                defer_batch(&pool, jobs, BATCH_SIZE) == 0);
+      for (int i = 0; i < BATCH_SIZE; ++i) {
+        sem_wait(&relay.done);
+      }
+
+      thread_pool_destroy(&pool);
+      sem_destroy(&relay.done);
+    }
+  }
+  return 0;
+}
+
+#define QUEUE_CAPACITY 4
+#define BACKPRESSURE_JOBS 100
+
+typedef struct spawner {
+  thread_pool_t *pool;
+  sem_t *done;
+} spawner_t;
+
+// Defers BACKPRESSURE_JOBS jobs from a worker of a pool with a small queue
+static void spawn_jobs(void *args, size_t argsz __attribute__((unused))) {
+  spawner_t *spawner = args;
+  for (int i = 0; i < BACKPRESSURE_JOBS; ++i) {
+    defer(spawner->pool,
+          (runnable_t){.function = count_job, .arg = spawner->done});
+  }
+}
+
+static char *backpressure() {
+  thread_pool_options_t options;
+  thread_pool_options_init(&options);
+  options.queue_capacity = QUEUE_CAPACITY;
+  thread_pool_t pool;
+  thread_pool_init_with_options(&pool, 1, &options);
+
+  // With the only worker held back, the queue fills up
+  blocking_job_t blocking;
+  sem_init(&blocking.started, 0, 0);
+  sem_init(&blocking.release, 0, 0);
+  defer(&pool, (runnable_t){.function = block_job, .arg = &blocking});
+  sem_wait(&blocking.started);
+
+  sem_t done;
+  sem_init(&done, 0, 0);
+  runnable_t counted = {.function = count_job, .arg = &done};
+  for (int i = 0; i < QUEUE_CAPACITY; ++i) {
+    mu_assert("expected room in the queue", try_defer(&pool, counted) == 0);
+  }
+  mu_assert("expected try_defer to fail on a full queue",
+            try_defer(&pool, counted) == QUEUE_FULL_ERROR);
+  mu_assert("expected defer to fail on a full queue without blocking",
+            defer(&pool, counted) == QUEUE_FULL_ERROR);
+  sem_post(&blocking.release);
+  for (int i = 0; i < QUEUE_CAPACITY; ++i) {
+    sem_wait(&done);
+  }
+  thread_pool_destroy(&pool);
+
+  // A blocking pool takes any number of jobs, a few at a time
+  options.block_when_full = true;
+  thread_pool_init_with_options(&pool, 1, &options);
+  for (int i = 0; i < BACKPRESSURE_JOBS; ++i) {
+    mu_assert("expected defer to wait for room", defer(&pool, counted) == 0);
+  }
+  runnable_t jobs[BACKPRESSURE_JOBS];
+  for (int i = 0; i < BACKPRESSURE_JOBS; ++i) {
+    jobs[i] = counted;
+  }
+  mu_assert("expected defer_batch to wait for room",
+            defer_batch(&pool, jobs, BACKPRESSURE_JOBS) == 0);
+
+  // The only worker can't wait for itself; it runs the queued jobs instead
+  spawner_t spawner = {.pool = &pool, .done = &done};
+  defer(&pool, (runnable_t){.function = spawn_jobs, .arg = &spawner});
+  for (int i = 0; i < 3 * BACKPRESSURE_JOBS; ++i) {
+    sem_wait(&done);
+  }
+
+  thread_pool_destroy(&pool);
+  sem_destroy(&done);
+  sem_destroy(&blocking.started);
+  sem_destroy(&blocking.release);
+  return 0;
+}
+
+#define WHEEL_TIMERS 7
+
+// Drives the wheel in uneven steps; every timer must come out at the first
+// step that reaches its due tick, including those beyond the top level
+static char *timer_wheel() {
+  timer_wheel_t wheel;
+  timer_wheel_init(&wheel, 100);
+  uint64_t dues[WHEEL_TIMERS] = {3,      101,      170,     4200,
+                                 300000, 16800000, 40000000};
+  timer_entry_t entries[WHEEL_TIMERS];
+  for (int i = 0; i < WHEEL_TIMERS; ++i) {
+    timer_wheel_insert(&wheel, &entries[i], dues[i]);
+  }
+  mu_assert("expected a passed tick to mean the next one",
+            entries[0].due == 101);
+
+  int fired = 0;
+  uint64_t now = 100;
+  while (fired < WHEEL_TIMERS) {
+    uint64_t next;
+    mu_assert("expected pending timers", timer_wheel_next(&wheel, &next));
+    mu_assert("expected the next tick to be ahead", next > now);
+    uint64_t previous = now;
+    now += 1 + (now * 7919) % 5000;
+    for (timer_entry_t *entry = timer_wheel_advance(&wheel, now);
+         entry != NULL; entry = entry->next) {
+      mu_assert("expected a timer exactly when due",
+                entry->due > previous && entry->due <= now);
+      fired++;
+    }
+    if (now > 50000000) {
+      break;
+    }
+  }
+  mu_assert("expected every timer to fire", fired == WHEEL_TIMERS);
+
+  uint64_t next;
+  mu_assert("expected an empty wheel", !timer_wheel_next(&wheel, &next));
+  return 0;
+}
+
+#define DELAYED_JOBS 64
+#define DELAY_MS 1000000u
+
+typedef struct timed_job {
+  uint64_t due_ns;
+  uint64_t ran_ns;
+  sem_t *done;
+} timed_job_t;
+
+static void record_time(void *arg, size_t argsz __attribute__((unused))) {
+  timed_job_t *job = arg;
+  job->ran_ns = stats_now_ns();
+  sem_post(job->done);
+}
+
+static char *delayed_jobs() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 1);
+  sem_t done;
+  sem_init(&done, 0, 0);
+
+  // Delays cross a few boundaries of the first level of the wheel
+  timed_job_t jobs[DELAYED_JOBS];
+  for (int i = 0; i < DELAYED_JOBS; ++i) {
+    uint64_t delay_ns = (10 + (i * 37) % 150) * DELAY_MS;
+    jobs[i] =
+        (timed_job_t){.due_ns = stats_now_ns() + delay_ns, .done = &done};
+    runnable_t runnable = {.function = record_time, .arg = &jobs[i]};
+    mu_assert("defer_after failed",
+              defer_after(&pool, runnable, delay_ns) == 0);
+  }
+
+  // Waiting jobs don't hold the only worker
+  timed_job_t immediate = {.done = &done};
+  defer(&pool, (runnable_t){.function = record_time, .arg = &immediate});
+  sem_wait(&done);
+  mu_assert("expected a plain job to run before the delayed ones",
+            immediate.ran_ns < jobs[0].due_ns);
+
+  for (int i = 0; i < DELAYED_JOBS; ++i) {
+    sem_wait(&done);
+  }
+  for (int i = 0; i < DELAYED_JOBS; ++i) {
+    mu_assert("expected no delayed job to run early",
+              jobs[i].ran_ns >= jobs[i].due_ns);
+  }
+
+  // Destroying the pool waits for jobs still waiting in the wheel
+  timed_job_t last = {.done = &done};
+  defer_after(&pool, (runnable_t){.function = record_time, .arg = &last},
+              20 * DELAY_MS);
+  thread_pool_destroy(&pool);
+  mu_assert("expected destroy to run the delayed job", last.ran_ns != 0);
+
+  sem_destroy(&done);
+  return 0;
+}
+
+#define TARGET_WORKERS 4
+#define JOBS_PER_WORKER 16
+
+typedef struct pinned_job {
+  thread_pool_t *pool;
+  size_t ran_on;
+  sem_t *done;
+} pinned_job_t;
+
+static void record_worker(void *arg, size_t argsz __attribute__((unused))) {
+  pinned_job_t *job = arg;
+  if (!thread_pool_worker_index(job->pool, &job->ran_on)) {
+    job->ran_on = SIZE_MAX;
+  }
+  sem_post(job->done);
+}
+
+// Defers jobs with the local hint from a worker; they all run somewhere
+static void defer_locals(void *arg, size_t argsz __attribute__((unused))) {
+  pinned_job_t *jobs = arg;
+  for (int i = 0; i < JOBS_PER_WORKER; ++i) {
+    defer_local(jobs[i].pool,
+                (runnable_t){.function = record_worker, .arg = &jobs[i]});
+  }
+}
+
+static char *pinned_jobs() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, TARGET_WORKERS);
+  sem_t done;
+  sem_init(&done, 0, 0);
+
+  size_t index;
+  mu_assert("expected the main thread not to be a worker",
+            !thread_pool_worker_index(&pool, &index));
+  mu_assert("expected no worker beyond the pool",
+            defer_on(&pool, TARGET_WORKERS,
+                     (runnable_t){.function = record_worker}) ==
+                INVALID_WORKER_ERROR);
+
+  pinned_job_t jobs[TARGET_WORKERS][JOBS_PER_WORKER];
+  for (int i = 0; i < JOBS_PER_WORKER; ++i) {
+    for (size_t w = 0; w < TARGET_WORKERS; ++w) {
+      jobs[w][i] = (pinned_job_t){.pool = &pool, .done = &done};
+      runnable_t runnable = {.function = record_worker, .arg = &jobs[w][i]};
+      mu_assert("defer_on failed", defer_on(&pool, w, runnable) == 0);
+    }
+  }
+  for (int i = 0; i < TARGET_WORKERS * JOBS_PER_WORKER; ++i) {
+    sem_wait(&done);
+  }
+  for (size_t w = 0; w < TARGET_WORKERS; ++w) {
+    for (int i = 0; i < JOBS_PER_WORKER; ++i) {
+      mu_assert("expected a pinned job to run on its worker",
+                jobs[w][i].ran_on == w);
+    }
+  }
+
+  // Deques take the hinted jobs in SCHEDULER_SHARED_QUEUE mode too
+  defer(&pool, (runnable_t){.function = defer_locals, .arg = jobs[0]});
+  for (int i = 0; i < JOBS_PER_WORKER; ++i) {
+    sem_wait(&done);
+  }
+  for (int i = 0; i < JOBS_PER_WORKER; ++i) {
+    mu_assert("expected a hinted job to run on a worker",
+              jobs[0][i].ran_on < TARGET_WORKERS);
+  }
+  thread_pool_destroy(&pool);
+
+  // Slots of an elastic pool take pinned jobs only while a worker runs there
+  thread_pool_options_t options;
+  thread_pool_options_init(&options);
+  options.max_threads = 2;
+  thread_pool_init_with_options(&pool, 1, &options);
+  mu_assert("expected no worker in an unused slot",
+            defer_on(&pool, 1, (runnable_t){.function = record_worker}) ==
+                INVALID_WORKER_ERROR);
+  thread_pool_destroy(&pool);
+
+  sem_destroy(&done);
+  return 0;
+}
+
+#define MESSAGES 50
+
+typedef struct reader {
+  thread_pool_t *pool;
+  int fd;
+  int received;
+  int sum;
+  sem_t *done;
+} reader_t;
+
+// Reads a single message and waits for the next one, until the writer hangs up
+static void read_message(void *arg, size_t argsz __attribute__((unused))) {
+  reader_t *reader = arg;
+  int message;
+  if (read(reader->fd, &message, sizeof(message)) == sizeof(message)) {
+    reader->received++;
+    reader->sum += message;
+    defer_on_readable(reader->pool, reader->fd,
+                      (runnable_t){.function = read_message, .arg = reader});
+  } else {
+    sem_post(reader->done);
+  }
+}
+
+static void post(void *arg, size_t argsz __attribute__((unused))) {
+  sem_post(arg);
+}
+
+static char *readable_jobs() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 1);
+  sem_t done;
+  sem_init(&done, 0, 0);
+  int fds[2];
+  mu_assert("pipe failed", pipe(fds) == 0);
+
+  reader_t reader = {.pool = &pool, .fd = fds[0], .done = &done};
+  runnable_t runnable = {.function = read_message, .arg = &reader};
+  mu_assert("defer_on_readable failed",
+            defer_on_readable(&pool, fds[0], runnable) == 0);
+  mu_assert("expected a single job per fd",
+            defer_on_readable(&pool, fds[0], runnable) == EEXIST);
+
+  // The waiting job doesn't hold the only worker
+  defer(&pool, (runnable_t){.function = post, .arg = &done});
+  sem_wait(&done);
+  mu_assert("expected nothing read yet", reader.received == 0);
+
+  for (int i = 0; i < MESSAGES; ++i) {
+    mu_assert("write failed", write(fds[1], &i, sizeof(i)) == sizeof(i));
+  }
+  close(fds[1]);
+  sem_wait(&done);
+  mu_assert("expected every message",
+            reader.received == MESSAGES &&
+                reader.sum == MESSAGES * (MESSAGES - 1) / 2);
+  close(fds[0]);
+
+  // Destroying the pool waits for jobs still waiting for their fds
+  mu_assert("pipe failed", pipe(fds) == 0);
+  reader = (reader_t){.pool = &pool, .fd = fds[0], .done = &done};
+  defer_on_readable(&pool, fds[0],
+                    (runnable_t){.function = read_message, .arg = &reader});
+  int message = 1;
+  mu_assert("write failed",
+            write(fds[1], &message, sizeof(message)) == sizeof(message));
+  close(fds[1]);
+  thread_pool_destroy(&pool);
+  mu_assert("expected destroy to run the waiting jobs",
+            reader.received == 1 && sem_trywait(&done) == 0);
+  close(fds[0]);
+
+  sem_destroy(&done);
+  return 0;
+}
+
 static char *all_tests() {
   mu_run_test(ping_pong);
+  mu_run_test(work_stealing_fanout);
+  mu_run_test(steady_state_allocations);
+  mu_run_test(batch);
+  mu_run_test(stats);
+  mu_run_test(priorities);
+  mu_run_test(priority_aging);
+  mu_run_test(elastic);
+  mu_run_test(affinity);
+  mu_run_test(idle_policies);
+  mu_run_test(backpressure);
+  mu_run_test(timer_wheel);
+  mu_run_test(delayed_jobs);
+  mu_run_test(pinned_jobs);
+  mu_run_test(readable_jobs);
   return 0;
 }
 
@@ -0,0 +1,170 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fiber.h"
+#include "minunit.h"
+
+int tests_run = 0;
+
+static void *squared(void *arg, size_t argsz __attribute__((unused)),
+                     size_t *retsz __attribute__((unused))) {
+  int n = *(int *)arg;
+  int *ret = malloc(sizeof(int));
+  *ret = n * n;
+  return ret;
+}
+
+static void *squared_twice(void *arg, size_t argsz __attribute__((unused)),
+                           size_t *retsz __attribute__((unused))) {
+  future_t inner;
+  async(thread_pool_current(), &inner,
+        (callable_t){.function = squared, .arg = arg});
+  int *m = await(&inner);
+  async(thread_pool_current(), &inner,
+        (callable_t){.function = squared, .arg = m});
+  int *res = await(&inner);
+  free(m);
+  return res;
+}
+
+// With a single worker, the jobs awaited by the fiber can run only if the
+// fiber gives the worker back while it waits
+static char *test_fiber_await() {
+  thread_pool_t pool;
+  fiber_runtime_t runtime;
+  thread_pool_init(&pool, 1);
+  fiber_runtime_init(&runtime, &pool, 0);
+
+  int n = 3;
+  future_t future;
+  fiber_spawn(&runtime, &future,
+              (callable_t){.function = squared_twice, .arg = &n});
+  int *m = await(&future);
+  mu_assert("expected 81", *m == 81);
+  free(m);
+
+  thread_pool_destroy(&pool);
+  fiber_runtime_destroy(&runtime);
+  return 0;
+}
+
+#define FIBERS 1000
+
+static atomic_int woken;
+
+static void *wait_for_gate(void *arg, size_t argsz __attribute__((unused)),
+                           size_t *retsz __attribute__((unused))) {
+  int *open = await((future_t *)arg);
+  atomic_fetch_add(&woken, *open);
+  return NULL;
+}
+
+// Every fiber waits for a Future completed by the test only after all of them
+// were spawned; a worker blocked in any of them would never run the others
+static char *test_suspended_fibers() {
+  thread_pool_t pool;
+  fiber_runtime_t runtime;
+  thread_pool_init(&pool, 2);
+  fiber_runtime_init(&runtime, &pool, 16 * 1024);
+  future_t *futures = malloc(sizeof(future_t) * FIBERS);
+
+  for (int round = 0; round < 2; round++) {
+    future_t gate;
+    future_init((callable_t){.function = NULL}, &gate);
+    atomic_store(&woken, 0);
+    for (int i = 0; i < FIBERS; i++) {
+      mu_assert("fiber_spawn failed",
+                fiber_spawn(&runtime, &futures[i],
+                            (callable_t){.function = wait_for_gate,
+                                         .arg = &gate}) == 0);
+    }
+
+    int open = 1;
+    gate.res = &open;
+    future_complete(&gate);
+    for (int i = 0; i < FIBERS; i++) {
+      await(&futures[i]);
+    }
+    mu_assert("expected every fiber to wake up",
+              atomic_load(&woken) == FIBERS);
+  }
+  mu_assert("expected stacks of the first round to be reused",
+            runtime.stack_allocations <= FIBERS);
+
+  thread_pool_destroy(&pool);
+  fiber_runtime_destroy(&runtime);
+  free(futures);
+  return 0;
+}
+
+typedef struct range {
+  fiber_runtime_t *runtime;
+  long begin;
+  long end;
+  long sum;
+} range_t;
+
+static void *fiber_sum(void *arg, size_t argsz __attribute__((unused)),
+                       size_t *retsz __attribute__((unused))) {
+  range_t *range = arg;
+  if (range->end - range->begin <= 16) {
+    range->sum = 0;
+    for (long i = range->begin; i < range->end; i++) {
+      range->sum += i;
+    }
+    return range;
+  }
+
+  long middle = (range->begin + range->end) / 2;
+  range_t halves[2] = {
+      {.runtime = range->runtime, .begin = range->begin, .end = middle},
+      {.runtime = range->runtime, .begin = middle, .end = range->end}};
+  future_t futures[2];
+  for (int i = 0; i < 2; i++) {
+    fiber_spawn(range->runtime, &futures[i],
+                (callable_t){.function = fiber_sum, .arg = &halves[i]});
+  }
+  range->sum = 0;
+  for (int i = 0; i < 2; i++) {
+    range->sum += ((range_t *)await(&futures[i]))->sum;
+  }
+  return range;
+}
+
+static char *test_fiber_fork_join() {
+  thread_pool_t pool;
+  fiber_runtime_t runtime;
+  thread_pool_init(&pool, 2);
+  fiber_runtime_init(&runtime, &pool, 16 * 1024);
+
+  range_t range = {.runtime = &runtime, .begin = 0, .end = 20000};
+  future_t future;
+  fiber_spawn(&runtime, &future,
+              (callable_t){.function = fiber_sum, .arg = &range});
+  range_t *res = await(&future);
+  mu_assert("expected the sum of 0..19999", res->sum == 199990000L);
+
+  thread_pool_destroy(&pool);
+  fiber_runtime_destroy(&runtime);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_fiber_await);
+  mu_run_test(test_suspended_fibers);
+  mu_run_test(test_fiber_fork_join);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ " %s\n", result);
+  } else {
+    printf(__FILE__ " ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
@@ -0,0 +1,191 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "minunit.h"
+#include "parallel.h"
+
+int tests_run = 0;
+
+#define N 100000
+
+static void mark(void *ctx, size_t begin, size_t end) {
+  atomic_int *visits = ctx;
+  for (size_t i = begin; i < end; i++) {
+    atomic_fetch_add(&visits[i], 1);
+  }
+}
+
+static char *test_parallel_for() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 3);
+
+  atomic_int *visits = calloc(N, sizeof(atomic_int));
+  mu_assert("parallel_for failed",
+            parallel_for(&pool, 0, N, 100, mark, visits) == 0);
+  for (size_t i = 0; i < N; i++) {
+    mu_assert("expected every index exactly once", visits[i] == 1);
+  }
+
+  free(visits);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static void sum(void *ctx __attribute__((unused)), size_t begin, size_t end,
+                void *acc) {
+  for (size_t i = begin; i < end; i++) {
+    *(unsigned long long *)acc += i;
+  }
+}
+
+static void add(void *ctx __attribute__((unused)), void *into,
+                const void *from) {
+  *(unsigned long long *)into += *(const unsigned long long *)from;
+}
+
+static char *test_parallel_reduce() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 3);
+
+  unsigned long long res = 0;
+  mu_assert("parallel_reduce failed",
+            parallel_reduce(&pool, 0, N, 1, sum, add, NULL, &res,
+                            sizeof(res)) == 0);
+  mu_assert("expected sum of 0..N-1",
+            res == (unsigned long long)N * (N - 1) / 2);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+// Accumulator that only accepts contiguous ranges merged in order
+typedef struct span {
+  size_t begin;
+  size_t end;
+  int in_order;
+} span_t;
+
+static void extend(void *ctx __attribute__((unused)), size_t begin,
+                   size_t end, void *acc) {
+  span_t *span = acc;
+  if (span->begin == span->end) {
+    span->begin = begin;
+  } else if (span->end != begin) {
+    span->in_order = 0;
+  }
+  span->end = end;
+}
+
+static void concatenate(void *ctx __attribute__((unused)), void *into,
+                        const void *from) {
+  span_t *left = into;
+  const span_t *right = from;
+  if (right->begin == right->end) {
+    return;
+  }
+  if (left->begin == left->end) {
+    *left = *right;
+    return;
+  }
+  left->in_order = left->in_order && right->in_order && left->end == right->begin;
+  left->end = right->end;
+}
+
+static char *test_parallel_reduce_order() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 4);
+
+  span_t span = {.begin = 0, .end = 0, .in_order = 1};
+  parallel_reduce(&pool, 10, N, 7, extend, concatenate, NULL, &span,
+                  sizeof(span));
+  mu_assert("expected partial results combined in index order",
+            span.in_order && span.begin == 10 && span.end == N);
+
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+typedef struct nested {
+  thread_pool_t *pool;
+  atomic_int *visits;
+} nested_t;
+
+static void nested_rows(void *ctx, size_t begin, size_t end) {
+  nested_t *nested = ctx;
+  for (size_t row = begin; row < end; row++) {
+    parallel_for(nested->pool, row * 100, (row + 1) * 100, 1, mark,
+                 nested->visits);
+  }
+}
+
+// Loops started from inside a worker of a single-thread pool
+// can only finish if the caller does all the work itself
+static char *test_nested_single_thread() {
+  thread_pool_t pool;
+  thread_pool_init(&pool, 1);
+
+  atomic_int *visits = calloc(100 * 100, sizeof(atomic_int));
+  nested_t nested = {.pool = &pool, .visits = visits};
+  parallel_for(&pool, 0, 100, 1, nested_rows, &nested);
+  for (size_t i = 0; i < 100 * 100; i++) {
+    mu_assert("expected every index exactly once", visits[i] == 1);
+  }
+
+  free(visits);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+#define FULL_QUEUE_ROUNDS 50
+
+// Pieces that don't fit in a bounded queue stay with whoever split them off
+static char *test_full_queue() {
+  thread_pool_options_t options;
+  thread_pool_options_init(&options);
+  options.queue_capacity = 1;
+  thread_pool_t pool;
+  thread_pool_init_with_options(&pool, 3, &options);
+
+  atomic_int *visits = calloc(N, sizeof(atomic_int));
+  for (int round = 1; round <= FULL_QUEUE_ROUNDS; round++) {
+    mu_assert("parallel_for failed",
+              parallel_for(&pool, 0, N, 100, mark, visits) == 0);
+  }
+  for (size_t i = 0; i < N; i++) {
+    mu_assert("expected every index once per round",
+              visits[i] == FULL_QUEUE_ROUNDS);
+  }
+
+  unsigned long long res = 0;
+  mu_assert("parallel_reduce failed",
+            parallel_reduce(&pool, 0, N, 1, sum, add, NULL, &res,
+                            sizeof(res)) == 0);
+  mu_assert("expected sum of 0..N-1",
+            res == (unsigned long long)N * (N - 1) / 2);
+
+  free(visits);
+  thread_pool_destroy(&pool);
+  return 0;
+}
+
+static char *all_tests() {
+  mu_run_test(test_parallel_for);
+  mu_run_test(test_parallel_reduce);
+  mu_run_test(test_parallel_reduce_order);
+  mu_run_test(test_nested_single_thread);
+  mu_run_test(test_full_queue);
+  return 0;
+}
+
+int main() {
+  char *result = all_tests();
+  if (result != 0) {
+    printf(__FILE__ " %s\n", result);
+  } else {
+    printf(__FILE__ " ALL TESTS PASSED\n");
+  }
+  printf(__FILE__ " Tests run: %d\n", tests_run);
+
+  return result != 0;
+}
@@ -1,111 +1,1680 @@
+#define _GNU_SOURCE // CPU affinity, `sched_getcpu`
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include "threadpool.h"
+#include "topology.h"
+#include "futex.h"
+#include "trace.h"
+
+#define DEFAULT_DEQUE_CAPACITY 1024
+#define DEFAULT_PRIORITY_AGING 32
+#define DEFAULT_GROW_QUEUE_DEPTH 16
+#define DEFAULT_GROW_WAIT_NS 1000000u // 1 ms
+#define DEFAULT_IDLE_TIMEOUT_NS 1000000000u // 1 s
+#define DEFAULT_IDLE_SPINS 4096 // A few microseconds
+#define DEFAULT_IDLE_YIELDS 8
+
+// Bound on jobs nested in `thread_pool_help` on a single worker, so that its stack can't overflow
+// (in SCHEDULER_SHARED_QUEUE mode fork-join recursion nests about as deep as there are pending jobs)
+#define HELP_MAX_DEPTH 1024
+
+// Bounds of the per-worker job slot caches: a worker with an empty cache takes
+// JOB_CACHE_BATCH slots from its node, and gives that many back once it holds JOB_CACHE_LIMIT
+#define JOB_CACHE_BATCH 32
+#define JOB_CACHE_LIMIT (4 * JOB_CACHE_BATCH)
+
+// Number of events the reactor takes from epoll_wait at once
+#define REACTOR_EVENTS 64
+
+// How long the reactor sleeps before trying again to defer jobs that didn't fit in a full queue
+#define REACTOR_RETRY_MS 1
+
+// Worker that runs on the current thread (NULL if the current thread is not a pool worker)
+static _Thread_local pool_worker_t *current_worker = NULL;
+
+// Statements that only update statistics; they disappear without ASYNCC_STATS
+#ifdef ASYNCC_STATS
+#define STATS(stmt) stmt
+#else
+#define STATS(stmt)
+#endif
+
+// Takes a free job slot from the node's free list, allocating a new slab if the list is empty
+// Must be called with `node->mutex` locked
+// Returns NULL on allocation failure
+static job_t *job_alloc_locked(pool_node_t *node) {
+    if (node->free_jobs == NULL) {
+        job_slab_t *slab = (job_slab_t *) calloc(1, sizeof(job_slab_t));
+        if (slab == NULL) {
+            return NULL;
+        }
+        node->job_slab_allocations++;
+        slab->next = node->job_slabs;
+        node->job_slabs = slab;
+
+        for (size_t i = 0; i < JOB_SLAB_SIZE; i++) {
+            slab->jobs[i].node = node->index;
+            slab->jobs[i].next = node->free_jobs;
+            node->free_jobs = &slab->jobs[i];
+        }
+    }
+
+    job_t *job = node->free_jobs;
+    node->free_jobs = job->next;
+    return job;
+}
+
+// Gives job slot back to the node's free list
+// Must be called with `node->mutex` locked
+static void job_free_locked(pool_node_t *node, job_t *job) {
+    job->next = node->free_jobs;
+    node->free_jobs = job;
+}
+
+// Takes a free job slot from the worker's cache, refilling it from its node if it's empty
+// Returns NULL on allocation failure
+static job_t *worker_job_alloc(pool_worker_t *self) {
+    if (self->free_jobs == NULL) {
+        pool_node_t *node = &self->pool->nodes[self->node];
+        silent_on_err(pthread_mutex_lock(&node->mutex));
+        while (self->free_jobs_count < JOB_CACHE_BATCH) {
+            job_t *job = job_alloc_locked(node);
+            if (job == NULL) {
+                break;
+            }
+            job->next = self->free_jobs;
+            self->free_jobs = job;
+            self->free_jobs_count++;
+        }
+        silent_on_err(pthread_mutex_unlock(&node->mutex));
+
+        if (self->free_jobs == NULL) {
+            return NULL;
+        }
+    }
+
+    job_t *job = self->free_jobs;
+    self->free_jobs = job->next;
+    self->free_jobs_count--;
+    return job;
+}
+
+// Gives job slot back to the worker's cache; returns a batch to its node once the cache grows too big
+static void worker_job_free(pool_worker_t *self, job_t *job) {
+    job->next = self->free_jobs;
+    self->free_jobs = job;
+    self->free_jobs_count++;
+
+    if (self->free_jobs_count >= JOB_CACHE_LIMIT) {
+        pool_node_t *node = &self->pool->nodes[self->node];
+        silent_on_err(pthread_mutex_lock(&node->mutex));
+        for (size_t i = 0; i < JOB_CACHE_BATCH; i++) {
+            job_t *surplus = self->free_jobs;
+            self->free_jobs = surplus->next;
+            job_free_locked(node, surplus);
+        }
+        self->free_jobs_count -= JOB_CACHE_BATCH;
+        silent_on_err(pthread_mutex_unlock(&node->mutex));
+    }
+}
+
+// Gives slot of a finished job back: to the worker's cache if it's a slot of the worker's node,
+// otherwise to its own node, so that slots don't pile up on nodes that run more jobs than they defer
+static void release_job(pool_worker_t *self, job_t *job) {
+    if (job->node == self->node) {
+        worker_job_free(self, job);
+        return;
+    }
+    pool_node_t *node = &self->pool->nodes[job->node];
+    silent_on_err(pthread_mutex_lock(&node->mutex));
+    job_free_locked(node, job);
+    silent_on_err(pthread_mutex_unlock(&node->mutex));
+}
+
+// Runs `job` on worker `self`
+static void run_job(pool_worker_t *self __attribute__((unused)), job_t *job) {
+    STATS(uint64_t started_ns = stats_now_ns());
+    TRACE(TRACE_RUN, "job", job->runnable.arg, NULL);
+    job->runnable.function(job->runnable.arg, job->runnable.argsz);
+    TRACE(TRACE_END, "job", job->runnable.arg, NULL);
+
+#ifdef ASYNCC_STATS
+    uint64_t finished_ns = stats_now_ns();
+    stats_add(&self->stats.executed, 1);
+    stats_add(&self->stats.queue_wait_ns, started_ns - job->enqueued_ns);
+    stats_add(&self->stats.run_ns, finished_ns - started_ns);
+    stats_record(self->stats.queue_wait_histogram, started_ns - job->enqueued_ns);
+    stats_record(self->stats.run_histogram, finished_ns - started_ns);
+#endif
+}
+
+void *worker(void *self_);
+
+// Returns whether the number of workers of `pool` can change
+static bool elastic(thread_pool_t *pool) {
+    return pool->min_threads < pool->thread_count;
+}
+
+// Returns whether another worker could help: the pool has a free slot and none of its workers is idle
+static bool can_grow(thread_pool_t *pool) {
+    return atomic_load_explicit(&pool->live_threads, memory_order_relaxed) < pool->thread_count
+           && atomic_load(&pool->idle_count) == 0 && atomic_load(&pool->spinning) == 0;
+}
+
+// Builds the set of CPUs `slot` may run on
+// Returns false if it may run anywhere
+static bool worker_cpus(thread_pool_t *pool, pool_worker_t *slot, cpu_set_t *set) {
+    CPU_ZERO(set);
+    if (slot->cpu >= 0) {
+        CPU_SET(slot->cpu, set);
+        return true;
+    }
+    if (pool->affinity == AFFINITY_NONE && !pool->numa_queues) {
+        return false;
+    }
+    for (size_t i = 0; i < pool->cpu_count; i++) {
+        size_t cpu = (size_t) pool->cpus[i];
+        if (pool->cpu_nodes[cpu] == slot->node) {
+            CPU_SET(cpu, set);
+        }
+    }
+    return true;
+}
+
+// Returns a free worker slot, preferably of node `node`; a slot of a retired worker is reused once its thread
+// is joined
+// Must be called with `workers_mutex` locked
+// Returns NULL if all slots are taken
+static pool_worker_t *free_slot_locked(thread_pool_t *pool, size_t node) {
+    for (int pass = 0; pass < 4; pass++) {
+        worker_state_t state = pass < 2 ? WORKER_EMPTY : WORKER_RETIRED;
+        bool same_node = pass % 2 == 0;
+        for (size_t i = 0; i < pool->thread_count; i++) {
+            pool_worker_t *slot = &pool->workers[i];
+            if (slot->state != state || (same_node && slot->node != node)) {
+                continue;
+            }
+            if (state == WORKER_RETIRED) {
+                // The thread marked itself retired just before returning, so this doesn't wait for long
+                silent_on_err(pthread_join(slot->thread, NULL));
+                slot->state = WORKER_EMPTY;
+            }
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+// Starts a worker thread in a free slot, preferably of node `node`
+// Does nothing if all slots are taken, or if the pool is being destroyed
+// Must be called with `workers_mutex` locked
+// Returns error code, or 0 on success
+static int spawn_worker_locked(thread_pool_t *pool, size_t node) {
+    if (!atomic_load(&pool->keep_working)) {
+        return 0;
+    }
+    pool_worker_t *slot = free_slot_locked(pool, node);
+    if (slot == NULL) {
+        return 0;
+    }
+
+    pthread_attr_t attr;
+    return_on_err(pthread_attr_init(&attr));
+    cpu_set_t cpus;
+    int err = 0;
+    if (worker_cpus(pool, slot, &cpus)) {
+        err = pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+    }
+    if (err == 0) {
+        // Jobs pinned to the slot from now on are taken by the new thread
+        atomic_store(&slot->pinned_open, true);
+        err = pthread_create(&slot->thread, &attr, worker, slot);
+        if (err != 0) {
+            atomic_store(&slot->pinned_open, false);
+        }
+    }
+    silent_on_err(pthread_attr_destroy(&attr));
+    return_on_err(err);
+
+    slot->state = WORKER_RUNNING;
+    atomic_fetch_add_explicit(&pool->live_threads, 1, memory_order_relaxed);
+    return 0;
+}
+
+// Starts another worker, preferably on node `node`, if it could help
+static void grow(thread_pool_t *pool, size_t node) {
+    silent_on_err(pthread_mutex_lock(&pool->workers_mutex));
+    if (can_grow(pool)) {
+        silent_on_err(spawn_worker_locked(pool, node));
+    }
+    silent_on_err(pthread_mutex_unlock(&pool->workers_mutex));
+}
+
+// Starts another worker if `self`'s deque got backlogged while no worker is parked to steal from it
+static void grow_for_deque(pool_worker_t *self) {
+    thread_pool_t *pool = self->pool;
+    if (can_grow(pool) && deque_size(&self->deque) >= pool->grow_queue_depth) {
+        grow(pool, self->node);
+    }
+}
+
+// Computes the time (of CLOCK_MONOTONIC) after which a worker that is idle from now on retires
+static void idle_deadline(thread_pool_t *pool, struct timespec *deadline) {
+    uint64_t at_ns = stats_now_ns() + pool->idle_timeout_ns;
+    deadline->tv_sec = (time_t) (at_ns / 1000000000u);
+    deadline->tv_nsec = (long) (at_ns % 1000000000u);
+}
+
+// Retires worker `self` if the pool still has more than `min_threads` workers and no job is pinned to it:
+// its cached job slots go back to its node, and its slot can be reused
+// The thread must return right after a successful retirement
+// Returns whether the worker retired
+static bool retire(pool_worker_t *self) {
+    thread_pool_t *pool = self->pool;
+    // `defer_on` can't pin a job to the worker until it's decided
+    silent_on_err(pthread_mutex_lock(&self->pinned_mutex));
+    silent_on_err(pthread_mutex_lock(&pool->workers_mutex));
+    bool retire = atomic_load(&pool->keep_working) && queue_empty(self->pinned)
+                  && atomic_load_explicit(&pool->live_threads, memory_order_relaxed) > pool->min_threads;
+    if (retire) {
+        self->state = WORKER_RETIRED;
+        atomic_fetch_sub_explicit(&pool->live_threads, 1, memory_order_relaxed);
+        atomic_store(&self->pinned_open, false);
+    }
+    silent_on_err(pthread_mutex_unlock(&pool->workers_mutex));
+    silent_on_err(pthread_mutex_unlock(&self->pinned_mutex));
+    if (!retire) {
+        return false;
+    }
+
+    pool_node_t *node = &pool->nodes[self->node];
+    silent_on_err(pthread_mutex_lock(&node->mutex));
+    while (self->free_jobs != NULL) {
+        job_t *job = self->free_jobs;
+        self->free_jobs = job->next;
+        job_free_locked(node, job);
+    }
+    silent_on_err(pthread_mutex_unlock(&node->mutex));
+    self->free_jobs_count = 0;
+    self->local_streak = 0;
+    return true;
+}
+
+// Unlocks `node->mutex`, and then starts another worker if `push_job_locked` or `pop_job_locked` asked for it,
+// so that threads deferring to the node don't wait behind `pthread_create`
+// Returns error code, or 0 on success
+static int unlock_node(thread_pool_t *pool, pool_node_t *node) {
+    bool grow_wanted = node->grow_wanted;
+    node->grow_wanted = false;
+    int err = pthread_mutex_unlock(&node->mutex);
+    if (grow_wanted) {
+        grow(pool, node->index);
+    }
+    return err;
+}
+
+// Puts `job` into lane `priority` of the node's part of the shared queue
+// An elastic pool starts another worker if the queue is backlogged and no worker is parked
+// Must be called with `node->mutex` locked; the lock must be released with `unlock_node`
+// Returns error code, or 0 on success
+static int push_job_locked(thread_pool_t *pool, pool_node_t *node, job_t *job, job_priority_t priority) {
+    return_on_err(queue_push(node->jobqueues[priority], job));
+    size_t depth = atomic_fetch_add_explicit(&node->queued, 1, memory_order_relaxed) + 1;
+    if (priority == PRIORITY_HIGH) {
+        atomic_fetch_add_explicit(&pool->urgent_count, 1, memory_order_relaxed);
+    }
+
+    if (elastic(pool)) {
+        if (depth == 1) {
+            node->queue_moved_ns = stats_now_ns();
+        }
+        if (can_grow(pool) && (depth >= pool->grow_queue_depth
+                               || stats_now_ns() - node->queue_moved_ns >= pool->grow_wait_ns)) {
+            node->grow_wanted = true;
+        }
+    }
+    return 0;
+}
+
+// Takes a job from the highest non-empty lane of the node's part of the shared queue, unless some lower lane
+// has been passed over `priority_aging` times, in which case it goes first
+// Must be called with `node->mutex` locked; the lock must be released with `unlock_node`
+// Returns NULL if all lanes are empty
+static job_t *pop_job_locked(thread_pool_t *pool, pool_node_t *node) {
+    size_t chosen = PRIORITY_LANES;
+    for (size_t lane = PRIORITY_LANES; lane-- > 1; ) {
+        if (!queue_empty(node->jobqueues[lane]) && node->lane_skips[lane] >= pool->priority_aging) {
+            chosen = lane;
+            break;
+        }
+    }
+    for (size_t lane = 0; chosen == PRIORITY_LANES && lane < PRIORITY_LANES; lane++) {
+        if (!queue_empty(node->jobqueues[lane])) {
+            chosen = lane;
+        }
+    }
+    if (chosen == PRIORITY_LANES) {
+        return NULL;
+    }
+
+    // Lower lanes that have to wait once more age
+    node->lane_skips[chosen] = 0;
+    for (size_t lane = chosen + 1; lane < PRIORITY_LANES; lane++) {
+        if (!queue_empty(node->jobqueues[lane])) {
+            node->lane_skips[lane]++;
+        }
+    }
+    if (chosen == PRIORITY_HIGH) {
+        atomic_fetch_sub_explicit(&pool->urgent_count, 1, memory_order_relaxed);
+    }
+    job_t *job = queue_pop(node->jobqueues[chosen]);
+    size_t depth = atomic_fetch_sub_explicit(&node->queued, 1, memory_order_relaxed) - 1;
+
+    // There's room for one more job now
+    if (node->space_waiters > 0) {
+        atomic_fetch_add(&node->space_seq, 1);
+        futex_wake(&node->space_seq, 1);
+    }
+
+    // The worker taking a job from a backlogged queue starts another one, so that the pool keeps growing
+    // even when nothing more is deferred
+    if (elastic(pool)) {
+        node->queue_moved_ns = stats_now_ns();
+        if (can_grow(pool) && depth >= pool->grow_queue_depth) {
+            node->grow_wanted = true;
+        }
+    }
+    return job;
+}
+
+// Takes a job from the shared queue: from the part of the worker's own node first, then from other nodes
+// Returns NULL if nothing was found
+static job_t *pop_shared_job(pool_worker_t *self) {
+    thread_pool_t *pool = self->pool;
+    for (size_t i = 0; i < pool->node_count; i++) {
+        pool_node_t *node = &pool->nodes[(self->node + i) % pool->node_count];
+        if (atomic_load_explicit(&node->queued, memory_order_relaxed) == 0) {
+            continue;
+        }
+        silent_on_err(pthread_mutex_lock(&node->mutex));
+        job_t *job = pop_job_locked(pool, node);
+        silent_on_err(unlock_node(pool, node));
+        if (job != NULL) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+// Tries to take a job from other workers' deques, starting from a random victim
+// Returns NULL if nothing was stolen
+static job_t *steal_job(pool_worker_t *self) {
+    thread_pool_t *pool = self->pool;
+    size_t start = (size_t) rand_r(&self->steal_seed) % pool->thread_count;
+
+    for (size_t i = 0; i < pool->thread_count; i++) {
+        pool_worker_t *victim = &pool->workers[(start + i) % pool->thread_count];
+        if (victim == self) {
+            continue;
+        }
+        job_t *job = deque_steal(&victim->deque);
+        if (job != NULL) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+// Takes a job pinned to `self` (see `defer_on`)
+// Returns NULL if there is none
+static job_t *pop_pinned_job(pool_worker_t *self) {
+    if (atomic_load_explicit(&self->pinned_count, memory_order_relaxed) == 0) {
+        return NULL;
+    }
+    silent_on_err(pthread_mutex_lock(&self->pinned_mutex));
+    job_t *job = queue_pop(self->pinned);
+    if (job != NULL) {
+        atomic_fetch_sub(&self->pinned_count, 1);
+    }
+    silent_on_err(pthread_mutex_unlock(&self->pinned_mutex));
+    return job;
+}
+
+// Looks for a job any worker could take: its own deque first, then the shared queue, then other workers' deques
+// (in SCHEDULER_SHARED_QUEUE mode deques hold only jobs of `defer_local`)
+// The shared queue goes first if it holds urgent jobs, or if the worker hasn't looked at it for a while
+// Returns NULL if nothing was found
+static job_t *find_unpinned_job(pool_worker_t *self) {
+    thread_pool_t *pool = self->pool;
+    job_t *job;
+    bool shared_first = atomic_load_explicit(&pool->urgent_count, memory_order_relaxed) > 0
+                        || self->local_streak >= pool->priority_aging;
+    if (!shared_first && (job = deque_pop(&self->deque)) != NULL) {
+        self->local_streak++;
+        return job;
+    }
+
+    self->local_streak = 0;
+    job = pop_shared_job(self);
+    if (job != NULL) {
+        return job;
+    }
+
+    if (shared_first && (job = deque_pop(&self->deque)) != NULL) {
+        self->local_streak++;
+        return job;
+    }
+
+    job = steal_job(self);
+    if (job != NULL) {
+        self->local_streak++;
+    }
+    return job;
+}
+
+// Looks for a job for `self`: jobs pinned to it first (unless the shared queue holds urgent jobs), as no other
+// worker can take them, then the rest (see `find_unpinned_job`)
+// Returns NULL if nothing was found
+static job_t *find_job(pool_worker_t *self) {
+    bool urgent = atomic_load_explicit(&self->pool->urgent_count, memory_order_relaxed) > 0;
+    job_t *job = urgent ? NULL : pop_pinned_job(self);
+    if (job == NULL) {
+        job = find_unpinned_job(self);
+    }
+    if (job == NULL && urgent) {
+        job = pop_pinned_job(self);
+    }
+    return job;
+}
+
+// Returns whether there is any job in the pool waiting to be taken by any worker
+static bool work_visible(thread_pool_t *pool) {
+    for (size_t i = 0; i < pool->node_count; i++) {
+        if (atomic_load(&pool->nodes[i].queued) > 0) {
+            return true;
+        }
+    }
+    for (size_t i = 0; i < pool->thread_count; i++) {
+        if (!deque_empty(&pool->workers[i].deque)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns whether there is any job waiting that worker `self` could take, pinned ones included
+static bool work_visible_to(pool_worker_t *self) {
+    return atomic_load(&self->pinned_count) > 0 || work_visible(self->pool);
+}
+
+// Wakes up at most `count` parked workers of `node`
+// Returns how many of the `count` jobs are left for workers of other nodes
+static size_t signal_node(pool_node_t *node, size_t count) {
+    size_t idle = atomic_load(&node->idle_count);
+    if (idle == 0) {
+        return count;
+    }
+    atomic_fetch_add(&node->wake_seq, 1);
+    futex_wake(&node->wake_seq, count < idle ? (int) count : (int) idle);
+    return count > idle ? count - idle : 0;
+}
+
+// Makes sure that `count` new jobs will be picked up: workers spinning right now take some of them,
+// and for the rest at most that many parked workers are woken up, preferably of node `home`
+// Must be called after the jobs became visible
+static void wake_workers(thread_pool_t *pool, size_t home, size_t count) {
+    // Pairs with the fence of a worker that stops spinning or parks: either it sees the jobs,
+    // or we see it and wake it
+    atomic_thread_fence(memory_order_seq_cst);
+    size_t spinning = atomic_load(&pool->spinning);
+    if (spinning >= count) {
+        return;
+    }
+    count -= spinning;
+    for (size_t i = 0; i < pool->node_count && count > 0; i++) {
+        pool_node_t *node = &pool->nodes[(home + i) % pool->node_count];
+        if (atomic_load(&node->idle_count) > 0) {
+            count = signal_node(node, count);
+        }
+    }
+}
+
+// Executes a single step of the idle policy
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Looks for a job while spinning and then yielding, as `idle_spins` and `idle_yields` allow
+// Returns NULL if nothing was found
+static job_t *spin_for_job(pool_worker_t *self) {
+    thread_pool_t *pool = self->pool;
+    size_t rounds = pool->idle_spins + pool->idle_yields;
+    if (rounds == 0) {
+        return NULL;
+    }
+
+    atomic_fetch_add(&pool->spinning, 1);
+    job_t *job = NULL;
+    for (size_t i = 0; i < rounds && atomic_load_explicit(&pool->keep_working, memory_order_relaxed); i++) {
+        if (i < pool->idle_spins) {
+            cpu_relax();
+        } else {
+            sched_yield();
+        }
+        // A worker that takes a job is not spinning any more; producers and growth of the pool
+        // must not count on it
+        if (work_visible_to(self)) {
+            atomic_fetch_sub(&pool->spinning, 1);
+            job = find_job(self);
+            if (job != NULL) {
+                break;
+            }
+            atomic_fetch_add(&pool->spinning, 1);
+        }
+    }
+    if (job == NULL) {
+        atomic_fetch_sub(&pool->spinning, 1);
+    }
+
+    // Producers counted on us for a single job; if there are more, someone else has to take them
+    if (job != NULL && work_visible(pool)) {
+        wake_workers(pool, self->node, 1);
+    }
+    STATS(if (job != NULL) stats_add(&self->stats.spin_hits, 1));
+    return job;
+}
+
+// Parks worker `self` on its node's futex until new jobs show up (or the pool is being destroyed);
+// a worker above `min_threads` of an elastic pool retires after `idle_timeout_ns` instead
+// Returns whether the worker retired
+static bool park(pool_worker_t *self) {
+    thread_pool_t *pool = self->pool;
+    pool_node_t *node = &pool->nodes[self->node];
+    atomic_store(&self->parked, true);
+    atomic_fetch_add(&node->idle_count, 1);
+    atomic_fetch_add(&pool->idle_count, 1);
+    struct timespec deadline;
+    if (elastic(pool)) {
+        idle_deadline(pool, &deadline);
+    }
+
+    bool retired = false;
+    for (;;) {
+        // `idle_count` (and `parked`) is raised and `wake_seq` read before re-checking the queues, and producers
+        // read them after making jobs visible, so either we see the job or the producer bumps `wake_seq`
+        uint32_t seq = atomic_load(&node->wake_seq);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (!atomic_load(&pool->keep_working) || work_visible_to(self)) {
+            break;
+        }
+        STATS(stats_add(&self->stats.parks, 1));
+        bool may_retire = elastic(pool)
+                          && atomic_load_explicit(&pool->live_threads, memory_order_relaxed) > pool->min_threads;
+        if (!futex_wait_until(&node->wake_seq, seq, may_retire ? &deadline : NULL) && retire(self)) {
+            retired = true;
+            break;
+        }
+    }
+    atomic_fetch_sub(&pool->idle_count, 1);
+    atomic_fetch_sub(&node->idle_count, 1);
+    atomic_store(&self->parked, false);
+
+    // A producer may have woken us just before we retired; pass its job on
+    if (retired && work_visible(pool)) {
+        wake_workers(pool, self->node, 1);
+    }
+    return retired;
+}
+
+// Stops `defer_on` from pinning jobs to worker `self`, which is about to stop, unless some are pinned already
+// Returns whether it did
+static bool close_pinned(pool_worker_t *self) {
+    silent_on_err(pthread_mutex_lock(&self->pinned_mutex));
+    bool closed = queue_empty(self->pinned);
+    if (closed) {
+        atomic_store(&self->pinned_open, false);
+    }
+    silent_on_err(pthread_mutex_unlock(&self->pinned_mutex));
+    return closed;
+}
 
 // This is the function that describes the worker thread
 // On error: silently ignore and hope for the best
 // Always returns NULL
-void *worker(void *parent_pool_) {
-    // Get pointer to the thread pool
-    thread_pool_t *parent_pool = (thread_pool_t *) parent_pool_;
+void *worker(void *self_) {
+    pool_worker_t *self = (pool_worker_t *) self_;
+    thread_pool_t *pool = self->pool;
+    current_worker = self;
+    trace_thread_worker(pool, self->index);
 
-    runnable_t *job;
     for (;;) {
-        // Wait until there is something to do
-        silent_on_err(pthread_mutex_lock(&parent_pool->jobs_mutex));
-        while (queue_empty(parent_pool->jobqueue) && parent_pool->keep_working) {
-            silent_on_err(pthread_cond_wait(&parent_pool->stg_to_do_cond, &parent_pool->jobs_mutex));
+        job_t *job = find_job(self);
+        if (job == NULL) {
+            STATS(stats_add(&self->stats.idle, 1));
+            job = spin_for_job(self);
+        }
+        if (job != NULL) {
+            run_job(self, job);
+            release_job(self, job);
+            continue;
         }
 
-        // "Book" a job (or get NULL if we "got out" on `keep_working` being false)
-        job = queue_pop(parent_pool->jobqueue);
-        silent_on_err(pthread_mutex_unlock(&parent_pool->jobs_mutex));
-
-        if (job == NULL) { // no job -> !`keep_working` -> time to finish work
+        // Nothing found; park until a producer signals new work
+        if (park(self) || (!atomic_load(&pool->keep_working) && !work_visible_to(self) && close_pinned(self))) {
             return NULL;
-        } // else: job was initialised, time to do it
-        job->function(job->arg, job->argsz);
-        free(job); // Job must have been allocated in `defer`
+        }
     }
 }
 
+// Fills `options` with default values (SCHEDULER_SHARED_QUEUE)
+void thread_pool_options_init(thread_pool_options_t *options) {
+    options->scheduler = SCHEDULER_SHARED_QUEUE;
+    options->deque_capacity = DEFAULT_DEQUE_CAPACITY;
+    options->priority_aging = DEFAULT_PRIORITY_AGING;
+    options->max_threads = 0;
+    options->grow_queue_depth = DEFAULT_GROW_QUEUE_DEPTH;
+    options->grow_wait_ns = DEFAULT_GROW_WAIT_NS;
+    options->idle_timeout_ns = DEFAULT_IDLE_TIMEOUT_NS;
+    options->affinity = AFFINITY_NONE;
+    options->cpus = NULL;
+    options->cpu_count = 0;
+    options->numa_queues = false;
+    options->idle_spins = DEFAULT_IDLE_SPINS;
+    options->idle_yields = DEFAULT_IDLE_YIELDS;
+    options->queue_capacity = 0;
+    options->block_when_full = false;
+}
+
 // Initialises the threadpool of `pool_size` threads in memory pointed to by `pool`
 // Returns error code, or 0 on success
 int thread_pool_init(thread_pool_t *pool, size_t pool_size) {
+    return thread_pool_init_with_options(pool, pool_size, NULL);
+}
+
+// Fills `pool->cpus` (in ascending order) with the CPUs workers may run on: from `options`,
+// or those the process may run on
+// Returns error code, or 0 on success
+static int read_cpus(thread_pool_t *pool, const thread_pool_options_t *options) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (options->cpus != NULL) {
+        for (size_t i = 0; i < options->cpu_count; i++) {
+            if (options->cpus[i] < 0 || options->cpus[i] >= CPU_SETSIZE) {
+                return INVALID_CPU_ERROR;
+            }
+            CPU_SET(options->cpus[i], &allowed);
+        }
+    } else {
+        return_on_err(sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == 0 ? 0 : errno);
+    }
+    if (CPU_COUNT(&allowed) == 0) {
+        return INVALID_CPU_ERROR;
+    }
+
+    pool->cpu_count = 0;
+    pool->cpus = (int *) calloc((size_t) CPU_COUNT(&allowed), sizeof(int));
+    if (pool->cpus == NULL) {
+        return MEMORY_ALLOCATION_ERROR;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            pool->cpus[pool->cpu_count++] = cpu;
+        }
+    }
+    return 0;
+}
+
+// Splits `pool->cpus` into nodes of the pool: with `numa_queues` one per NUMA node with some of them,
+// otherwise a single one; then reorders `pool->cpus` so that consecutive CPUs alternate between the nodes
+// Returns error code, or 0 on success
+static int place_nodes(thread_pool_t *pool) {
+    topology_t topology = {.node_count = 1, .cpu_count = 0, .cpu_node = NULL};
+    if (pool->numa_queues) {
+        return_on_err(topology_init(&topology));
+    }
+
+    size_t max_cpu = (size_t) pool->cpus[pool->cpu_count - 1];
+    pool->cpu_node_count = max_cpu + 1 > topology.cpu_count ? max_cpu + 1 : topology.cpu_count;
+    pool->cpu_nodes = (size_t *) calloc(pool->cpu_node_count, sizeof(size_t));
+    size_t *pool_node = (size_t *) calloc(topology.node_count, sizeof(size_t));
+    bool *used = (bool *) calloc(topology.node_count, sizeof(bool));
+    int *ordered = (int *) calloc(pool->cpu_count, sizeof(int));
+    int err = 0;
+    if (pool->cpu_nodes == NULL || pool_node == NULL || used == NULL || ordered == NULL) {
+        err = MEMORY_ALLOCATION_ERROR;
+        goto cleanup;
+    }
+
+    // Number the NUMA nodes with some of the CPUs; CPUs of other nodes count as the first node of the pool
+    // (jobs deferred there are taken by workers of other nodes anyway)
+    for (size_t i = 0; i < pool->cpu_count; i++) {
+        size_t cpu = (size_t) pool->cpus[i];
+        used[cpu < topology.cpu_count ? topology.cpu_node[cpu] : 0] = true;
+    }
+    pool->node_count = 0;
+    for (size_t n = 0; n < topology.node_count; n++) {
+        if (used[n]) {
+            pool_node[n] = pool->node_count++;
+        }
+    }
+    for (size_t cpu = 0; cpu < pool->cpu_node_count; cpu++) {
+        size_t n = cpu < topology.cpu_count ? topology.cpu_node[cpu] : 0;
+        pool->cpu_nodes[cpu] = used[n] ? pool_node[n] : 0;
+    }
+
+    // Workers pinned to CPUs take them in this order, so that a small pool is spread over all nodes
+    size_t count = 0;
+    for (size_t round = 0; count < pool->cpu_count; round++) {
+        for (size_t n = 0; n < pool->node_count; n++) {
+            size_t seen = 0;
+            for (size_t i = 0; i < pool->cpu_count; i++) {
+                if (pool->cpu_nodes[pool->cpus[i]] == n && seen++ == round) {
+                    ordered[count++] = pool->cpus[i];
+                    break;
+                }
+            }
+        }
+    }
+    free(pool->cpus);
+    pool->cpus = ordered;
+    ordered = NULL;
+
+cleanup:
+    free(ordered);
+    free(used);
+    free(pool_node);
+    topology_destroy(&topology);
+    return err;
+}
+
+// Initialises node `index` of a pool in memory pointed to by `node`, with lanes of at most `capacity` jobs
+// (0 means unbounded)
+// Returns error code, or 0 on success
+static int node_init(pool_node_t *node, size_t index, size_t capacity) {
+    memset(node, 0, sizeof(pool_node_t));
+    node->index = index;
+    atomic_init(&node->queued, 0);
+    atomic_init(&node->idle_count, 0);
+    atomic_init(&node->wake_seq, 0);
+    atomic_init(&node->space_seq, 0);
+    return_on_err(pthread_mutex_init(&node->mutex, NULL));
+
+    for (size_t lane = 0; lane < PRIORITY_LANES; lane++) {
+        node->jobqueues[lane] = queue_init(capacity);
+        if (node->jobqueues[lane] == NULL) {
+            return MEMORY_ALLOCATION_ERROR;
+        }
+    }
+    return 0;
+}
+
+// Same as `thread_pool_init`, but with tunables in `options` (NULL means defaults)
+// In an elastic pool `pool_size` is the minimal number of workers
+// Returns error code, or 0 on success
+int thread_pool_init_with_options(thread_pool_t *pool, size_t pool_size, const thread_pool_options_t *options) {
     if (pool == NULL) {
         return NULL_POINTER_ERROR;
     } else if (pool_size == 0) {
         return ZERO_THREADS_ERROR;
     }
 
-    pool->threads = (pthread_t *) calloc(pool_size, sizeof(pthread_t));
-    if (pool->threads == NULL) {
+    thread_pool_options_t defaults;
+    if (options == NULL) {
+        thread_pool_options_init(&defaults);
+        options = &defaults;
+    }
+
+    pool->scheduler = options->scheduler;
+    pool->priority_aging = options->priority_aging > 0 ? options->priority_aging : DEFAULT_PRIORITY_AGING;
+    pool->affinity = options->affinity;
+    pool->numa_queues = options->numa_queues;
+    return_on_err(read_cpus(pool, options));
+    return_on_err(place_nodes(pool));
+
+    // On a single CPU a spinning worker only delays the thread that would give it a job
+    pool->idle_spins = pool->cpu_count > 1 ? options->idle_spins : 0;
+    pool->idle_yields = options->idle_yields;
+    pool->queue_capacity = options->queue_capacity;
+    pool->block_when_full = options->block_when_full;
+
+    // An elastic pool has a slot for every worker it may ever need, so that workers never move
+    size_t slots = options->max_threads > pool_size ? options->max_threads : pool_size;
+
+    // Workers and nodes are cache-line aligned, so plain `calloc` is not enough
+    if (posix_memalign((void **) &pool->workers, 64, slots * sizeof(pool_worker_t)) != 0
+        || posix_memalign((void **) &pool->nodes, 64, pool->node_count * sizeof(pool_node_t)) != 0) {
         return MEMORY_ALLOCATION_ERROR;
     }
-    pool->thread_count = pool_size;
+    memset(pool->workers, 0, slots * sizeof(pool_worker_t));
+    pool->thread_count = slots;
+    pool->min_threads = pool_size;
+    pool->grow_queue_depth = options->grow_queue_depth > 0 ? options->grow_queue_depth : 1;
+    pool->grow_wait_ns = options->grow_wait_ns;
+    pool->idle_timeout_ns = options->idle_timeout_ns;
+    atomic_init(&pool->live_threads, 0);
+    atomic_init(&pool->urgent_count, 0);
+    atomic_init(&pool->idle_count, 0);
+    atomic_init(&pool->spinning, 0);
+    atomic_init(&pool->keep_working, true);
+    return_on_err(pthread_mutex_init(&pool->workers_mutex, NULL));
+
+    atomic_init(&pool->timer_seq, 0);
+    return_on_err(pthread_mutex_init(&pool->timers_mutex, NULL));
+    timer_wheel_init(&pool->timers, 0);
+    pool->timers_start_ns = stats_now_ns();
+    pool->timer_wake_tick = UINT64_MAX;
+    pool->timer_started = false;
+    pool->timers_closed = false;
+    pool->free_delayed_jobs = NULL;
+    pool->delayed_job_allocations = 0;
+
+    pool->reactor_epoll = -1;
+    pool->reactor_wake = -1;
+    return_on_err(pthread_mutex_init(&pool->reactor_mutex, NULL));
+    pool->fd_waits = 0;
+    pool->reactor_started = false;
+    pool->reactor_closed = false;
+    pool->free_fd_waits = NULL;
+    pool->fd_wait_allocations = 0;
+
+    for (size_t i = 0; i < pool->node_count; i++) {
+        return_on_err(node_init(&pool->nodes[i], i, pool->queue_capacity));
+    }
+
+    // Deques are created in SCHEDULER_SHARED_QUEUE mode too, for `defer_local`
+    size_t deque_capacity = options->deque_capacity > 0 ? options->deque_capacity : DEFAULT_DEQUE_CAPACITY;
+    for (size_t i = 0; i < slots; i++) {
+        pool_worker_t *slot = &pool->workers[i];
+        slot->pool = pool;
+        slot->index = i;
+        slot->state = WORKER_EMPTY;
+        slot->steal_seed = (unsigned int) i + 1;
+        if (pool->affinity == AFFINITY_PER_CPU) {
+            slot->cpu = pool->cpus[i % pool->cpu_count];
+            slot->node = pool->cpu_nodes[slot->cpu];
+        } else {
+            slot->cpu = -1;
+            slot->node = i % pool->node_count;
+        }
+        return_on_err(deque_init(&slot->deque, deque_capacity));
+        atomic_init(&slot->pinned_count, 0);
+        atomic_init(&slot->pinned_open, false);
+        atomic_init(&slot->parked, false);
+        return_on_err(pthread_mutex_init(&slot->pinned_mutex, NULL));
+        slot->pinned = queue_init(0);
+        if (slot->pinned == NULL) {
+            return MEMORY_ALLOCATION_ERROR;
+        }
+    }
+
+    int err = 0;
+    silent_on_err(pthread_mutex_lock(&pool->workers_mutex));
+    for (size_t i = 0; i < pool_size && err == 0; i++) {
+        err = spawn_worker_locked(pool, pool->workers[i].node);
+    }
+    silent_on_err(pthread_mutex_unlock(&pool->workers_mutex));
+
+    return err;
+}
+
+// Returns the tick of the timer wheel of `pool` that the current time falls in
+static uint64_t current_tick(thread_pool_t *pool) {
+    return (stats_now_ns() - pool->timers_start_ns) / TIMER_TICK_NS;
+}
+
+// Defers the jobs of due timers in `due`; a job that can't be deferred yet (the pool doesn't block producers
+// and its queue is full) is put back into the wheel to try again at the next tick
+static void fire_timers(thread_pool_t *pool, timer_entry_t *due) {
+    while (due != NULL) {
+        delayed_job_t *delayed = (delayed_job_t *) due; // `entry` goes first
+        due = due->next;
+
+        int err = defer(pool, delayed->runnable);
+        silent_on_err(pthread_mutex_lock(&pool->timers_mutex));
+        if (err != 0) {
+            timer_wheel_insert(&pool->timers, &delayed->entry, pool->timers.now + 1);
+        } else {
+            delayed->entry.next = (timer_entry_t *) pool->free_delayed_jobs;
+            pool->free_delayed_jobs = delayed;
+        }
+        silent_on_err(pthread_mutex_unlock(&pool->timers_mutex));
+    }
+}
 
-    return_on_err(pthread_mutex_init(&pool->jobs_mutex, NULL));
-    return_on_err(pthread_cond_init(&pool->stg_to_do_cond, NULL));
+// Body of the timer thread: sleeps until the next timer is due and defers the jobs of due timers
+static void *timer_thread(void *pool_) {
+    thread_pool_t *pool = (thread_pool_t *) pool_;
+    silent_on_err(pthread_mutex_lock(&pool->timers_mutex));
+    for (;;) {
+        timer_entry_t *due = timer_wheel_advance(&pool->timers, current_tick(pool));
+        if (due != NULL) {
+            silent_on_err(pthread_mutex_unlock(&pool->timers_mutex));
+            fire_timers(pool, due);
+            silent_on_err(pthread_mutex_lock(&pool->timers_mutex));
+            continue;
+        }
+        if (pool->timers_closed && pool->timers.count == 0) {
+            break;
+        }
 
-    pool->keep_working = true;
-    pool->jobqueue = queue_init();
+        // `defer_after` bumps `timer_seq` with the mutex locked, so no new timer can be missed
+        uint64_t tick;
+        bool pending = timer_wheel_next(&pool->timers, &tick);
+        pool->timer_wake_tick = pending ? tick : UINT64_MAX;
+        uint32_t seq = atomic_load(&pool->timer_seq);
+        silent_on_err(pthread_mutex_unlock(&pool->timers_mutex));
+        if (pending) {
+            uint64_t at_ns = pool->timers_start_ns + tick * TIMER_TICK_NS;
+            struct timespec deadline = {.tv_sec = (time_t) (at_ns / 1000000000u),
+                                        .tv_nsec = (long) (at_ns % 1000000000u)};
+            futex_wait_until(&pool->timer_seq, seq, &deadline);
+        } else {
+            futex_wait(&pool->timer_seq, seq);
+        }
+        silent_on_err(pthread_mutex_lock(&pool->timers_mutex));
+    }
+    silent_on_err(pthread_mutex_unlock(&pool->timers_mutex));
+    return NULL;
+}
 
-    for (size_t i = 0; i < pool_size; i++) {
-        return_on_err(pthread_create(&pool->threads[i], NULL, worker, pool));
+// Waits until all delayed jobs of `pool` have been deferred and stops the timer thread
+static void stop_timers(thread_pool_t *pool) {
+    silent_on_err(pthread_mutex_lock(&pool->timers_mutex));
+    pool->timers_closed = true;
+    bool started = pool->timer_started;
+    atomic_fetch_add(&pool->timer_seq, 1);
+    silent_on_err(pthread_mutex_unlock(&pool->timers_mutex));
+    futex_wake(&pool->timer_seq, 1);
+    if (started) {
+        silent_on_err(pthread_join(pool->timer_thread, NULL));
     }
+}
+
+// Wakes the reactor thread of `pool` up
+static void wake_reactor(thread_pool_t *pool) {
+    uint64_t one = 1;
+    silent_on_err(write(pool->reactor_wake, &one, sizeof(one)));
+}
 
+// Job deferred by the reactor: runs the job of `wait`, whose fd is ready, and then releases `wait`
+static void fd_ready(void *arg, size_t argsz __attribute__((unused))) {
+    fd_wait_t *wait = (fd_wait_t *) arg;
+    thread_pool_t *pool = current_worker->pool;
+    wait->runnable.function(wait->runnable.arg, wait->runnable.argsz);
+
+    // Counted until now, so that the reactor outlives a job that waits for its fd again
+    silent_on_err(pthread_mutex_lock(&pool->reactor_mutex));
+    wait->next = pool->free_fd_waits;
+    pool->free_fd_waits = wait;
+    bool last = --pool->fd_waits == 0 && pool->reactor_closed;
+    silent_on_err(pthread_mutex_unlock(&pool->reactor_mutex));
+    if (last) {
+        wake_reactor(pool);
+    }
+}
+
+// Defers the jobs of waits in `ready`, whose fds are ready; returns those that can't be deferred yet
+// (the pool doesn't block producers and its queue is full)
+static fd_wait_t *fire_fd_waits(thread_pool_t *pool, fd_wait_t *ready) {
+    fd_wait_t *rest = NULL;
+    while (ready != NULL) {
+        fd_wait_t *wait = ready;
+        ready = ready->next;
+        if (defer(pool, (runnable_t) {.function = fd_ready, .arg = wait, .argsz = sizeof(fd_wait_t)}) != 0) {
+            wait->next = rest;
+            rest = wait;
+        }
+    }
+    return rest;
+}
+
+// Body of the reactor thread: sleeps until some of the watched fds are ready and defers their jobs
+static void *reactor_thread(void *pool_) {
+    thread_pool_t *pool = (thread_pool_t *) pool_;
+    struct epoll_event events[REACTOR_EVENTS];
+    fd_wait_t *retry = NULL;
+    for (;;) {
+        silent_on_err(pthread_mutex_lock(&pool->reactor_mutex));
+        bool stop = pool->reactor_closed && pool->fd_waits == 0;
+        silent_on_err(pthread_mutex_unlock(&pool->reactor_mutex));
+        if (stop) {
+            break;
+        }
+
+        int count = epoll_wait(pool->reactor_epoll, events, REACTOR_EVENTS, retry != NULL ? REACTOR_RETRY_MS : -1);
+        fd_wait_t *ready = retry;
+        for (int i = 0; i < count; i++) {
+            fd_wait_t *wait = (fd_wait_t *) events[i].data.ptr;
+            if (wait == NULL) {
+                uint64_t value;
+                silent_on_err(read(pool->reactor_wake, &value, sizeof(value)));
+                continue;
+            }
+            // Stop watching before the job runs, so that it can wait for the fd again
+            silent_on_err(epoll_ctl(pool->reactor_epoll, EPOLL_CTL_DEL, wait->fd, NULL));
+            wait->next = ready;
+            ready = wait;
+        }
+        retry = fire_fd_waits(pool, ready);
+    }
+    return NULL;
+}
+
+// Creates the epoll instance and the eventfd of the reactor of `pool` and starts its thread
+// Must be called with `pool->reactor_mutex` locked
+// Returns error code, or 0 on success
+static int start_reactor_locked(thread_pool_t *pool) {
+    int err = 0;
+    pool->reactor_epoll = epoll_create1(EPOLL_CLOEXEC);
+    pool->reactor_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if (pool->reactor_epoll < 0 || pool->reactor_wake < 0
+            || epoll_ctl(pool->reactor_epoll, EPOLL_CTL_ADD, pool->reactor_wake, &event) != 0) {
+        err = errno;
+    } else {
+        err = pthread_create(&pool->reactor_thread, NULL, reactor_thread, pool);
+    }
+    if (err != 0) {
+        if (pool->reactor_epoll >= 0) {
+            close(pool->reactor_epoll);
+        }
+        if (pool->reactor_wake >= 0) {
+            close(pool->reactor_wake);
+        }
+        pool->reactor_epoll = -1;
+        pool->reactor_wake = -1;
+        return err;
+    }
+    pool->reactor_started = true;
     return 0;
 }
 
-// Waits for all jobs to finish and then destroys the pool
+// Waits until all jobs waiting for fds of `pool` have finished and stops the reactor thread
+static void stop_reactor(thread_pool_t *pool) {
+    silent_on_err(pthread_mutex_lock(&pool->reactor_mutex));
+    pool->reactor_closed = true;
+    bool started = pool->reactor_started;
+    silent_on_err(pthread_mutex_unlock(&pool->reactor_mutex));
+    if (started) {
+        wake_reactor(pool);
+        silent_on_err(pthread_join(pool->reactor_thread, NULL));
+        close(pool->reactor_epoll);
+        close(pool->reactor_wake);
+    }
+}
+
+// Waits for all jobs (delayed ones and those waiting for fds too) to finish and then destroys the pool
 // Ignores silently all pthread errors
 // `pool` must not be NULL
 void thread_pool_destroy(thread_pool_t *pool) {
-    silent_on_err(pthread_mutex_lock(&pool->jobs_mutex));
-    pool->keep_working = false;
+    stop_timers(pool);
+    stop_reactor(pool);
 
-    // Signal waiting threads to check that they can stop
-    silent_on_err(pthread_cond_broadcast(&pool->stg_to_do_cond));
-    silent_on_err(pthread_mutex_unlock(&pool->jobs_mutex));
+    silent_on_err(pthread_mutex_lock(&pool->workers_mutex));
+    atomic_store(&pool->keep_working, false);
+    silent_on_err(pthread_mutex_unlock(&pool->workers_mutex));
 
-    // Wait until all workers stop
+    // Wake parked threads to check that they can stop
+    for (size_t i = 0; i < pool->node_count; i++) {
+        atomic_fetch_add(&pool->nodes[i].wake_seq, 1);
+        futex_wake(&pool->nodes[i].wake_seq, INT_MAX);
+    }
+
+    // Wait until all workers stop (including retired ones nobody joined yet);
+    // no worker is started once `keep_working` is false
     for (size_t i = 0; i < pool->thread_count; i++) {
-        silent_on_err(pthread_join(pool->threads[i], NULL));
+        if (pool->workers[i].state != WORKER_EMPTY) {
+            silent_on_err(pthread_join(pool->workers[i].thread, NULL));
+        }
     }
 
     // Free allocated memory
-    silent_on_err(pthread_mutex_destroy(&pool->jobs_mutex));
-    silent_on_err(pthread_cond_destroy(&pool->stg_to_do_cond));
-    queue_destroy(pool->jobqueue);
-    free(pool->threads);
+    silent_on_err(pthread_mutex_destroy(&pool->workers_mutex));
+    silent_on_err(pthread_mutex_destroy(&pool->timers_mutex));
+    while (pool->free_delayed_jobs != NULL) {
+        delayed_job_t *delayed = pool->free_delayed_jobs;
+        pool->free_delayed_jobs = (delayed_job_t *) delayed->entry.next;
+        free(delayed); // allocation in `defer_after`
+    }
+    silent_on_err(pthread_mutex_destroy(&pool->reactor_mutex));
+    while (pool->free_fd_waits != NULL) {
+        fd_wait_t *wait = pool->free_fd_waits;
+        pool->free_fd_waits = wait->next;
+        free(wait); // allocation in `defer_on_readable`
+    }
+    for (size_t i = 0; i < pool->node_count; i++) {
+        pool_node_t *node = &pool->nodes[i];
+        silent_on_err(pthread_mutex_destroy(&node->mutex));
+        for (size_t lane = 0; lane < PRIORITY_LANES; lane++) {
+            queue_destroy(node->jobqueues[lane]);
+        }
+        while (node->job_slabs != NULL) {
+            job_slab_t *slab = node->job_slabs;
+            node->job_slabs = slab->next;
+            free(slab); // allocation in `job_alloc_locked`
+        }
+    }
+    for (size_t i = 0; i < pool->thread_count; i++) {
+        deque_destroy(&pool->workers[i].deque);
+        silent_on_err(pthread_mutex_destroy(&pool->workers[i].pinned_mutex));
+        queue_destroy(pool->workers[i].pinned);
+    }
+    free(pool->workers);
+    free(pool->nodes);
+    free(pool->cpus);
+    free(pool->cpu_nodes);
+}
+
+// Returns the node that jobs deferred by the current thread go to: that of worker `self`,
+// or that of the CPU the thread runs on
+static size_t submit_node(thread_pool_t *pool, pool_worker_t *self) {
+    if (pool->node_count == 1) {
+        return 0;
+    } else if (self != NULL) {
+        return self->node;
+    }
+    int cpu = sched_getcpu();
+    return cpu >= 0 && (size_t) cpu < pool->cpu_node_count ? pool->cpu_nodes[cpu] : 0;
+}
+
+// Waits until the node's part of the shared queue has room for another job, if the pool's capacity is bounded
+// A worker of the pool runs other jobs instead of sleeping, so that a full pool can't deadlock
+// Must be called with `node->mutex` locked; it's unlocked while waiting
+// Returns QUEUE_FULL_ERROR if the queue is full and the caller must not wait, or 0 if there's room
+static int wait_for_space_locked(thread_pool_t *pool, pool_node_t *node, pool_worker_t *self, bool may_wait) {
+    while (pool->queue_capacity > 0
+           && atomic_load_explicit(&node->queued, memory_order_relaxed) >= pool->queue_capacity) {
+        if (!may_wait || !pool->block_when_full) {
+            return QUEUE_FULL_ERROR;
+        }
+
+        if (self != NULL) {
+            silent_on_err(unlock_node(pool, node));
+            if (!thread_pool_help(pool)) {
+                sched_yield();
+            }
+        } else {
+            // Workers taking jobs bump `space_seq` with the mutex locked, so no wake-up can be missed
+            uint32_t seq = atomic_load(&node->space_seq);
+            node->space_waiters++;
+            silent_on_err(unlock_node(pool, node));
+            futex_wait(&node->space_seq, seq);
+            silent_on_err(pthread_mutex_lock(&node->mutex));
+            node->space_waiters--;
+            continue;
+        }
+        silent_on_err(pthread_mutex_lock(&node->mutex));
+    }
+    return 0;
+}
+
+// Common part of `defer_prio`, `try_defer` and `defer_local`; waits for room in a full queue only if `may_wait`,
+// and a job deferred by a worker goes to its deque in SCHEDULER_SHARED_QUEUE mode only if `local`
+// Returns error code, or 0 on success
+static int defer_job(thread_pool_t *pool, runnable_t runnable, job_priority_t priority, bool may_wait, bool local) {
+    if (pool == NULL) {
+        return NULL_POINTER_ERROR;
+    } else if ((unsigned int) priority >= PRIORITY_LANES) {
+        return INVALID_PRIORITY_ERROR;
+    }
+
+    // Jobs deferred by a worker of a work-stealing pool (or with the local hint) go to its own deque (unless
+    // it's full); other priorities always go through the shared queue
+    pool_worker_t *self = current_worker != NULL && current_worker->pool == pool ? current_worker : NULL;
+    if ((pool->scheduler == SCHEDULER_WORK_STEALING || local) && self != NULL && priority == PRIORITY_NORMAL) {
+        job_t *job = worker_job_alloc(self);
+        if (job == NULL) {
+            return MEMORY_ALLOCATION_ERROR;
+        }
+        job->runnable = runnable;
+        STATS(job->enqueued_ns = stats_now_ns());
+
+        if (deque_push(&self->deque, job)) {
+            TRACE(TRACE_ENQUEUE, "job", runnable.arg, NULL);
+            wake_workers(pool, self->node, 1);
+            grow_for_deque(self);
+            return 0;
+        }
+        worker_job_free(self, job);
+    }
+
+    size_t home = submit_node(pool, self);
+    pool_node_t *node = &pool->nodes[home];
+    return_on_err(pthread_mutex_lock(&node->mutex));
+    int err = wait_for_space_locked(pool, node, self, may_wait);
+    if (err != 0) {
+        silent_on_err(pthread_mutex_unlock(&node->mutex));
+        return err;
+    }
+
+    // `runnable` must be moved from this scope's stack to some memory that will be still accessible
+    // when some thread eventually gets to work on it
+    job_t *job = job_alloc_locked(node);
+    if (job == NULL) {
+        return_on_err(pthread_mutex_unlock(&node->mutex));
+        return MEMORY_ALLOCATION_ERROR;
+    }
+    job->runnable = runnable;
+    STATS(job->enqueued_ns = stats_now_ns());
+
+    // Put job into its lane
+    err = push_job_locked(pool, node, job, priority);
+    if (err != 0) {
+        job_free_locked(node, job);
+        silent_on_err(pthread_mutex_unlock(&node->mutex));
+        return err;
+    }
+
+    return_on_err(unlock_node(pool, node));
+    TRACE(TRACE_ENQUEUE, "job", runnable.arg, NULL);
+
+    // Make sure some worker picks the job up, of the same node if possible
+    wake_workers(pool, home, 1);
+    return 0;
 }
 
 // Defers a job described by `runnable` to thread pool in `pool`
 // Returns error code, or 0 on success
 // If running a job encounters an error in pthreads, it silently ignores it
 int defer(thread_pool_t *pool, runnable_t runnable) {
+    return defer_prio(pool, runnable, PRIORITY_NORMAL);
+}
+
+// Same as `defer`, but never waits: fails with QUEUE_FULL_ERROR if a pool with `queue_capacity` has no room
+// Returns error code, or 0 on success
+int try_defer(thread_pool_t *pool, runnable_t runnable) {
+    return defer_job(pool, runnable, PRIORITY_NORMAL, false, false);
+}
+
+// Defers a job described by `runnable` to lane `priority` of thread pool in `pool`
+// Returns error code, or 0 on success
+int defer_prio(thread_pool_t *pool, runnable_t runnable, job_priority_t priority) {
+    return defer_job(pool, runnable, priority, true, false);
+}
+
+// Same as `defer`, but hints that the job should run on the calling worker
+// Returns error code, or 0 on success
+int defer_local(thread_pool_t *pool, runnable_t runnable) {
+    return defer_job(pool, runnable, PRIORITY_NORMAL, true, true);
+}
+
+// Gives job slot `job`, taken for a job that couldn't be deferred, back to where it came from
+static void discard_job(thread_pool_t *pool, pool_worker_t *self, job_t *job) {
+    if (self != NULL) {
+        release_job(self, job);
+        return;
+    }
+    pool_node_t *node = &pool->nodes[job->node];
+    silent_on_err(pthread_mutex_lock(&node->mutex));
+    job_free_locked(node, job);
+    silent_on_err(pthread_mutex_unlock(&node->mutex));
+}
+
+// Defers a job described by `runnable` to worker `worker_index` of `pool`
+// Returns error code (INVALID_WORKER_ERROR if no worker runs in that slot), or 0 on success
+int defer_on(thread_pool_t *pool, size_t worker_index, runnable_t runnable) {
     if (pool == NULL) {
         return NULL_POINTER_ERROR;
+    } else if (worker_index >= pool->thread_count) {
+        return INVALID_WORKER_ERROR;
     }
 
-    return_on_err(pthread_mutex_lock(&pool->jobs_mutex));
-    // `runnable` must be moved from this scope's stack to some memory that will be still accessible
-    // when some thread eventually gets to work on it
-    runnable_t *runnable_ptr = (runnable_t *) calloc(1, sizeof(runnable_t));
-    if (runnable_ptr == NULL) {
-        return_on_err(pthread_mutex_unlock(&pool->jobs_mutex));
+    pool_worker_t *target = &pool->workers[worker_index];
+    pool_node_t *node = &pool->nodes[target->node];
+    pool_worker_t *self = current_worker != NULL && current_worker->pool == pool ? current_worker : NULL;
+    job_t *job;
+    if (self != NULL) {
+        job = worker_job_alloc(self);
+    } else {
+        return_on_err(pthread_mutex_lock(&node->mutex));
+        job = job_alloc_locked(node);
+        silent_on_err(pthread_mutex_unlock(&node->mutex));
+    }
+    if (job == NULL) {
+        return MEMORY_ALLOCATION_ERROR;
+    }
+    job->runnable = runnable;
+    STATS(job->enqueued_ns = stats_now_ns());
+
+    // A worker closes its queue of pinned jobs (once it's empty) before it retires or stops
+    silent_on_err(pthread_mutex_lock(&target->pinned_mutex));
+    int err = atomic_load(&target->pinned_open) ? queue_push(target->pinned, job) : INVALID_WORKER_ERROR;
+    if (err == 0) {
+        atomic_fetch_add(&target->pinned_count, 1);
+    }
+    silent_on_err(pthread_mutex_unlock(&target->pinned_mutex));
+    if (err != 0) {
+        discard_job(pool, self, job);
+        return err;
+    }
+    TRACE(TRACE_ENQUEUE, "job", runnable.arg, NULL);
+
+    // Pairs with the fence in `park`: either the worker sees the job, or we see it parked; workers of a node
+    // sleep on a single futex, so all of them are woken up to make sure it's among them
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&target->parked)) {
+        atomic_fetch_add(&node->wake_seq, 1);
+        futex_wake(&node->wake_seq, INT_MAX);
+    }
+    return 0;
+}
+
+// Defers a job described by `runnable` to thread pool in `pool` once `delay_ns` nanoseconds have passed
+// Returns error code, or 0 on success
+int defer_after(thread_pool_t *pool, runnable_t runnable, uint64_t delay_ns) {
+    if (pool == NULL) {
+        return NULL_POINTER_ERROR;
+    } else if (delay_ns == 0) {
+        return defer(pool, runnable);
+    }
+
+    // Round up, so that the job never runs early
+    uint64_t due_ns = stats_now_ns() + delay_ns - pool->timers_start_ns;
+    uint64_t due = (due_ns + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+
+    return_on_err(pthread_mutex_lock(&pool->timers_mutex));
+    if (pool->timers_closed && (!pool->timer_started || pool->timers.count == 0)) {
+        silent_on_err(pthread_mutex_unlock(&pool->timers_mutex));
+        return CLOSED_POOL_ERROR;
+    }
+    if (!pool->timer_started) {
+        int err = pthread_create(&pool->timer_thread, NULL, timer_thread, pool);
+        if (err != 0) {
+            silent_on_err(pthread_mutex_unlock(&pool->timers_mutex));
+            return err;
+        }
+        pool->timer_started = true;
+    }
+
+    delayed_job_t *delayed = pool->free_delayed_jobs;
+    if (delayed != NULL) {
+        pool->free_delayed_jobs = (delayed_job_t *) delayed->entry.next;
+    } else {
+        delayed = (delayed_job_t *) malloc(sizeof(delayed_job_t));
+        if (delayed == NULL) {
+            silent_on_err(pthread_mutex_unlock(&pool->timers_mutex));
+            return MEMORY_ALLOCATION_ERROR;
+        }
+        pool->delayed_job_allocations++;
+    }
+    delayed->runnable = runnable;
+    timer_wheel_insert(&pool->timers, &delayed->entry, due);
+
+    // Wake the timer thread up only if it sleeps past the new timer
+    bool wake = due < pool->timer_wake_tick;
+    if (wake) {
+        pool->timer_wake_tick = due;
+        atomic_fetch_add(&pool->timer_seq, 1);
+    }
+    silent_on_err(pthread_mutex_unlock(&pool->timers_mutex));
+    if (wake) {
+        futex_wake(&pool->timer_seq, 1);
+    }
+    return 0;
+}
+
+// Defers a job described by `runnable` to thread pool in `pool` once file descriptor `fd` is readable
+// Returns error code, or 0 on success
+int defer_on_readable(thread_pool_t *pool, int fd, runnable_t runnable) {
+    if (pool == NULL) {
+        return NULL_POINTER_ERROR;
+    }
+
+    return_on_err(pthread_mutex_lock(&pool->reactor_mutex));
+    if (pool->reactor_closed && pool->fd_waits == 0) {
+        silent_on_err(pthread_mutex_unlock(&pool->reactor_mutex));
+        return CLOSED_POOL_ERROR;
+    }
+    if (!pool->reactor_started) {
+        int err = start_reactor_locked(pool);
+        if (err != 0) {
+            silent_on_err(pthread_mutex_unlock(&pool->reactor_mutex));
+            return err;
+        }
+    }
+
+    fd_wait_t *wait = pool->free_fd_waits;
+    if (wait != NULL) {
+        pool->free_fd_waits = wait->next;
+    } else {
+        wait = (fd_wait_t *) malloc(sizeof(fd_wait_t));
+        if (wait == NULL) {
+            silent_on_err(pthread_mutex_unlock(&pool->reactor_mutex));
+            return MEMORY_ALLOCATION_ERROR;
+        }
+        pool->fd_wait_allocations++;
+    }
+    wait->fd = fd;
+    wait->runnable = runnable;
+
+    // The job can't finish before it's counted: `fd_ready` needs the mutex to count it out
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = wait};
+    if (epoll_ctl(pool->reactor_epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+        int err = errno;
+        wait->next = pool->free_fd_waits;
+        pool->free_fd_waits = wait;
+        silent_on_err(pthread_mutex_unlock(&pool->reactor_mutex));
+        return err;
+    }
+    pool->fd_waits++;
+    silent_on_err(pthread_mutex_unlock(&pool->reactor_mutex));
+    return 0;
+}
+
+// Defers `n` jobs described by `jobs` to thread pool in `pool` at once
+// All jobs are queued under a single lock acquisition (unless a bounded queue fills up and the pool blocks
+// producers), and only as many workers as can take them are woken up
+// Returns error code, or 0 on success; on error only the jobs before the failing one may have been deferred
+int defer_batch(thread_pool_t *pool, runnable_t *jobs, size_t n) {
+    if (pool == NULL || (jobs == NULL && n > 0)) {
+        return NULL_POINTER_ERROR;
+    }
+
+    size_t deferred = 0;
+    STATS(uint64_t enqueued_ns = stats_now_ns());
+
+    // Jobs deferred by a worker of a work-stealing pool go to its own deque as long as they fit
+    pool_worker_t *self = current_worker != NULL && current_worker->pool == pool ? current_worker : NULL;
+    if (pool->scheduler == SCHEDULER_WORK_STEALING && self != NULL) {
+        for (; deferred < n; deferred++) {
+            job_t *job = worker_job_alloc(self);
+            if (job == NULL) {
+                wake_workers(pool, self->node, deferred);
+                return MEMORY_ALLOCATION_ERROR;
+            }
+            job->runnable = jobs[deferred];
+            STATS(job->enqueued_ns = enqueued_ns);
+            if (!deque_push(&self->deque, job)) {
+                worker_job_free(self, job);
+                break;
+            }
+            TRACE(TRACE_ENQUEUE, "job", job->runnable.arg, NULL);
+        }
+        wake_workers(pool, self->node, deferred);
+        grow_for_deque(self);
+        if (deferred == n) {
+            return 0;
+        }
+    }
+
+    size_t home = submit_node(pool, self);
+    pool_node_t *node = &pool->nodes[home];
+    return_on_err(pthread_mutex_lock(&node->mutex));
+    int err = 0;
+    size_t queued = 0;
+    for (; deferred < n; deferred++, queued++) {
+        // Workers have to know about the jobs queued so far before we wait for them to make room
+        if (pool->queue_capacity > 0 && queued > 0
+            && atomic_load_explicit(&node->queued, memory_order_relaxed) >= pool->queue_capacity) {
+            silent_on_err(unlock_node(pool, node));
+            wake_workers(pool, home, queued);
+            queued = 0;
+            silent_on_err(pthread_mutex_lock(&node->mutex));
+        }
+        err = wait_for_space_locked(pool, node, self, true);
+        if (err != 0) {
+            break;
+        }
+
+        job_t *job = job_alloc_locked(node);
+        if (job == NULL) {
+            err = MEMORY_ALLOCATION_ERROR;
+            break;
+        }
+        job->runnable = jobs[deferred];
+        STATS(job->enqueued_ns = enqueued_ns);
+
+        err = push_job_locked(pool, node, job, PRIORITY_NORMAL);
+        if (err != 0) {
+            job_free_locked(node, job);
+            break;
+        }
+        TRACE(TRACE_ENQUEUE, "job", jobs[deferred].arg, NULL);
+    }
+
+    return_on_err(unlock_node(pool, node));
+
+    // Make sure workers pick the jobs up, of the same node first
+    wake_workers(pool, home, queued);
+    return err;
+}
+
+// Takes a snapshot of statistics of `pool` and writes it to `stats`; release it with `thread_pool_stats_destroy`
+// Can be called at any time, from any thread
+// Returns error code (STATS_DISABLED_ERROR if compiled without ASYNCC_STATS), or 0 on success
+int thread_pool_stats(thread_pool_t *pool, thread_pool_stats_t *stats) {
+    if (pool == NULL || stats == NULL) {
+        return NULL_POINTER_ERROR;
+    }
+#ifndef ASYNCC_STATS
+    return STATS_DISABLED_ERROR;
+#else
+    memset(stats, 0, sizeof(thread_pool_stats_t));
+    stats->workers = (worker_stats_snapshot_t *) calloc(pool->thread_count, sizeof(worker_stats_snapshot_t));
+    if (stats->workers == NULL) {
         return MEMORY_ALLOCATION_ERROR;
     }
-    *runnable_ptr = runnable;
+    stats->worker_count = pool->thread_count;
+    stats->live_workers = atomic_load_explicit(&pool->live_threads, memory_order_relaxed);
 
-    // Put runnable into jobqueue
-    return_on_err(queue_push(pool->jobqueue, runnable_ptr));
+    for (size_t i = 0; i < pool->thread_count; i++) {
+        worker_stats_t *source = &pool->workers[i].stats;
+        worker_stats_snapshot_t *snapshot = &stats->workers[i];
+        snapshot->executed = atomic_load_explicit(&source->executed, memory_order_relaxed);
+        snapshot->idle = atomic_load_explicit(&source->idle, memory_order_relaxed);
+        snapshot->spin_hits = atomic_load_explicit(&source->spin_hits, memory_order_relaxed);
+        snapshot->parks = atomic_load_explicit(&source->parks, memory_order_relaxed);
+        snapshot->queue_wait_ns = atomic_load_explicit(&source->queue_wait_ns, memory_order_relaxed);
+        snapshot->run_ns = atomic_load_explicit(&source->run_ns, memory_order_relaxed);
 
-    // Signal threads waiting for work
-    return_on_err(pthread_cond_signal(&pool->stg_to_do_cond));
+        stats->total.executed += snapshot->executed;
+        stats->total.idle += snapshot->idle;
+        stats->total.spin_hits += snapshot->spin_hits;
+        stats->total.parks += snapshot->parks;
+        stats->total.queue_wait_ns += snapshot->queue_wait_ns;
+        stats->total.run_ns += snapshot->run_ns;
+        for (size_t b = 0; b < STATS_HISTOGRAM_BUCKETS; b++) {
+            stats->queue_wait_histogram[b] +=
+                    atomic_load_explicit(&source->queue_wait_histogram[b], memory_order_relaxed);
+            stats->run_histogram[b] += atomic_load_explicit(&source->run_histogram[b], memory_order_relaxed);
+        }
+
+        stats->queue_depth += deque_size(&pool->workers[i].deque);
+    }
+
+    for (size_t i = 0; i < pool->node_count; i++) {
+        stats->queue_depth += atomic_load_explicit(&pool->nodes[i].queued, memory_order_relaxed);
+    }
 
-    return_on_err(pthread_mutex_unlock(&pool->jobs_mutex));
     return 0;
-}
\ No newline at end of file
+#endif
+}
+
+// Releases memory of a snapshot made by `thread_pool_stats`
+void thread_pool_stats_destroy(thread_pool_stats_t *stats) {
+    free(stats->workers);
+    stats->workers = NULL;
+}
+
+// Returns the pool the calling thread is a worker of, or NULL
+thread_pool_t *thread_pool_current(void) {
+    return current_worker != NULL ? current_worker->pool : NULL;
+}
+
+// Finds the index of the calling thread in `pool->workers` and stores it in `*index`
+// Returns false if the thread is not a worker of `pool`
+bool thread_pool_worker_index(thread_pool_t *pool, size_t *index) {
+    if (pool == NULL || current_worker == NULL || current_worker->pool != pool) {
+        return false;
+    }
+    *index = current_worker->index;
+    return true;
+}
+
+// Runs a single job waiting in `pool` on the calling thread, if it is a worker of `pool`
+// Returns false if the thread is not a worker of `pool`, no job was found, or jobs run this way are nested
+// too deeply already
+bool thread_pool_help(thread_pool_t *pool) {
+    pool_worker_t *self = current_worker;
+    if (pool == NULL || self == NULL || self->pool != pool || self->help_depth >= HELP_MAX_DEPTH) {
+        return false;
+    }
+    job_t *job = find_job(self);
+    if (job == NULL) {
+        return false;
+    }
+
+    self->help_depth++;
+    run_job(self, job);
+    release_job(self, job);
+    self->help_depth--;
+    return true;
+}
+
+// Returns how many workers of `pool` are running now; it changes over time only in an elastic pool
+size_t thread_pool_threads(thread_pool_t *pool) {
+    return atomic_load_explicit(&pool->live_threads, memory_order_relaxed);
+}
+
+// Returns how many heap allocations the pool has made to store deferred jobs so far
+// Job slots, delayed jobs, fd waits and queue nodes are recycled, so the number stops growing once the pool
+// has warmed up
+size_t thread_pool_allocations(thread_pool_t *pool) {
+    size_t res = 0;
+    for (size_t i = 0; i < pool->node_count; i++) {
+        pool_node_t *node = &pool->nodes[i];
+        silent_on_err(pthread_mutex_lock(&node->mutex));
+        res += node->job_slab_allocations;
+        for (size_t lane = 0; lane < PRIORITY_LANES; lane++) {
+            res += node->jobqueues[lane]->allocations;
+        }
+        silent_on_err(pthread_mutex_unlock(&node->mutex));
+    }
+    for (size_t i = 0; i < pool->thread_count; i++) {
+        pool_worker_t *slot = &pool->workers[i];
+        silent_on_err(pthread_mutex_lock(&slot->pinned_mutex));
+        res += slot->pinned->allocations;
+        silent_on_err(pthread_mutex_unlock(&slot->pinned_mutex));
+    }
+    silent_on_err(pthread_mutex_lock(&pool->timers_mutex));
+    res += pool->delayed_job_allocations;
+    silent_on_err(pthread_mutex_unlock(&pool->timers_mutex));
+    silent_on_err(pthread_mutex_lock(&pool->reactor_mutex));
+    res += pool->fd_wait_allocations;
+    silent_on_err(pthread_mutex_unlock(&pool->reactor_mutex));
+    return res;
+}
@@ -3,10 +3,14 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
 #include "err.h"
 #include "queue.h"
+#include "deque.h"
+#include "stats.h"
+#include "timer.h"
 
 // Description of task to be run by a worker in the threadpool
 typedef struct runnable {
@@ -15,21 +19,257 @@ typedef struct runnable {
     size_t argsz;
 } runnable_t;
 
+// Pool-owned storage of a deferred job; job slots are recycled instead of being freed
+typedef struct job {
+    runnable_t runnable;
+    struct job *next; // Link on a free list
+    size_t node; // Node whose free list the slot belongs to
+#ifdef ASYNCC_STATS
+    uint64_t enqueued_ns; // When the job was deferred
+#endif
+} job_t;
+
+// Granularity of the delays of `defer_after`
+#define TIMER_TICK_NS 1000000u // 1 ms
+
+// Job waiting in the timer wheel of a pool until it's due (see `defer_after`)
+typedef struct delayed_job {
+    timer_entry_t entry; // `entry.next` links free ones too
+    runnable_t runnable;
+} delayed_job_t;
+
+// Job waiting in the reactor of a pool until its file descriptor is readable (see `defer_on_readable`)
+typedef struct fd_wait {
+    struct fd_wait *next; // Links free ones, and ready ones whose job couldn't be deferred yet
+    int fd;
+    runnable_t runnable;
+} fd_wait_t;
+
+// Chunk of job slots allocated at once; slabs are freed only by `thread_pool_destroy`
+#define JOB_SLAB_SIZE 64
+typedef struct job_slab {
+    struct job_slab *next;
+    job_t jobs[JOB_SLAB_SIZE];
+} job_slab_t;
+
+// Priority classes of jobs; each has its own lane in the shared queue and workers drain higher lanes first
+typedef enum job_priority {
+    PRIORITY_HIGH = 0, // Latency-sensitive jobs
+    PRIORITY_NORMAL = 1, // Used by `defer`, `async` and `map`
+    PRIORITY_LOW = 2 // Bulk background jobs
+} job_priority_t;
+#define PRIORITY_LANES 3
+
+// How jobs are distributed between the workers
+typedef enum scheduler_mode {
+    SCHEDULER_SHARED_QUEUE = 0, // All jobs go through the shared queue (`jobqueues` of the nodes)
+    SCHEDULER_WORK_STEALING = 1 // Jobs deferred by a worker go to its own deque; idle workers steal from others
+} scheduler_mode_t;
+
+// Where worker threads may run
+typedef enum affinity_mode {
+    AFFINITY_NONE = 0, // Anywhere the OS puts them (but see `numa_queues`)
+    AFFINITY_CPU_SET = 1, // Each worker on any CPU of `cpus`
+    AFFINITY_PER_CPU = 2 // Each worker pinned to a single CPU of `cpus`; with more workers than CPUs, they share
+} affinity_mode_t;
+
+// Tunables of the threadpool; fill with `thread_pool_options_init` and then change what's needed
+typedef struct thread_pool_options {
+    scheduler_mode_t scheduler;
+    // Per-worker deque size; overflow goes to `jobqueues`. In SCHEDULER_SHARED_QUEUE mode only `defer_local` uses
+    // the deques
+    size_t deque_capacity;
+    // Anti-starvation: after this many jobs were taken while a lower lane had jobs waiting, that lane goes first;
+    // a work-stealing worker also looks at the shared lanes after this many jobs from the deques
+    size_t priority_aging;
+
+    // Elastic sizing: with `max_threads` greater than `pool_size`, the pool keeps `pool_size` workers at least
+    // and starts more, up to `max_threads`, while no worker is idle and the jobs waiting in the shared queue
+    // (or in a worker's deque) reach `grow_queue_depth`, or the shared queue doesn't move for `grow_wait_ns`;
+    // workers above `pool_size` retire after `idle_timeout_ns` without jobs. 0 means a fixed-size pool
+    size_t max_threads;
+    size_t grow_queue_depth;
+    uint64_t grow_wait_ns;
+    uint64_t idle_timeout_ns;
+
+    // Placement of workers; `cpus` lists `cpu_count` CPU ids, NULL means the CPUs the process may run on
+    affinity_mode_t affinity;
+    const int *cpus;
+    size_t cpu_count;
+
+    // One part of the shared queue per NUMA node (as described in sysfs) that has some of the CPUs;
+    // workers are spread over the nodes and run only on their node's CPUs, jobs go to the part of the node
+    // they are deferred on, and workers take jobs from their own node first
+    bool numa_queues;
+
+    // Idle policy: a worker that runs out of jobs spins `idle_spins` times (with a pause instruction) and yields
+    // `idle_yields` times, looking for new jobs in between, before it parks on a futex; while some worker spins,
+    // producers don't wake parked ones. Both 0 means parking right away. On a single CPU nothing spins
+    size_t idle_spins;
+    size_t idle_yields;
+
+    // Backpressure: with `queue_capacity` > 0, at most that many jobs wait in the shared queue of each node
+    // (a single node without `numa_queues`); then `try_defer` fails with QUEUE_FULL_ERROR, and so do `defer`
+    // and friends unless `block_when_full` is set, in which case they wait for room
+    // (a worker of the pool runs other jobs meanwhile); jobs in the deques of workers don't count
+    size_t queue_capacity;
+    bool block_when_full;
+} thread_pool_options_t;
+
+struct thread_pool;
+
+// Lifecycle of a worker slot
+typedef enum worker_state {
+    WORKER_EMPTY = 0, // No thread was ever started in the slot
+    WORKER_RUNNING = 1,
+    WORKER_RETIRED = 2 // The thread has retired, but hasn't been joined yet
+} worker_state_t;
+
+// Part of the pool local to a NUMA node: its part of the shared queue, its job slots and its parked workers
+// A pool without `numa_queues` has a single node
+typedef struct pool_node {
+    size_t index; // Position in `pool->nodes`
+
+    // Number of jobs in `jobqueues`; lets workers of other nodes look at them without taking `mutex`
+    _Atomic size_t queued;
+
+    // Number of workers of the node parked on `wake_seq`
+    _Atomic size_t idle_count;
+
+    // Futex word of parked workers of the node; bumped by whoever wakes them
+    _Atomic uint32_t wake_seq;
+
+    // Futex word of producers waiting for room in a full queue; bumped whenever a job is taken
+    _Atomic uint32_t space_seq;
+
+    // Protected by mutex:
+    pthread_mutex_t mutex;
+    size_t space_waiters; // Producers waiting on `space_seq`
+    queue_t *jobqueues[PRIORITY_LANES]; // One lane per `job_priority_t`
+    size_t lane_skips[PRIORITY_LANES]; // Jobs taken from higher lanes while this one had jobs waiting
+    uint64_t queue_moved_ns; // When the queue last became non-empty or had a job taken (elastic pools only)
+    bool grow_wanted; // The pool should start another worker once `mutex` is unlocked (see `unlock_node`)
+    job_t *free_jobs; // Free job slots of the node, shared by all threads
+    job_slab_t *job_slabs; // All job slots of the node ever allocated
+    size_t job_slab_allocations;
+} __attribute__((aligned(64))) pool_node_t;
+
+// State of a single worker thread
+typedef struct pool_worker {
+    pthread_t thread;
+    struct thread_pool *pool;
+    size_t index; // Position in `pool->workers`
+    size_t node; // Position of the worker's node in `pool->nodes`
+    int cpu; // CPU the worker is pinned to (AFFINITY_PER_CPU), or -1
+    worker_state_t state; // Protected by `pool->workers_mutex`
+    unsigned int steal_seed; // State of the PRNG choosing steal victims
+    deque_t deque; // Jobs deferred by this worker (in SCHEDULER_SHARED_QUEUE mode only with `defer_local`)
+
+    // Jobs deferred to this worker alone (see `defer_on`); other workers never take them
+    _Atomic size_t pinned_count;
+    _Atomic bool pinned_open; // Whether a thread runs in the slot and takes pinned jobs; cleared under pinned_mutex
+    _Atomic bool parked; // Whether the worker sleeps on its node's futex, so `defer_on` has to wake it up
+    pthread_mutex_t pinned_mutex;
+    queue_t *pinned; // Protected by pinned_mutex
+
+    // Free job slots (of the worker's node) used only by this worker, so that it doesn't have to lock the node
+    job_t *free_jobs;
+    size_t free_jobs_count;
+
+    size_t local_streak; // Jobs taken from the deques since the shared lanes were last looked at
+    size_t help_depth; // Jobs run by `thread_pool_help` on this worker that haven't finished yet
+
+#ifdef ASYNCC_STATS
+    worker_stats_t stats;
+#endif
+} pool_worker_t;
+
 typedef struct thread_pool {
-    pthread_t *threads;
-    size_t thread_count;
-
-    // Protected by jobs_mutex:
-    pthread_mutex_t jobs_mutex;
-    pthread_cond_t stg_to_do_cond;
-    bool keep_working;
-    queue_t *jobqueue;
+    pool_worker_t *workers;
+    size_t thread_count; // Number of worker slots, i.e. the maximum number of workers
+    pool_node_t *nodes;
+    size_t node_count;
+    scheduler_mode_t scheduler;
+    size_t priority_aging;
+
+    // Placement of workers (see `thread_pool_options_t`)
+    affinity_mode_t affinity;
+    bool numa_queues;
+    int *cpus; // CPUs the workers may run on, alternating between nodes
+    size_t cpu_count;
+    size_t *cpu_nodes; // Node of every CPU id below `cpu_node_count`, for finding the node of a producer
+    size_t cpu_node_count;
+
+    // Elastic sizing (see `thread_pool_options_t`); a fixed-size pool has `min_threads` == `thread_count`
+    size_t min_threads;
+    size_t grow_queue_depth;
+    uint64_t grow_wait_ns;
+    uint64_t idle_timeout_ns;
+
+    // Number of running workers; changed only with `workers_mutex` locked, but read without it
+    _Atomic size_t live_threads;
+
+    // Number of jobs in the PRIORITY_HIGH lanes; lets work-stealing workers notice them without locking nodes
+    _Atomic size_t urgent_count;
+
+    // Number of parked workers of all nodes
+    _Atomic size_t idle_count;
+
+    // Idle policy (see `thread_pool_options_t`) and the number of workers spinning right now
+    size_t idle_spins;
+    size_t idle_yields;
+    _Atomic size_t spinning;
+
+    // Backpressure (see `thread_pool_options_t`)
+    size_t queue_capacity;
+    bool block_when_full;
+
+    // Cleared (with `workers_mutex` locked) when the pool is being destroyed
+    _Atomic bool keep_working;
+
+    // Delayed jobs (see `defer_after`), in a timer wheel serviced by a thread started with the first of them
+    _Atomic uint32_t timer_seq; // Futex word the timer thread sleeps on; bumped to wake it up
+    pthread_t timer_thread;
+    // Protected by timers_mutex:
+    pthread_mutex_t timers_mutex;
+    timer_wheel_t timers; // In ticks of TIMER_TICK_NS since `timers_start_ns`
+    uint64_t timers_start_ns;
+    uint64_t timer_wake_tick; // Tick the timer thread sleeps until; UINT64_MAX if until woken up
+    bool timer_started;
+    bool timers_closed; // Set by `thread_pool_destroy`; the timer thread stops once the wheel is empty
+    delayed_job_t *free_delayed_jobs;
+    size_t delayed_job_allocations;
+
+    // Jobs waiting for file descriptors (see `defer_on_readable`), watched by a reactor thread started with
+    // the first of them; it sleeps in epoll_wait on `reactor_epoll`, and a write to `reactor_wake` (an eventfd)
+    // wakes it up
+    int reactor_epoll;
+    int reactor_wake;
+    pthread_t reactor_thread;
+    // Protected by reactor_mutex:
+    pthread_mutex_t reactor_mutex;
+    size_t fd_waits; // Jobs registered in the reactor, or deferred by it and not finished yet
+    bool reactor_started;
+    bool reactor_closed; // Set by `thread_pool_destroy`; the reactor thread stops once `fd_waits` drops to 0
+    fd_wait_t *free_fd_waits;
+    size_t fd_wait_allocations;
+
+    // Protects `state` of the workers and starting them
+    pthread_mutex_t workers_mutex;
 } thread_pool_t;
 
+// Fills `options` with default values (SCHEDULER_SHARED_QUEUE)
+void thread_pool_options_init(thread_pool_options_t *options);
+
 // Initialises the threadpool of `pool_size` threads in memory pointed to by `pool`
 // Returns error code, or 0 on success
 int thread_pool_init(thread_pool_t *pool, size_t pool_size);
 
+// Same as `thread_pool_init`, but with tunables in `options` (NULL means defaults)
+// In an elastic pool `pool_size` is the minimal number of workers
+// Returns error code, or 0 on success
+int thread_pool_init_with_options(thread_pool_t *pool, size_t pool_size, const thread_pool_options_t *options);
+
 // Waits for all jobs to finish and then destroys the pool (or does its best to do so)
 // Ignores silently all pthread errors
 // `pool` must not be NULL
@@ -40,4 +280,79 @@ void thread_pool_destroy(thread_pool_t *pool);
 // If running a job encounters an error in pthreads, it silently ignores it
 int defer(thread_pool_t *pool, runnable_t runnable);
 
+// Defers a job described by `runnable` to lane `priority` of thread pool in `pool`
+// Returns error code, or 0 on success
+int defer_prio(thread_pool_t *pool, runnable_t runnable, job_priority_t priority);
+
+// Same as `defer`, but never waits: fails with QUEUE_FULL_ERROR if a pool with `queue_capacity` has no room
+// Returns error code, or 0 on success
+int try_defer(thread_pool_t *pool, runnable_t runnable);
+
+// Defers a job described by `runnable` to worker `worker_index` of `pool` (see `thread_pool_worker_index`);
+// no other worker takes it, so jobs working on the same data stay in the caches of a single CPU
+// Pinned jobs bypass the priority lanes and the queue capacity; a worker takes them before anything else
+// except urgent jobs. A parked worker is woken up together with all others of its node
+// Returns error code (INVALID_WORKER_ERROR if no worker runs in that slot), or 0 on success
+int defer_on(thread_pool_t *pool, size_t worker_index, runnable_t runnable);
+
+// Same as `defer`, but hints that the job should run on the calling worker: if the caller is a worker of `pool`,
+// the job goes to its own deque (in either scheduler mode), which it drains newest first before looking
+// elsewhere; an idle worker may still steal it. From other threads it's the same as `defer`
+// Returns error code, or 0 on success
+int defer_local(thread_pool_t *pool, runnable_t runnable);
+
+// Defers a job described by `runnable` to thread pool in `pool` once `delay_ns` nanoseconds have passed
+// (rounded up to TIMER_TICK_NS); until then the job waits in a timer wheel serviced by a single thread
+// of the pool and takes no worker. Delay 0 means `defer`
+// `thread_pool_destroy` waits for delayed jobs as well; after the last one is due, new ones fail with
+// CLOSED_POOL_ERROR
+// Returns error code, or 0 on success
+int defer_after(thread_pool_t *pool, runnable_t runnable, uint64_t delay_ns);
+
+// Defers a job described by `runnable` to thread pool in `pool` once file descriptor `fd` is readable
+// (or hung up, or in error), so that a job doing I/O on a pipe, socket or eventfd doesn't block a worker
+// in `read` while it waits; until then the job waits in an epoll reactor serviced by a single thread of the pool
+// The job runs once per call; each fd can have a single job waiting at a time (EEXIST otherwise), and it must
+// stay open until the job runs. Readiness is only a hint: with several readers of `fd`, open it O_NONBLOCK
+// `thread_pool_destroy` waits for these jobs as well, and a job run this way may wait for its fd again;
+// after the last one has finished, new ones fail with CLOSED_POOL_ERROR
+// Returns error code (errno of epoll_ctl if `fd` can't be watched), or 0 on success
+int defer_on_readable(thread_pool_t *pool, int fd, runnable_t runnable);
+
+// Defers `n` jobs described by `jobs` to thread pool in `pool` at once
+// All jobs are queued under a single lock acquisition (unless a bounded queue fills up and the pool blocks
+// producers), and only as many workers as can take them are woken up
+// Returns error code, or 0 on success; on error only the jobs before the failing one may have been deferred
+int defer_batch(thread_pool_t *pool, runnable_t *jobs, size_t n);
+
+// Takes a snapshot of statistics of `pool` and writes it to `stats`; release it with `thread_pool_stats_destroy`
+// Can be called at any time, from any thread
+// Returns error code (STATS_DISABLED_ERROR if compiled without ASYNCC_STATS), or 0 on success
+int thread_pool_stats(thread_pool_t *pool, thread_pool_stats_t *stats);
+
+// Releases memory of a snapshot made by `thread_pool_stats`
+void thread_pool_stats_destroy(thread_pool_stats_t *stats);
+
+// Returns the pool the calling thread is a worker of, or NULL
+thread_pool_t *thread_pool_current(void);
+
+// Finds the index of the calling thread in `pool->workers` and stores it in `*index`, e.g. for `defer_on`
+// Returns false if the thread is not a worker of `pool`
+bool thread_pool_worker_index(thread_pool_t *pool, size_t *index);
+
+// Runs a single job waiting in `pool` on the calling thread, if it is a worker of `pool`; lets a worker that
+// waits for something (see `await`) make progress instead of blocking
+// Jobs pinned to the worker go first, then its own deque, so a worker takes back what it deferred last
+// Returns false if the thread is not a worker of `pool`, no job was found, or jobs run this way are nested
+// too deeply already
+bool thread_pool_help(thread_pool_t *pool);
+
+// Returns how many workers of `pool` are running now; it changes over time only in an elastic pool
+size_t thread_pool_threads(thread_pool_t *pool);
+
+// Returns how many heap allocations the pool has made to store deferred jobs so far
+// Job slots, delayed jobs, fd waits and queue nodes are recycled, so the number stops growing once the pool
+// has warmed up
+size_t thread_pool_allocations(thread_pool_t *pool);
+
 #endif
@@ -0,0 +1,108 @@
+#include <string.h>
+
+#include "timer.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+// Initialise empty wheel in memory pointed to by `wheel`, starting at tick `now`
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now) {
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->now = now;
+    wheel->count = 0;
+}
+
+// Puts `entry` in its slot, relative to `wheel->now`, without counting it
+static void place(timer_wheel_t *wheel, timer_entry_t *entry) {
+    // The lowest level whose slots, counted from the current one, reach the due tick
+    // (slot 0 of every level is the current one, so a due tick is never placed there)
+    size_t level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1) {
+        unsigned int shift = level * TIMER_WHEEL_SLOT_BITS;
+        if ((entry->due >> shift) - (wheel->now >> shift) < TIMER_WHEEL_SLOTS) {
+            break;
+        }
+        level++;
+    }
+
+    unsigned int shift = level * TIMER_WHEEL_SLOT_BITS;
+    uint64_t slot = entry->due >> shift;
+    if (slot - (wheel->now >> shift) >= TIMER_WHEEL_SLOTS) {
+        slot = (wheel->now >> shift) + TIMER_WHEEL_SLOTS - 1; // Beyond the top level: come back later
+    }
+    timer_entry_t **head = &wheel->slots[level][slot & SLOT_MASK];
+    entry->next = *head;
+    *head = entry;
+}
+
+// Puts `entry` into the wheel to fire at tick `due`
+void timer_wheel_insert(timer_wheel_t *wheel, timer_entry_t *entry, uint64_t due) {
+    entry->due = due > wheel->now ? due : wheel->now + 1;
+    place(wheel, entry);
+    wheel->count++;
+}
+
+// Moves the timers of the current slot of `level` to lower levels, now that the wheel has got to it
+static void cascade(timer_wheel_t *wheel, size_t level) {
+    timer_entry_t **head = &wheel->slots[level][(wheel->now >> (level * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK];
+    timer_entry_t *entry = *head;
+    *head = NULL;
+    while (entry != NULL) {
+        timer_entry_t *next = entry->next;
+        place(wheel, entry);
+        entry = next;
+    }
+}
+
+// Moves the wheel to tick `now` and takes out all timers due by then
+// Returns their list (linked by `next`, in no particular order), or NULL
+timer_entry_t *timer_wheel_advance(timer_wheel_t *wheel, uint64_t now) {
+    // Ticks at which nothing fires nor cascades are skipped
+    timer_entry_t *due = NULL;
+    uint64_t next;
+    while (wheel->now < now && timer_wheel_next(wheel, &next) && next <= now) {
+        wheel->now = next;
+        for (size_t level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if ((wheel->now & (((uint64_t) 1 << (level * TIMER_WHEEL_SLOT_BITS)) - 1)) != 0) {
+                break;
+            }
+            cascade(wheel, level);
+        }
+
+        timer_entry_t **head = &wheel->slots[0][wheel->now & SLOT_MASK];
+        while (*head != NULL) {
+            timer_entry_t *entry = *head;
+            *head = entry->next;
+            entry->next = due;
+            due = entry;
+            wheel->count--;
+        }
+    }
+    if (wheel->now < now) {
+        wheel->now = now;
+    }
+    return due;
+}
+
+// Finds the earliest tick at which `timer_wheel_advance` may return some timers
+// Returns false if the wheel is empty
+bool timer_wheel_next(const timer_wheel_t *wheel, uint64_t *tick) {
+    if (wheel->count == 0) {
+        return false;
+    }
+
+    // Level 0 gives the due tick itself, higher levels the tick their slot cascades at
+    uint64_t earliest = UINT64_MAX;
+    for (size_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        unsigned int shift = level * TIMER_WHEEL_SLOT_BITS;
+        uint64_t current = wheel->now >> shift;
+        for (uint64_t distance = 1; distance < TIMER_WHEEL_SLOTS; distance++) {
+            if (wheel->slots[level][(current + distance) & SLOT_MASK] != NULL) {
+                uint64_t at = (current + distance) << shift;
+                earliest = at < earliest ? at : earliest;
+                break;
+            }
+        }
+    }
+    *tick = earliest;
+    return true;
+}
@@ -0,0 +1,44 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Hierarchical timer wheel: TIMER_WHEEL_LEVELS rings of TIMER_WHEEL_SLOTS slots, where a slot of level `l`
+// spans TIMER_WHEEL_SLOTS^l ticks; a timer sits in the lowest level that reaches its due tick and moves down
+// ("cascades") when the wheel gets near, so inserting and firing a timer is O(1) amortised
+// Times are in ticks of the owner's choice; not thread-safe, the owner locks it
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1u << TIMER_WHEEL_SLOT_BITS)
+
+// Intrusive entry of a timer; embed it in whatever has to happen when it's due
+typedef struct timer_entry {
+    struct timer_entry *next; // Link in a slot, or in the list returned by `timer_wheel_advance`
+    uint64_t due; // Tick the timer fires at
+} timer_entry_t;
+
+typedef struct timer_wheel {
+    uint64_t now; // Last tick the wheel has been advanced to; timers due at or before it have fired
+    size_t count; // Number of timers in the wheel
+    timer_entry_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel_t;
+
+// Initialise empty wheel in memory pointed to by `wheel`, starting at tick `now`
+void timer_wheel_init(timer_wheel_t *wheel, uint64_t now);
+
+// Puts `entry` into the wheel to fire at tick `due`; a tick that has passed already means the next one
+// Timers beyond the reach of the top level wait there and cascade until they are due
+void timer_wheel_insert(timer_wheel_t *wheel, timer_entry_t *entry, uint64_t due);
+
+// Moves the wheel to tick `now` and takes out all timers due by then
+// Returns their list (linked by `next`, in no particular order), or NULL
+timer_entry_t *timer_wheel_advance(timer_wheel_t *wheel, uint64_t now);
+
+// Finds the earliest tick at which `timer_wheel_advance` may return some timers (it may return none,
+// if the timers only cascade then)
+// Returns false if the wheel is empty
+bool timer_wheel_next(const timer_wheel_t *wheel, uint64_t *tick);
+
+#endif //_TIMER_H_
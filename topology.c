@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "topology.h"
+#include "err.h"
+
+#define NODE_DIRECTORY "/sys/devices/system/node"
+#define CPULIST_MAX_LENGTH 4096
+
+// Calls `fn(ctx, cpu)` for every CPU of a list in the sysfs format, e.g. "0-3,8,10-11"
+// Returns false if the list is malformed
+bool topology_parse_cpulist(const char *list, void (*fn)(void *ctx, size_t cpu), void *ctx) {
+    const char *p = list;
+    while (*p != '\0' && *p != '\n') {
+        if (!isdigit((unsigned char) *p)) {
+            return false;
+        }
+        char *end;
+        size_t first = strtoul(p, &end, 10);
+        size_t last = first;
+        p = end;
+        if (*p == '-') {
+            p++;
+            if (!isdigit((unsigned char) *p)) {
+                return false;
+            }
+            last = strtoul(p, &end, 10);
+            p = end;
+        }
+        if (last < first) {
+            return false;
+        }
+
+        for (size_t cpu = first; cpu <= last; cpu++) {
+            fn(ctx, cpu);
+        }
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return true;
+}
+
+static int compare_size(const void *a, const void *b) {
+    size_t x = *(const size_t *) a;
+    size_t y = *(const size_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Reads ids of all NUMA nodes into `*ids` (sorted; free it with `free`)
+// Returns their number; 0 if sysfs doesn't describe any nodes
+static size_t read_node_ids(size_t **ids) {
+    *ids = NULL;
+    DIR *directory = opendir(NODE_DIRECTORY);
+    if (directory == NULL) {
+        return 0;
+    }
+
+    size_t count = 0;
+    size_t capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        size_t id;
+        char rest;
+        if (sscanf(entry->d_name, "node%zu%c", &id, &rest) != 1) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity > 0 ? 2 * capacity : 8;
+            size_t *grown = (size_t *) realloc(*ids, capacity * sizeof(size_t));
+            if (grown == NULL) {
+                break;
+            }
+            *ids = grown;
+        }
+        (*ids)[count++] = id;
+    }
+    closedir(directory);
+
+    qsort(*ids, count, sizeof(size_t), compare_size);
+    return count;
+}
+
+// Reads the list of CPUs of node `id` into `list`; returns false if it can't be read
+static bool read_node_cpulist(size_t id, char *list) {
+    char path[64];
+    snprintf(path, sizeof(path), NODE_DIRECTORY "/node%zu/cpulist", id);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+    bool read = fgets(list, CPULIST_MAX_LENGTH, file) != NULL;
+    fclose(file);
+    return read;
+}
+
+static void note_max_cpu(void *max_, size_t cpu) {
+    size_t *max = (size_t *) max_;
+    if (cpu + 1 > *max) {
+        *max = cpu + 1;
+    }
+}
+
+// Node being assigned to its CPUs by `assign_cpu`
+typedef struct node_assignment {
+    topology_t *topology;
+    size_t node;
+} node_assignment_t;
+
+static void assign_cpu(void *assignment_, size_t cpu) {
+    node_assignment_t *assignment = (node_assignment_t *) assignment_;
+    if (cpu < assignment->topology->cpu_count) { // sysfs could change between reads
+        assignment->topology->cpu_node[cpu] = assignment->node;
+    }
+}
+
+// Reads the topology of the machine into `topology`
+// Return error code, 0 on success
+int topology_init(topology_t *topology) {
+    if (topology == NULL) {
+        return NULL_POINTER_ERROR;
+    }
+
+    char *list = (char *) malloc(CPULIST_MAX_LENGTH);
+    if (list == NULL) {
+        return MEMORY_ALLOCATION_ERROR;
+    }
+    size_t *ids;
+    size_t node_count = read_node_ids(&ids);
+
+    // Find out how many CPU ids there are; nodes whose CPUs can't be read are left out
+    long configured = sysconf(_SC_NPROCESSORS_CONF);
+    size_t cpu_count = configured > 0 ? (size_t) configured : 1;
+    size_t valid = 0;
+    for (size_t i = 0; i < node_count; i++) {
+        if (read_node_cpulist(ids[i], list) && topology_parse_cpulist(list, note_max_cpu, &cpu_count)) {
+            ids[valid++] = ids[i];
+        }
+    }
+    node_count = valid;
+
+    topology->cpu_count = cpu_count;
+    topology->node_count = node_count > 0 ? node_count : 1;
+    topology->cpu_node = (size_t *) calloc(cpu_count, sizeof(size_t)); // CPUs of no node are in the first one
+    if (topology->cpu_node == NULL) {
+        free(ids);
+        free(list);
+        return MEMORY_ALLOCATION_ERROR;
+    }
+
+    for (size_t i = 0; i < node_count; i++) {
+        node_assignment_t assignment = {.topology = topology, .node = i};
+        if (read_node_cpulist(ids[i], list)) {
+            topology_parse_cpulist(list, assign_cpu, &assignment);
+        }
+    }
+
+    free(ids);
+    free(list);
+    return 0;
+}
+
+// Releases memory of `topology`
+void topology_destroy(topology_t *topology) {
+    free(topology->cpu_node);
+    topology->cpu_node = NULL;
+}
@@ -0,0 +1,26 @@
+#ifndef _TOPOLOGY_H_
+#define _TOPOLOGY_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// NUMA topology of the machine, as described in sysfs (/sys/devices/system/node)
+// A machine (or container) without that information is seen as a single node with all configured CPUs
+typedef struct topology {
+    size_t node_count;
+    size_t cpu_count; // CPU ids are below `cpu_count`
+    size_t *cpu_node; // Node of every CPU id, as an index of the node in the order of node ids
+} topology_t;
+
+// Reads the topology of the machine into `topology`
+// Return error code, 0 on success
+int topology_init(topology_t *topology);
+
+// Releases memory of `topology`
+void topology_destroy(topology_t *topology);
+
+// Calls `fn(ctx, cpu)` for every CPU of a list in the sysfs format, e.g. "0-3,8,10-11"
+// Returns false if the list is malformed
+bool topology_parse_cpulist(const char *list, void (*fn)(void *ctx, size_t cpu), void *ctx);
+
+#endif //_TOPOLOGY_H_
@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <errno.h>
+
+#include "trace.h"
+#include "stats.h"
+#include "err.h"
+
+_Atomic bool trace_enabled = false;
+
+// All buffers ever created, newest first; buffers are never freed, so a writer can't see one disappear
+static _Atomic(trace_buffer_t *) buffers = NULL;
+
+// Number of the current session and the capacity of its buffers
+static _Atomic uint32_t session = 0;
+static _Atomic size_t session_capacity = TRACE_DEFAULT_CAPACITY;
+
+// Source of thread numbers in the trace
+static _Atomic size_t next_tid = 0;
+
+// Buffer of the calling thread, and what it runs (see `trace_thread_worker`)
+static _Thread_local trace_buffer_t *thread_buffer = NULL;
+static _Thread_local long thread_worker = -1;
+static _Thread_local const void *thread_pool = NULL;
+
+// Returns the buffer of the calling thread for session `current`, emptying or replacing one of an earlier
+// session; NULL if memory runs out
+static trace_buffer_t *session_buffer(uint32_t current) {
+    trace_buffer_t *buffer = thread_buffer;
+    if (buffer != NULL && atomic_load_explicit(&buffer->session, memory_order_relaxed) == current) {
+        return buffer;
+    }
+
+    size_t capacity = atomic_load_explicit(&session_capacity, memory_order_relaxed);
+    if (buffer == NULL || buffer->capacity != capacity) {
+        buffer = (trace_buffer_t *) malloc(sizeof(trace_buffer_t) + capacity * sizeof(trace_event_t));
+        if (buffer == NULL) {
+            return NULL;
+        }
+        buffer->capacity = capacity;
+        buffer->tid = atomic_fetch_add_explicit(&next_tid, 1, memory_order_relaxed);
+        atomic_init(&buffer->session, current);
+        atomic_init(&buffer->count, 0);
+        atomic_init(&buffer->dropped, 0);
+
+        // Published with release, so that `trace_write` sees the fields above
+        buffer->next = atomic_load_explicit(&buffers, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&buffers, &buffer->next, buffer,
+                                                      memory_order_release, memory_order_relaxed)) {
+        }
+    } else {
+        atomic_store_explicit(&buffer->count, 0, memory_order_relaxed);
+        atomic_store_explicit(&buffer->dropped, 0, memory_order_relaxed);
+        atomic_store_explicit(&buffer->session, current, memory_order_relaxed);
+    }
+    buffer->worker = thread_worker;
+    buffer->pool = thread_pool;
+    thread_buffer = buffer;
+    return buffer;
+}
+
+// Records an event on the calling thread
+void trace_record(trace_phase_t phase, const char *name, const void *id, const void *parent) {
+    trace_buffer_t *buffer = session_buffer(atomic_load_explicit(&session, memory_order_acquire));
+    if (buffer == NULL) {
+        return;
+    }
+
+    // Only this thread writes to the buffer
+    size_t count = atomic_load_explicit(&buffer->count, memory_order_relaxed);
+    if (count == buffer->capacity) {
+        size_t dropped = atomic_load_explicit(&buffer->dropped, memory_order_relaxed);
+        atomic_store_explicit(&buffer->dropped, dropped + 1, memory_order_relaxed);
+        return;
+    }
+    trace_event_t *event = &buffer->events[count];
+    event->ts_ns = stats_now_ns();
+    event->id = id;
+    event->parent = parent;
+    event->name = name;
+    event->phase = phase;
+    atomic_store_explicit(&buffer->count, count + 1, memory_order_release);
+}
+
+// Starts recording events, at most `capacity` of them per thread
+void trace_start(size_t capacity) {
+    atomic_store_explicit(&session_capacity, capacity > 0 ? capacity : TRACE_DEFAULT_CAPACITY,
+                          memory_order_relaxed);
+    atomic_fetch_add_explicit(&session, 1, memory_order_release);
+    atomic_store_explicit(&trace_enabled, true, memory_order_release);
+}
+
+// Stops recording
+void trace_stop(void) {
+    atomic_store_explicit(&trace_enabled, false, memory_order_release);
+}
+
+// Writes a single event of the thread numbered `tid`
+static void write_event(FILE *file, size_t tid, long worker, const trace_event_t *event) {
+    double ts = (double) event->ts_ns / 1000.0; // Chrome wants microseconds
+    switch (event->phase) {
+        case TRACE_ENQUEUE:
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"queue\",\"ph\":\"s\",\"id\":\"%p\",\"ts\":%.3f,"
+                          "\"pid\":1,\"tid\":%zu}", event->name, event->id, ts, tid);
+            return;
+        case TRACE_RUN:
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"queue\",\"ph\":\"f\",\"bp\":\"e\",\"id\":\"%p\","
+                          "\"ts\":%.3f,\"pid\":1,\"tid\":%zu}", event->name, event->id, ts, tid);
+            // fall through
+        case TRACE_START:
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"task\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":1,\"tid\":%zu,"
+                          "\"args\":{\"id\":\"%p\",\"worker\":%ld", event->name, ts, tid, event->id, worker);
+            if (event->parent != NULL) {
+                fprintf(file, ",\"parent\":\"%p\"", event->parent);
+            }
+            fprintf(file, "}}");
+            return;
+        case TRACE_END:
+            fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"task\",\"ph\":\"E\",\"ts\":%.3f,\"pid\":1,\"tid\":%zu}",
+                    event->name, ts, tid);
+            return;
+    }
+}
+
+// Writes all events of the current (or last) session to `file` as Chrome trace-event JSON
+// Returns error code, or 0 on success
+int trace_write(FILE *file) {
+    if (file == NULL) {
+        return NULL_POINTER_ERROR;
+    }
+
+    uint32_t current = atomic_load_explicit(&session, memory_order_acquire);
+    uint64_t dropped = 0;
+    fprintf(file, "{\"traceEvents\":[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+                  "\"args\":{\"name\":\"asyncc\"}}");
+    for (trace_buffer_t *buffer = atomic_load_explicit(&buffers, memory_order_acquire); buffer != NULL;
+         buffer = buffer->next) {
+        if (atomic_load_explicit(&buffer->session, memory_order_relaxed) != current) {
+            continue;
+        }
+
+        if (buffer->worker >= 0) {
+            fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,"
+                          "\"args\":{\"name\":\"worker %ld of pool %p\"}}",
+                    buffer->tid, buffer->worker, buffer->pool);
+        }
+        // A slice that began before the session started has only its end here; it's left out, so that
+        // every "E" matches a "B" of its thread
+        size_t count = atomic_load_explicit(&buffer->count, memory_order_acquire);
+        size_t open = 0;
+        for (size_t i = 0; i < count; i++) {
+            const trace_event_t *event = &buffer->events[i];
+            if (event->phase == TRACE_END) {
+                if (open == 0) {
+                    continue;
+                }
+                open--;
+            } else if (event->phase == TRACE_RUN || event->phase == TRACE_START) {
+                open++;
+            }
+            write_event(file, buffer->tid, buffer->worker, event);
+        }
+        dropped += atomic_load_explicit(&buffer->dropped, memory_order_relaxed);
+    }
+    fprintf(file, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":%llu}}\n",
+            (unsigned long long) dropped);
+
+    if (fflush(file) != 0 || ferror(file)) {
+        return errno != 0 ? errno : EIO;
+    }
+    return 0;
+}
+
+// Tells the tracer that the calling thread is worker `index` of `pool`
+void trace_thread_worker(const void *pool, size_t index) {
+    thread_worker = (long) index;
+    thread_pool = pool;
+    if (thread_buffer != NULL) {
+        thread_buffer->worker = thread_worker;
+        thread_buffer->pool = thread_pool;
+    }
+}
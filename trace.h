@@ -0,0 +1,78 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+// Opt-in tracer of task lifecycles: jobs being deferred, jobs, `async` and `map` callables starting and ending
+// Every thread appends events to its own buffer (a single writer, so no locks and no RMWs); `trace_write` dumps
+// them as Chrome trace-event JSON, to be opened in chrome://tracing or https://ui.perfetto.dev
+// While tracing is off, every trace point costs a single load and a branch predicted not taken
+
+// Buffer size (in events) of a thread, unless `trace_start` says otherwise
+#define TRACE_DEFAULT_CAPACITY 65536
+
+typedef enum trace_phase {
+    TRACE_ENQUEUE = 0, // A job was deferred; starts a flow arrow ending where the job starts
+    TRACE_RUN = 1, // A deferred job started: ends the flow of its TRACE_ENQUEUE and starts a slice
+    TRACE_START = 2, // A callable started: starts a slice
+    TRACE_END = 3 // Ends the slice started last on the thread
+} trace_phase_t;
+
+// Single event; `name` must be a string literal
+typedef struct trace_event {
+    uint64_t ts_ns;
+    const void *id; // Task: the argument of a job, or the Future of a callable
+    const void *parent; // Future whose result a `map` callable takes, or NULL
+    const char *name;
+    trace_phase_t phase;
+} trace_event_t;
+
+// Events of a single thread
+typedef struct trace_buffer {
+    struct trace_buffer *next; // Link on the list of all buffers
+    _Atomic uint32_t session; // `trace_start` call the events belong to
+    size_t tid; // Thread number in the trace
+    long worker; // Index of the worker running on the thread, or -1
+    const void *pool; // Pool of that worker
+    size_t capacity;
+    _Atomic size_t count; // Events written; stored with release after writing an event
+    _Atomic size_t dropped; // Events that didn't fit
+    trace_event_t events[];
+} trace_buffer_t;
+
+// Whether tracing is on; read by the trace points
+extern _Atomic bool trace_enabled;
+
+// Records an event on the calling thread
+void trace_record(trace_phase_t phase, const char *name, const void *id, const void *parent);
+
+// Records an event if tracing is on
+#define TRACE(phase, name, id, parent) \
+    do { \
+        if (__builtin_expect(atomic_load_explicit(&trace_enabled, memory_order_relaxed), 0)) { \
+            trace_record(phase, name, id, parent); \
+        } \
+    } while (0)
+
+// Starts recording events, at most `capacity` of them (0 means TRACE_DEFAULT_CAPACITY) per thread; later
+// events of a thread with a full buffer are dropped. Events of an earlier session are discarded
+// Must not run concurrently with `trace_write`
+void trace_start(size_t capacity);
+
+// Stops recording; the events recorded so far stay for `trace_write`
+void trace_stop(void);
+
+// Writes all events of the current (or last) session to `file` as Chrome trace-event JSON
+// May run while tracing is on (events recorded meanwhile may be left out)
+// Ends of slices that began before `trace_start` (e.g. of a job that was running then) are left out
+// Returns error code, or 0 on success
+int trace_write(FILE *file);
+
+// Tells the tracer that the calling thread is worker `index` of `pool`
+void trace_thread_worker(const void *pool, size_t index);
+
+#endif //_TRACE_H_